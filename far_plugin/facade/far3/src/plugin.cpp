@@ -35,6 +35,7 @@
 #include <plugin/config_data_mapper.h>
 #include <plugin/navigator.h>
 #include <tags.h>
+#include <tags_index_options.h>
 #include <tags_repository_storage.h>
 #include <tags_selector.h>
 #include <tags_viewer.h>
@@ -725,7 +726,8 @@ catch (...)
   throw Error(MFailedLoadConfig, "Config file", fileName);
 }
 
-static auto Storage = Tags::RepositoryStorage::Create();
+// Go to declaration skips repositories which filter of names does not have the name
+static auto Storage = Tags::RepositoryStorage::Create([]() { Tags::IndexOptions options; options.NameFilter = true; options.ResidentMemoryLimit = 256 * 1024 * 1024; options.ChangesCheckInterval = 1000; return options; }());
 
 using Tags::SortingOptions;
 
@@ -761,6 +763,37 @@ static void LoadTags(std::string const& tagsFile, bool silent)
   VisitTags(tagsFile);
 }
 
+// Far API may be used by the main thread only, so calls of other threads are passed to ProcessSynchroEventW
+static void RunOnMainThread(std::function<void()>&& call)
+{
+  I.AdvControl(&PluginGuid, ACTL_SYNCHRO, 0, new std::function<void()>(std::move(call)));
+}
+
+// Tags files renamed aside by reindex, they are removed when repositories replaced by loaded ones do not map them anymore
+static std::vector<WideString> RetiredTagsFiles;
+
+static void RemoveRetiredTagsFiles()
+{
+  RetiredTagsFiles.erase(std::remove_if(RetiredTagsFiles.begin(), RetiredTagsFiles.end(), [](WideString const& file) { return !!::DeleteFileW(file.c_str()); }), RetiredTagsFiles.end());
+}
+
+// Repository loaded before serves lookups until the loaded one replaces it
+static void LoadTagsAsync(std::string const& tagsFile, bool silent)
+{
+  Storage->LoadAsync(tagsFile.c_str(), Tags::RepositoryType::Regular, Tags::IndexProgress(), [tagsFile, silent](int err, size_t symbolsLoaded) {
+    RunOnMainThread([tagsFile, silent, err, symbolsLoaded]() {
+      if (err)
+        throw Error(err == ENOENT ? MEFailedToOpen : MFailedToWriteIndex, "Tags file", tagsFile);
+
+      RemoveRetiredTagsFiles();
+      if (!silent)
+        InfoMessage(GetMsg(MLoadOk) + WideString(L":") + ToString(std::to_string(symbolsLoaded)));
+
+      VisitTags(tagsFile);
+    });
+  });
+}
+
 static void ManualResetCacheCounters(TagInfo const& tag)
 {
   auto info = Storage->GetInfo(tag.Owner->TagsFile.c_str());
@@ -1645,11 +1678,13 @@ static WideString ReindexTagsFile(WideString const& tagsFile)
   if (YesNoCalncelDialog(WideString(GetMsg(MAskReindex)) + L"\n" + reposDir + L"\n" + GetMsg(MProceed)) != YesNoCancel::Yes)
     return WideString();
 
+  // Mapped tags file can be renamed, so loaded repository keeps serving lookups while ctags writes the new one and it is loaded
+  RemoveRetiredTagsFiles();
   auto tempName = RenameToTempFilename(tagsFile);
   if (!SafeCall(TagDirectory, Err, reposDir).first)
     RenameFile(tempName, tagsFile);
   else
-    SafeCall(RemoveFile, Err, tempName);
+    RetiredTagsFiles.push_back(tempName);
 
   return tagsFile;
 }
@@ -1684,7 +1719,12 @@ static void UpdateFileInRepositoryImpl(WideString const& fileName, WideString co
   }
   catch (std::exception const& e)
   {
-    throw Error(MTagsCorrupted, "Error", e.what());
+    // Index of updated tags file is built anew in background
+    std::string const what = e.what();
+    Storage->LoadAsync(repo.TagsPath.c_str(), repo.Type, Tags::IndexProgress(), [what](int err, size_t) {
+      if (err)
+        RunOnMainThread([what]() { throw Error(MTagsCorrupted, "Error", what); });
+    });
   }
 }
 
@@ -1717,7 +1757,13 @@ static WideString ReindexFile(WideString const& fileName)
   auto repo = SelectRepository(std::move(owners));
   bool updated = false;
   if (repo.Type == Tags::RepositoryType::Temporary)
-    updated = (IndexSingleFile(fileName, GetDirOfFile(ToString(repo.TagsPath))), true);
+  {
+    // Loaded repository keeps tags file mapped, release it before ctags rewrites the file
+    Storage->Remove(repo.TagsPath.c_str());
+    IndexSingleFile(fileName, GetDirOfFile(ToString(repo.TagsPath)));
+    LoadTagsImpl(repo.TagsPath, Tags::RepositoryType::Temporary);
+    updated = true;
+  }
   else if (repo.Type != Tags::RepositoryInfo().Type)
     updated = UpdateFileInRepository(fileName, repo);
 
@@ -2059,7 +2105,7 @@ HANDLE WINAPI OpenW(const struct OpenInfo *info)
 
   if(!tagfile.empty())
   {
-    SafeCall(LoadTags, Err, ToStdString(tagfile), false);
+    SafeCall(LoadTagsAsync, Err, ToStdString(tagfile), false);
     return OpenFrom == OPEN_ANALYSE ? PANEL_STOP : nullptr;
   }
 
@@ -2174,6 +2220,17 @@ intptr_t WINAPI ProcessEditorEventW(const struct ProcessEditorEventInfo *info)
   return 0;
 }
 
+intptr_t WINAPI ProcessSynchroEventW(const struct ProcessSynchroEventInfo *info)
+{
+  if (info->Event == SE_COMMONSYNCHRO)
+  {
+    std::unique_ptr<std::function<void()>> call(static_cast<std::function<void()>*>(info->Param));
+    SafeCall(*call, Err);
+  }
+
+  return 0;
+}
+
 void WINAPI ExitFARW(const struct ExitInfo *info)
 {
 }
@@ -0,0 +1,153 @@
+#include "excmd_pattern.h"
+
+#include <string.h>
+
+namespace
+{
+  bool IsSpace(char c)
+  {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+  }
+
+  bool IsLineTerminator(char c)
+  {
+    return c == '\n' || c == '\r';
+  }
+
+  bool IsAlnum(char c)
+  {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+  }
+
+  bool IsEscaped(std::string const& pattern, size_t pos)
+  {
+    size_t backslashes = 0;
+    for (; pos > backslashes && pattern[pos - backslashes - 1] == '\\'; ++backslashes);
+    return backslashes % 2 == 1;
+  }
+}
+
+namespace Tags
+{
+namespace Internal
+{
+  ExcmdPattern::ExcmdPattern(std::string const& pattern)
+    : Valid(!pattern.empty())
+  {
+    if (!Valid || Compile(pattern))
+      return;
+
+    Tokens.clear();
+    try
+    {
+      Regex.reset(new std::regex(pattern));
+    }
+    catch (std::exception const&)
+    {
+      Valid = false;
+    }
+  }
+
+  bool ExcmdPattern::Matches(char const* line) const
+  {
+    if (!Valid)
+      return false;
+
+    return Regex ? std::regex_match(line, *Regex) : Matches(0, line, line + strlen(line));
+  }
+
+  // Returns false if pattern has constructs other than escaped literals, \s* and \s+ runs and trailing .+
+  bool ExcmdPattern::Compile(std::string const& pattern)
+  {
+    size_t pos = pattern.front() == '^' ? 1 : 0;
+    size_t end = pattern.back() == '$' && !IsEscaped(pattern, pattern.length() - 1) ? pattern.length() - 1 : pattern.length();
+    auto addLiteral = [this](char c) {
+      if (Tokens.empty() || Tokens.back().Type != TokenType::Literal)
+        Tokens.push_back(Token{TokenType::Literal, std::string(), 0});
+
+      Tokens.back().Text += c;
+    };
+
+    while (pos < end)
+    {
+      char c = pattern[pos];
+      if (c == '\\')
+      {
+        if (pos + 1 >= end)
+          return false;
+
+        char escaped = pattern[pos + 1];
+        if (escaped == 's' && pos + 2 < end && (pattern[pos + 2] == '*' || pattern[pos + 2] == '+'))
+        {
+          Tokens.push_back(Token{TokenType::Spaces, std::string(), pattern[pos + 2] == '+' ? 1u : 0u});
+          pos += 3;
+        }
+        else if (IsAlnum(escaped))
+        {
+          return false;
+        }
+        else
+        {
+          addLiteral(escaped);
+          pos += 2;
+        }
+      }
+      else if (c == '.' && pos + 2 == end && pattern[pos + 1] == '+')
+      {
+        Tokens.push_back(Token{TokenType::AnyChars, std::string(), 1});
+        pos += 2;
+      }
+      else if (strchr(".$^*()|+[]{}?", c))
+      {
+        return false;
+      }
+      else
+      {
+        addLiteral(c);
+        ++pos;
+      }
+    }
+
+    return true;
+  }
+
+  // Only whitespace runs backtrack, so matching is linear for patterns made from source lines
+  bool ExcmdPattern::Matches(size_t token, char const* cur, char const* end) const
+  {
+    if (token == Tokens.size())
+      return cur == end;
+
+    auto const& current = Tokens[token];
+    switch (current.Type)
+    {
+    case TokenType::Literal:
+      return static_cast<size_t>(end - cur) >= current.Text.length()
+          && !memcmp(cur, current.Text.data(), current.Text.length())
+          && Matches(token + 1, cur + current.Text.length(), end);
+    case TokenType::Spaces:
+    {
+      auto spacesEnd = cur;
+      for (; spacesEnd != end && IsSpace(*spacesEnd); ++spacesEnd);
+      for (; spacesEnd - cur >= static_cast<ptrdiff_t>(current.MinCount); --spacesEnd)
+      {
+        if (Matches(token + 1, spacesEnd, end))
+          return true;
+
+        if (spacesEnd == cur)
+          break;
+      }
+
+      return false;
+    }
+    case TokenType::AnyChars:
+    {
+      auto anyEnd = cur;
+      for (; anyEnd != end && !IsLineTerminator(*anyEnd); ++anyEnd);
+      return anyEnd == end && static_cast<size_t>(end - cur) >= current.MinCount;
+    }
+    }
+
+    return false;
+  }
+}
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <memory>
+#include <regex>
+#include <string>
+#include <vector>
+
+namespace Tags
+{
+namespace Internal
+{
+  // Matches whole line like std::regex_match with pattern of a tag made from ex command.
+  // Such patterns are literals with flexible whitespace and are matched without std::regex,
+  // patterns with other regular expression constructs fall back to it
+  class ExcmdPattern
+  {
+  public:
+    explicit ExcmdPattern(std::string const& pattern);
+
+    bool Matches(char const* line) const;
+
+  private:
+    enum class TokenType
+    {
+      Literal,
+      Spaces,
+      AnyChars,
+    };
+
+    struct Token
+    {
+      TokenType Type;
+      std::string Text;
+      size_t MinCount;
+    };
+
+    bool Compile(std::string const& pattern);
+    bool Matches(size_t token, char const* cur, char const* end) const;
+
+    bool Valid;
+    std::vector<Token> Tokens;
+    std::unique_ptr<std::regex> Regex;
+  };
+}
+}
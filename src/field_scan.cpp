@@ -0,0 +1,238 @@
+#include "field_scan.h"
+
+#include <stdint.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define TAGS_FIELD_SCAN_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(TAGS_FIELD_SCAN_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TAGS_TARGET(isa) __attribute__((target(isa)))
+#else
+#define TAGS_TARGET(isa)
+#endif
+
+// Blocks are read past the terminating character within the same page, sanitizers would report bytes of other objects read
+#if defined(TAGS_FIELD_SCAN_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TAGS_NO_SANITIZE __attribute__((no_sanitize_address, no_sanitize_thread))
+#else
+#define TAGS_NO_SANITIZE
+#endif
+
+namespace
+{
+  bool IsLineEnd(char c)
+  {
+    return !c || c == '\r' || c == '\n';
+  }
+
+  bool IsFieldEnd(char c)
+  {
+    return IsLineEnd(c) || c == '\t';
+  }
+
+  char const* FindFieldEndScalar(char const* str)
+  {
+    for (; !IsFieldEnd(*str); ++str);
+    return str;
+  }
+
+  char const* FindLineEndScalar(char const* str)
+  {
+    for (; !IsLineEnd(*str); ++str);
+    return str;
+  }
+
+  bool IsPathSeparator(char c)
+  {
+    return c == '/' || c == '\\';
+  }
+
+  char FoldCase(char c)
+  {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+  }
+
+  bool IsEqualPrefixChar(char left, char right, bool caseInsensitive, bool stopAtSeparators)
+  {
+    return !IsFieldEnd(left) && (left == right || (caseInsensitive && FoldCase(left) == FoldCase(right))) && (!stopAtSeparators || (!IsPathSeparator(left) && !IsPathSeparator(right)));
+  }
+
+  size_t GetEqualPrefixLengthScalar(char const* left, char const* right, bool caseInsensitive, bool stopAtSeparators)
+  {
+    size_t result = 0;
+    for (; IsEqualPrefixChar(left[result], right[result], caseInsensitive, stopAtSeparators); ++result);
+    return result;
+  }
+
+#ifdef TAGS_FIELD_SCAN_X86
+  unsigned CountTrailingZeros(uint32_t mask)
+  {
+#ifdef _MSC_VER
+    unsigned long result = 0;
+    _BitScanForward(&result, mask);
+    return result;
+#else
+    return __builtin_ctz(mask);
+#endif
+  }
+
+  template <bool Tabs>
+  TAGS_TARGET("sse2") uint32_t GetEndsMask(__m128i block)
+  {
+    auto ends = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_setzero_si128()),
+                _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(block, _mm_set1_epi8('\n'))));
+    return static_cast<uint32_t>(_mm_movemask_epi8(Tabs ? _mm_or_si128(ends, _mm_cmpeq_epi8(block, _mm_set1_epi8('\t'))) : ends));
+  }
+
+  template <bool Tabs>
+  TAGS_TARGET("avx2") uint32_t GetEndsMask(__m256i block)
+  {
+    auto ends = _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_setzero_si256()),
+                _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\r')), _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n'))));
+    return static_cast<uint32_t>(_mm256_movemask_epi8(Tabs ? _mm256_or_si256(ends, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\t'))) : ends));
+  }
+
+  TAGS_TARGET("sse2") __m128i FoldCase(__m128i block)
+  {
+    auto upper = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(block, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(block, _mm_and_si128(upper, _mm_set1_epi8('a' - 'A')));
+  }
+
+  TAGS_TARGET("sse2") uint32_t GetSeparatorsMask(__m128i block)
+  {
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('/')), _mm_cmpeq_epi8(block, _mm_set1_epi8('\\')))));
+  }
+
+  // Unaligned block is loaded only if it does not cross page boundary, otherwise the rest is compared byte by byte
+  bool IsBlockInPage(char const* str)
+  {
+    size_t const pageSize = 4096;
+    return reinterpret_cast<uintptr_t>(str) % pageSize <= pageSize - sizeof(__m128i);
+  }
+
+  TAGS_NO_SANITIZE TAGS_TARGET("sse2") size_t GetEqualPrefixLengthSse2(char const* left, char const* right, bool caseInsensitive, bool stopAtSeparators)
+  {
+    size_t result = 0;
+    for (; IsBlockInPage(left + result) && IsBlockInPage(right + result); result += sizeof(__m128i))
+    {
+      auto leftBlock = _mm_loadu_si128(reinterpret_cast<__m128i const*>(left + result));
+      auto rightBlock = _mm_loadu_si128(reinterpret_cast<__m128i const*>(right + result));
+      auto equal = caseInsensitive ? _mm_cmpeq_epi8(FoldCase(leftBlock), FoldCase(rightBlock)) : _mm_cmpeq_epi8(leftBlock, rightBlock);
+      auto stop = ~static_cast<uint32_t>(_mm_movemask_epi8(equal)) | GetEndsMask<true>(leftBlock);
+      stop |= stopAtSeparators ? GetSeparatorsMask(leftBlock) | GetSeparatorsMask(rightBlock) : 0;
+      if (stop & 0xffff)
+        return result + CountTrailingZeros(stop);
+    }
+
+    return result + GetEqualPrefixLengthScalar(left + result, right + result, caseInsensitive, stopAtSeparators);
+  }
+
+  // Loads are aligned, so they never cross page boundary and never touch memory the terminating character is not in.
+  // Bytes of the first block preceding str are shifted out of the mask
+  template <bool Tabs>
+  TAGS_NO_SANITIZE TAGS_TARGET("sse2") char const* FindEndSse2(char const* str)
+  {
+    auto const offset = reinterpret_cast<uintptr_t>(str) % sizeof(__m128i);
+    auto block = reinterpret_cast<__m128i const*>(str - offset);
+    auto mask = GetEndsMask<Tabs>(_mm_load_si128(block)) >> offset;
+    if (mask)
+      return str + CountTrailingZeros(mask);
+
+    for (++block; !(mask = GetEndsMask<Tabs>(_mm_load_si128(block))); ++block);
+    return reinterpret_cast<char const*>(block) + CountTrailingZeros(mask);
+  }
+
+  template <bool Tabs>
+  TAGS_NO_SANITIZE TAGS_TARGET("avx2") char const* FindEndAvx2(char const* str)
+  {
+    auto const offset = reinterpret_cast<uintptr_t>(str) % sizeof(__m256i);
+    auto block = reinterpret_cast<__m256i const*>(str - offset);
+    auto mask = GetEndsMask<Tabs>(_mm256_load_si256(block)) >> offset;
+    if (mask)
+      return str + CountTrailingZeros(mask);
+
+    for (++block; !(mask = GetEndsMask<Tabs>(_mm256_load_si256(block))); ++block);
+    return reinterpret_cast<char const*>(block) + CountTrailingZeros(mask);
+  }
+
+  bool HasSse2()
+  {
+#if defined(_M_X64) || defined(__x86_64__)
+    return true;
+#elif defined(_MSC_VER)
+    int info[4] = {};
+    __cpuid(info, 1);
+    return !!(info[3] & (1 << 26));
+#else
+    __builtin_cpu_init();
+    return !!__builtin_cpu_supports("sse2");
+#endif
+  }
+
+  // Besides processor support operating system has to save upper halves of ymm registers
+  bool HasAvx2()
+  {
+#ifdef _MSC_VER
+    int info[4] = {};
+    __cpuid(info, 0);
+    if (info[0] < 7)
+      return false;
+
+    __cpuid(info, 1);
+    bool const osSavesYmm = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+    __cpuidex(info, 7, 0);
+    return osSavesYmm && (info[1] & (1 << 5));
+#else
+    __builtin_cpu_init();
+    return !!__builtin_cpu_supports("avx2");
+#endif
+  }
+#endif
+
+  // Selected on first use, so scanning works during initialization of other static objects
+  Tags::Internal::FieldScanner const& GetBestFieldScanner()
+  {
+    static auto const scanner = Tags::Internal::GetFieldScanners().back();
+    return scanner;
+  }
+}
+
+namespace Tags
+{
+namespace Internal
+{
+  char const* FindFieldEnd(char const* str)
+  {
+    return GetBestFieldScanner().FindFieldEnd(str);
+  }
+
+  char const* FindLineEnd(char const* str)
+  {
+    return GetBestFieldScanner().FindLineEnd(str);
+  }
+
+  size_t GetEqualPrefixLength(char const* left, char const* right, bool caseInsensitive, bool stopAtSeparators)
+  {
+    return GetBestFieldScanner().GetEqualPrefixLength(left, right, caseInsensitive, stopAtSeparators);
+  }
+
+  std::vector<FieldScanner> GetFieldScanners()
+  {
+    std::vector<FieldScanner> result = {{"Scalar", &FindFieldEndScalar, &FindLineEndScalar, &GetEqualPrefixLengthScalar}};
+#ifdef TAGS_FIELD_SCAN_X86
+    if (HasSse2())
+      result.push_back({"SSE2", &FindEndSse2<true>, &FindEndSse2<false>, &GetEqualPrefixLengthSse2});
+
+    // Compared fields are mostly shorter than 32 bytes, so wider blocks are used only for scanning
+    if (HasAvx2())
+      result.push_back({"AVX2", &FindEndAvx2<true>, &FindEndAvx2<false>, &GetEqualPrefixLengthSse2});
+#endif
+    return result;
+  }
+}
+}
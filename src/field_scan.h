@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+namespace Tags
+{
+namespace Internal
+{
+  // Returns position of first tab, line end or terminating zero in str
+  char const* FindFieldEnd(char const* str);
+
+  // Returns position of first line end or terminating zero in str
+  char const* FindLineEnd(char const* str);
+
+  // Returns number of leading characters equal in left and right, stops at field end and, if stopAtSeparators, at path separator in either of them.
+  // Only ASCII letters are folded if caseInsensitive, so callers finish comparison of other characters themselves
+  size_t GetEqualPrefixLength(char const* left, char const* right, bool caseInsensitive, bool stopAtSeparators);
+
+  struct FieldScanner
+  {
+    char const* Name;
+    char const* (*FindFieldEnd)(char const* str);
+    char const* (*FindLineEnd)(char const* str);
+    size_t (*GetEqualPrefixLength)(char const* left, char const* right, bool caseInsensitive, bool stopAtSeparators);
+  };
+
+  // Implementations supported by processor starting with byte by byte one, the last one is used by FindFieldEnd and FindLineEnd
+  std::vector<FieldScanner> GetFieldScanners();
+}
+}
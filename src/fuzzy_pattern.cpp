@@ -0,0 +1,141 @@
+#include "fuzzy_pattern.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace
+{
+  int const NoMatch = std::numeric_limits<int>::min() / 2;
+  int const MatchScore = 16;
+  int const NameStartBonus = 12;
+  int const WordStartBonus = 10;
+  int const ConsecutiveBonus = 8;
+  int const SameCaseBonus = 1;
+  int const GapStartPenalty = 3;
+  int const GapExtensionPenalty = 1;
+  int const MaxLeadingPenalty = 6;
+
+  char ToLower(char c)
+  {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+  }
+
+  bool IsLower(char c)
+  {
+    return c >= 'a' && c <= 'z';
+  }
+
+  bool IsUpper(char c)
+  {
+    return c >= 'A' && c <= 'Z';
+  }
+
+  bool IsDigit(char c)
+  {
+    return c >= '0' && c <= '9';
+  }
+
+  bool IsAlnum(char c)
+  {
+    return IsLower(c) || IsUpper(c) || IsDigit(c);
+  }
+
+  // Start of name, character after separator, upper case after lower case and digit after letter
+  int GetPositionBonus(char const* name, size_t pos)
+  {
+    if (!pos)
+      return NameStartBonus;
+
+    char prev = name[pos - 1];
+    char cur = name[pos];
+    if (!IsAlnum(prev))
+      return IsAlnum(cur) ? WordStartBonus : 0;
+
+    return (IsUpper(cur) && !IsUpper(prev)) || (IsDigit(cur) && !IsDigit(prev)) ? WordStartBonus : 0;
+  }
+
+  uint32_t GetCharBit(char c)
+  {
+    c = ToLower(c);
+    return IsLower(c) ? 1u << (c - 'a')
+         : IsDigit(c) ? 1u << (26 + (c - '0') / 2)
+         : c == '_' ? 1u << 31
+         : 0;
+  }
+}
+
+namespace Tags
+{
+namespace Internal
+{
+  FuzzyPattern::FuzzyPattern(std::string const& pattern)
+    : Pattern(pattern)
+    , Signature(GetSignature(pattern.data(), pattern.data() + pattern.length()))
+  {
+  }
+
+  uint32_t FuzzyPattern::GetSignature(char const* name, char const* nameEnd)
+  {
+    uint32_t result = 0;
+    for (; name != nameEnd; ++name)
+      result |= GetCharBit(*name);
+
+    return result;
+  }
+
+  // Scores[i * length + j] is the best score of pattern prefix ending with i-th character matched at j-th character of name,
+  // consecutive characters get at least the bonus of the first character of their run, kept in Bonuses
+  bool FuzzyPattern::Matches(char const* name, char const* nameEnd, int& score) const
+  {
+    size_t const length = nameEnd - name;
+    if (Pattern.empty() || Pattern.length() > length)
+      return false;
+
+    size_t matched = 0;
+    for (size_t j = 0; j < length && matched < Pattern.length(); ++j)
+      matched += ToLower(name[j]) == ToLower(Pattern[matched]) ? 1 : 0;
+
+    if (matched < Pattern.length())
+      return false;
+
+    Scores.assign(Pattern.length() * length, NoMatch);
+    Bonuses.assign(Pattern.length() * length, 0);
+    for (size_t i = 0; i < Pattern.length(); ++i)
+    {
+      auto current = i * length;
+      auto previous = current - (i ? length : 0);
+      int gapped = NoMatch;
+      for (size_t j = i; j < length; ++j)
+      {
+        if (i && j >= 2)
+          gapped = std::max(gapped - GapExtensionPenalty, Scores[previous + j - 2] - GapStartPenalty);
+
+        if (ToLower(name[j]) != ToLower(Pattern[i]))
+          continue;
+
+        auto bonus = GetPositionBonus(name, j);
+        auto caseBonus = name[j] == Pattern[i] ? SameCaseBonus : 0;
+        if (!i)
+        {
+          Scores[current + j] = MatchScore + bonus + caseBonus - std::min(static_cast<int>(j), MaxLeadingPenalty);
+          Bonuses[current + j] = bonus;
+          continue;
+        }
+
+        auto runBonus = std::max(std::max(bonus, Bonuses[previous + j - 1]), ConsecutiveBonus);
+        auto consecutive = Scores[previous + j - 1] == NoMatch ? NoMatch : Scores[previous + j - 1] + runBonus;
+        auto afterGap = gapped <= NoMatch / 2 ? NoMatch : gapped + bonus;
+        if (consecutive == NoMatch && afterGap == NoMatch)
+          continue;
+
+        Scores[current + j] = std::max(consecutive, afterGap) + MatchScore + caseBonus;
+        Bonuses[current + j] = consecutive >= afterGap ? std::max(bonus, Bonuses[previous + j - 1]) : bonus;
+      }
+    }
+
+    auto last = Scores.begin() + (Pattern.length() - 1) * length;
+    score = *std::max_element(last, last + length);
+    return score > NoMatch / 2;
+  }
+}
+}
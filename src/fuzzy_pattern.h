@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace Tags
+{
+namespace Internal
+{
+  // Matches name if characters of pattern appear in it in the same order ignoring case, like "gmti" in "GetMatchedTagsImpl".
+  // Score of match is higher for characters starting words of camelCase or underscore separated names and for consecutive characters
+  class FuzzyPattern
+  {
+  public:
+    explicit FuzzyPattern(std::string const& pattern);
+
+    bool Matches(char const* name, char const* nameEnd, int& score) const;
+
+    // Bits of characters used in the pattern, name may match only if its signature contains them
+    uint32_t GetSignature() const
+    {
+      return Signature;
+    }
+
+    static uint32_t GetSignature(char const* name, char const* nameEnd);
+
+  private:
+    std::string Pattern;
+    uint32_t Signature;
+    mutable std::vector<int> Scores;
+    mutable std::vector<int> Bonuses;
+  };
+}
+}
@@ -0,0 +1,221 @@
+#include "mapped_file.h"
+
+#include <new>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+#if defined _WIN32
+#include <atomic>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+  class MappedFileImpl : public Tags::Internal::MappedFile
+  {
+  public:
+    MappedFileImpl(char const* data, size_t size)
+      : Begin(data)
+      , Length(size)
+    {
+    }
+
+    ~MappedFileImpl() override
+    {
+      if (Begin)
+        Unmap();
+    }
+
+    char const* Data() const override
+    {
+      return Begin;
+    }
+
+    size_t Size() const override
+    {
+      return Length;
+    }
+
+  private:
+    void Unmap();
+
+    char const* Begin;
+    size_t Length;
+  };
+
+  // Content is zero terminated like mapped files padded by page size
+  class LoadedFileImpl : public Tags::Internal::MappedFile
+  {
+  public:
+    explicit LoadedFileImpl(std::string&& content)
+      : Content(std::move(content))
+    {
+    }
+
+    char const* Data() const override
+    {
+      return Content.empty() ? nullptr : Content.data();
+    }
+
+    size_t Size() const override
+    {
+      return Content.size();
+    }
+
+  private:
+    std::string Content;
+  };
+
+  std::shared_ptr<Tags::Internal::MappedFile> Load(char const* path)
+  {
+    std::shared_ptr<FILE> file(fopen(path, "rb"), [](FILE* f) { if (f) fclose(f); });
+    if (!file)
+      return std::shared_ptr<Tags::Internal::MappedFile>();
+
+    std::string content;
+    char buffer[64 * 1024];
+    try
+    {
+      for (size_t read; (read = fread(buffer, 1, sizeof(buffer), file.get())) > 0;)
+        content.append(buffer, read);
+    }
+    catch (std::bad_alloc const&)
+    {
+      return std::shared_ptr<Tags::Internal::MappedFile>();
+    }
+
+    return ferror(file.get()) ? std::shared_ptr<Tags::Internal::MappedFile>() : std::make_shared<LoadedFileImpl>(std::move(content));
+  }
+
+#if defined _WIN32
+  void MappedFileImpl::Unmap()
+  {
+    UnmapViewOfFile(Begin);
+  }
+
+  std::shared_ptr<Tags::Internal::MappedFile> Map(char const* path)
+  {
+    auto file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+      return std::shared_ptr<Tags::Internal::MappedFile>();
+
+    std::shared_ptr<void> fileCloser(file, CloseHandle);
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || static_cast<uint64_t>(size.QuadPart) > SIZE_MAX)
+      return std::shared_ptr<Tags::Internal::MappedFile>();
+
+    if (!size.QuadPart)
+      return std::make_shared<MappedFileImpl>(nullptr, 0);
+
+    auto mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping)
+      return std::shared_ptr<Tags::Internal::MappedFile>();
+
+    std::shared_ptr<void> mappingCloser(mapping, CloseHandle);
+    auto data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    return !data ? std::shared_ptr<Tags::Internal::MappedFile>() : std::make_shared<MappedFileImpl>(static_cast<char const*>(data), static_cast<size_t>(size.QuadPart));
+  }
+
+  std::string const RetiredSuffix = ".retired";
+
+  // Removes targets moved aside by previous publishes, the ones still mapped are left for the next publish
+  void RemoveRetired(char const* target)
+  {
+    std::string const name(target);
+    auto const separator = name.find_last_of("\\/");
+    auto const dir = separator == std::string::npos ? std::string() : name.substr(0, separator + 1);
+    WIN32_FIND_DATAA data;
+    auto find = FindFirstFileA((name + ".*" + RetiredSuffix).c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE)
+      return;
+
+    do
+      DeleteFileA((dir + data.cFileName).c_str());
+    while (FindNextFileA(find, &data));
+
+    FindClose(find);
+  }
+
+  // Mapped file can not be replaced or removed, but it can be renamed, so mapped target is moved aside to be removed when it is unmapped
+  bool Rename(char const* path, char const* target)
+  {
+    RemoveRetired(target);
+    if (MoveFileExA(path, target, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+      return true;
+
+    auto const error = GetLastError();
+    if ((error != ERROR_ACCESS_DENIED && error != ERROR_USER_MAPPED_FILE) || GetFileAttributesA(path) == INVALID_FILE_ATTRIBUTES)
+      return false;
+
+    static std::atomic<unsigned> count(0);
+    auto const retired = std::string(target) + "." + std::to_string(GetCurrentProcessId()) + "." + std::to_string(++count) + RetiredSuffix;
+    if (!MoveFileExA(target, retired.c_str(), MOVEFILE_WRITE_THROUGH))
+      return false;
+
+    if (!MoveFileExA(path, target, MOVEFILE_WRITE_THROUGH))
+    {
+      MoveFileExA(retired.c_str(), target, MOVEFILE_WRITE_THROUGH);
+      return false;
+    }
+
+    DeleteFileA(retired.c_str());
+    return true;
+  }
+#else
+  void MappedFileImpl::Unmap()
+  {
+    munmap(const_cast<char*>(Begin), Length);
+  }
+
+  std::shared_ptr<Tags::Internal::MappedFile> Map(char const* path)
+  {
+    auto fd = open(path, O_RDONLY);
+    if (fd == -1)
+      return std::shared_ptr<Tags::Internal::MappedFile>();
+
+    std::shared_ptr<void> fileCloser(nullptr, [fd](void*) { close(fd); });
+    struct stat st;
+    if (fstat(fd, &st) == -1 || static_cast<uint64_t>(st.st_size) > SIZE_MAX)
+      return std::shared_ptr<Tags::Internal::MappedFile>();
+
+    if (!st.st_size)
+      return std::make_shared<MappedFileImpl>(nullptr, 0);
+
+    auto data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    return data == MAP_FAILED ? std::shared_ptr<Tags::Internal::MappedFile>() : std::make_shared<MappedFileImpl>(static_cast<char const*>(data), static_cast<size_t>(st.st_size));
+  }
+
+  bool Rename(char const* path, char const* target)
+  {
+    return !rename(path, target);
+  }
+#endif
+}
+
+namespace Tags
+{
+namespace Internal
+{
+  std::shared_ptr<MappedFile> MapFile(char const* path)
+  {
+    auto mapped = Map(path);
+    return mapped ? mapped : Load(path);
+  }
+
+  std::shared_ptr<MappedFile> LoadFile(char const* path)
+  {
+    return Load(path);
+  }
+
+  bool PublishFile(char const* path, char const* target)
+  {
+    return Rename(path, target);
+  }
+}
+}
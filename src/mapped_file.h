@@ -0,0 +1,30 @@
+#pragma once
+
+#include <memory>
+#include <stddef.h>
+
+namespace Tags
+{
+namespace Internal
+{
+  class MappedFile
+  {
+  public:
+    virtual ~MappedFile() = default;
+    virtual char const* Data() const = 0;
+    virtual size_t Size() const = 0;
+  };
+
+  // File which can not be mapped, e.g. for lack of address space in 32-bit process, is read into memory like by LoadFile.
+  // Returns empty pointer if file can not be opened or read. Empty files are mapped with Data() == nullptr
+  std::shared_ptr<MappedFile> MapFile(char const* path);
+
+  // Returns content of file read into memory, it does not change with the file. Empty pointer if file can not be read
+  std::shared_ptr<MappedFile> LoadFile(char const* path);
+
+  // Renames written file to target replacing it, so target is opened either as the whole previous file or as the whole written one.
+  // Target mapped on Windows is moved aside and removed by the next publish after it is unmapped, mappings keep the previous content.
+  // Returns false if target can not be replaced, written file is left then
+  bool PublishFile(char const* path, char const* target);
+}
+}
@@ -0,0 +1,70 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace Tags
+{
+namespace Internal
+{
+  size_t GetDefaultThreadsCount()
+  {
+    return std::max(static_cast<size_t>(std::thread::hardware_concurrency()), static_cast<size_t>(1));
+  }
+
+  void RunParallel(size_t threads, size_t count, std::function<void(size_t)> const& func)
+  {
+    threads = std::min(!threads ? GetDefaultThreadsCount() : threads, count);
+    if (threads <= 1)
+    {
+      for (size_t i = 0; i < count; ++i)
+        func(i);
+
+      return;
+    }
+
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    std::mutex errorGuard;
+    auto worker = [&]()
+    {
+      for (auto i = next++; i < count; i = next++)
+      {
+        try
+        {
+          func(i);
+        }
+        catch (...)
+        {
+          std::lock_guard<std::mutex> lock(errorGuard);
+          error = !error ? std::current_exception() : error;
+          next = count;
+        }
+      }
+    };
+
+    std::vector<std::thread> workers;
+    try
+    {
+      for (size_t i = 1; i < threads; ++i)
+        workers.emplace_back(worker);
+    }
+    catch (std::system_error const&)
+    {
+      // Proceed with threads already started
+    }
+
+    worker();
+    for (auto& w : workers)
+      w.join();
+
+    if (error)
+      std::rethrow_exception(error);
+  }
+}
+}
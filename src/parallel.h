@@ -0,0 +1,17 @@
+#pragma once
+
+#include <functional>
+#include <stddef.h>
+
+namespace Tags
+{
+namespace Internal
+{
+  // Returns number of threads to use if 0 is requested
+  size_t GetDefaultThreadsCount();
+
+  // Calls func(0) .. func(count - 1) using up to 'threads' threads including calling one.
+  // Waits until all calls complete and rethrows first caught exception
+  void RunParallel(size_t threads, size_t count, std::function<void(size_t)> const& func);
+}
+}
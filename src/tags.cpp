@@ -18,12 +18,17 @@
 */
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <forward_list>
 #include <fstream>
 #include <functional>
 #include <iterator>
+#include <limits>
 #include <list>
-#include <regex>
+#include <map>
+#include <mutex>
 #include <set>
 #include <stdio.h>
 #include <sys/stat.h>
@@ -31,33 +36,86 @@
 #include <string.h>
 #include <time.h>
 #include <tuple>
+#include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <memory>
+#include "excmd_pattern.h"
+#include "field_scan.h"
+#include "fuzzy_pattern.h"
+#include "mapped_file.h"
+#include "parallel.h"
 #include "tags.h"
 #include "tags_cache.h"
+#include "tags_index_options.h"
 #include "tags_repository.h"
 
 #if defined _WIN32
 #include <io.h>
-static void Truncate(FILE* f, long size)
+#include <process.h>
+static int GetProcessNumber()
 {
-  _chsize(_fileno(f), size);
+  return _getpid();
+}
+
+// Positions are 64-bit, since long is 32-bit on Windows and index of large tags file exceeds 2 Gb
+static int Seek(FILE* f, int64_t offset, int origin)
+{
+  return _fseeki64(f, offset, origin);
+}
+
+static int64_t Tell(FILE* f)
+{
+  return _ftelli64(f);
+}
+
+static bool SyncFile(FILE* f)
+{
+  return !fflush(f) && !ferror(f) && !_commit(_fileno(f));
+}
+
+// Default stat has 32-bit file size
+using FileStat = struct _stat64;
+static int GetFileStat(char const* path, FileStat* st)
+{
+  return _stat64(path, st);
 }
 #else
 #include <unistd.h>
-static void Truncate(FILE* f, long size)
+static int GetProcessNumber()
+{
+  return getpid();
+}
+
+static int Seek(FILE* f, int64_t offset, int origin)
+{
+  return fseeko(f, static_cast<off_t>(offset), origin);
+}
+
+static int64_t Tell(FILE* f)
+{
+  return static_cast<int64_t>(ftello(f));
+}
+
+static bool SyncFile(FILE* f)
+{
+  return !fflush(f) && !ferror(f) && !fsync(fileno(f));
+}
+
+using FileStat = struct stat;
+static int GetFileStat(char const* path, FileStat* st)
 {
-  ftruncate(fileno(f), size);
+  return stat(path, st);
 }
 #endif
 
 static bool IsEndOfFile(FILE* f)
 {
-  auto curPos = ftell(&*f);
-  fseek(f, 0, SEEK_END);
-  auto endPos = ftell(&*f);
-  fseek(f, curPos, SEEK_SET);
+  auto curPos = Tell(f);
+  Seek(f, 0, SEEK_END);
+  auto endPos = Tell(f);
+  Seek(f, curPos, SEEK_SET);
   return curPos == endPos;
 }
 
@@ -71,7 +129,7 @@ static std::shared_ptr<FILE> FOpen(char const* path, char const* mode)
   return std::shared_ptr<FILE>(fopen(path, mode), [](FILE* f) { if (f) fclose(f); });
 }
 
-using OffsetType = uint32_t;
+using OffsetType = uint64_t;
 using OffsetCont = std::vector<OffsetType>;
 enum class IndexType
 {
@@ -83,6 +141,255 @@ enum class IndexType
   EndOfEnum,
 };
 
+// Offsets table stored in memory mapped index file. Table may be unaligned so values are copied out.
+// Stored offsets are 32-bit unless tags file is too large for them
+class OffsetsView
+{
+public:
+  OffsetsView()
+    : Begin(nullptr)
+    , Length(0)
+    , Width(sizeof(uint32_t))
+  {
+  }
+
+  OffsetsView(char const* begin, size_t size, size_t width)
+    : Begin(begin)
+    , Length(size)
+    , Width(width)
+  {
+  }
+
+  OffsetsView(OffsetCont const& offsets)
+    : Begin(reinterpret_cast<char const*>(offsets.data()))
+    , Length(offsets.size())
+    , Width(sizeof(OffsetType))
+  {
+  }
+
+  OffsetType operator[] (size_t index) const
+  {
+    if (Width == sizeof(uint32_t))
+    {
+      uint32_t result;
+      memcpy(&result, Begin + index * sizeof(result), sizeof(result));
+      return result;
+    }
+
+    uint64_t result;
+    memcpy(&result, Begin + index * sizeof(result), sizeof(result));
+    return result;
+  }
+
+  OffsetType at(size_t index) const
+  {
+    if (index >= Length)
+      throw std::out_of_range("Offset index out of range");
+
+    return operator[](index);
+  }
+
+  size_t size() const
+  {
+    return Length;
+  }
+
+  bool empty() const
+  {
+    return !Length;
+  }
+
+private:
+  char const* Begin;
+  size_t Length;
+  size_t Width;
+};
+
+// Parsed fields of a tags line stored in fields file, strings are positions in its string pool
+struct FieldsRecord
+{
+  uint64_t Offset;
+  uint64_t Name;
+  uint64_t Re;
+  uint64_t Info;
+  uint32_t File;
+  int32_t Lineno;
+  char Kind;
+  char Reserved[7];
+};
+
+static_assert(sizeof(FieldsRecord) == 48, "Fields records are stored as is");
+
+// Mapped fields file: records sorted by offset of tags line, interned file paths and string pool
+class StoredFields
+{
+public:
+  StoredFields(std::shared_ptr<Tags::Internal::MappedFile> file, char const* records, size_t count, char const* pool, size_t poolSize, std::vector<uint64_t>&& relativeFiles, std::vector<std::string>&& files)
+    : File(std::move(file))
+    , Records(records)
+    , Count(count)
+    , Pool(pool)
+    , PoolSize(poolSize)
+    , RelativeFiles(std::move(relativeFiles))
+    , Files(std::move(files))
+  {
+  }
+
+  size_t size() const
+  {
+    return Count;
+  }
+
+  size_t FileSize() const
+  {
+    return File->Size();
+  }
+
+  FieldsRecord Get(size_t index) const
+  {
+    FieldsRecord record;
+    memcpy(&record, Records + index * sizeof(FieldsRecord), sizeof(FieldsRecord));
+    return record;
+  }
+
+  bool Find(OffsetType offset, FieldsRecord& record) const
+  {
+    size_t left = 0;
+    size_t right = Count;
+    while (left < right)
+    {
+      auto mid = left + (right - left) / 2;
+      if (Get(mid).Offset < offset)
+        left = mid + 1;
+      else
+        right = mid;
+    }
+
+    record = left < Count ? Get(left) : record;
+    return left < Count && record.Offset == offset;
+  }
+
+  // Pool ends with zero, so any position in pool is a valid string
+  char const* GetString(uint64_t pos) const
+  {
+    return pos < PoolSize ? Pool + pos : Pool;
+  }
+
+  void WritePool(FILE* f) const
+  {
+    fwrite(Pool, 1, PoolSize, f);
+  }
+
+  size_t GetPoolSize() const
+  {
+    return PoolSize;
+  }
+
+  // Positions of file paths as they are stored in tags file
+  std::vector<uint64_t> const& GetRelativeFiles() const
+  {
+    return RelativeFiles;
+  }
+
+  // Full path of interned file as tags report it
+  std::string GetFile(uint32_t index) const
+  {
+    return index < Files.size() ? Files[index] : std::string();
+  }
+
+private:
+  std::shared_ptr<Tags::Internal::MappedFile> File;
+  char const* Records;
+  size_t Count;
+  char const* Pool;
+  size_t PoolSize;
+  std::vector<uint64_t> RelativeFiles;
+  std::vector<std::string> Files;
+};
+
+// Keys of every Interval-th line of index table, so range search reads only a few lines of tags file.
+// Key is the part of line compared by match visitors of the table
+class SampledKeys
+{
+public:
+  static size_t const Interval = 64;
+
+  void Add(char const* begin, char const* end)
+  {
+    Positions.push_back(Keys.size());
+    Keys.append(begin, end);
+    Keys.push_back(0);
+  }
+
+  void Clear()
+  {
+    Keys.clear();
+    Positions.clear();
+  }
+
+  size_t size() const
+  {
+    return Positions.size();
+  }
+
+  char const* operator[] (size_t index) const
+  {
+    return Keys.c_str() + Positions[index];
+  }
+
+private:
+  std::string Keys;
+  std::vector<size_t> Positions;
+};
+
+// Distinct case insensitive names, every name ends with zero, and positions of their suffixes sorted by suffixes
+struct NameSuffixes
+{
+  char const* Text;
+  size_t TextSize;
+  OffsetsView Suffixes;
+};
+
+struct TagsMapping
+{
+  std::shared_ptr<Tags::Internal::MappedFile> Tags;
+  std::shared_ptr<Tags::Internal::MappedFile> Index;
+  // Empty if fields file is absent or not synchronized with tags file
+  std::shared_ptr<StoredFields const> Fields;
+  std::array<OffsetsView, static_cast<size_t>(IndexType::EndOfEnum)> Offsets;
+  // Signatures of names in order of case insensitive names table
+  OffsetsView NameSignatures;
+  // Empty if index is built without infix search, see AreNameSuffixesSkipped
+  NameSuffixes Suffixes;
+  // Empty if index is built without filter of names
+  OffsetsView NameFilter;
+  time_t TagsModTime;
+  time_t IndexModTime;
+  // Size of files read into memory, 0 if they are mapped
+  size_t ResidentSize = 0;
+  // Size reserved for files read into memory is released with them
+  std::shared_ptr<Tags::Internal::ResidentBudget> Budget;
+  size_t Reserved = 0;
+
+  ~TagsMapping()
+  {
+    if (Budget)
+      Budget->Release(Reserved);
+  }
+
+  OffsetsView const& GetOffsets(IndexType index) const
+  {
+    return Offsets.at(static_cast<size_t>(index));
+  }
+
+  // Sampled on first search in table
+  SampledKeys const& GetSampledKeys(IndexType index) const;
+
+private:
+  mutable std::array<SampledKeys, static_cast<size_t>(IndexType::EndOfEnum)> Samples;
+  mutable std::array<std::once_flag, static_cast<size_t>(IndexType::EndOfEnum)> SamplesOnce;
+};
+
 namespace Tags
 {
   TagInfo MakeFileTag(TagInfo&& tag, int lineNum)
@@ -97,13 +404,49 @@ namespace Tags
 
 using Tags::MakeFileTag;
 
+struct RepositoryPaths;
+
+// Changes of tags file made by updating tags of a single file
+struct IndexPatch
+{
+  time_t TagsModTime;
+  // All lines of the updated file before update
+  OffsetCont PathOffsets;
+  OffsetCont Removed;
+  OffsetCont Added;
+};
+
+// Repositories of the same tags file, like the one loaded in background and the one it replaces, write its index one at a time
+static std::shared_ptr<std::mutex> GetIndexWriterGuard(std::string const& indexFile)
+{
+  static std::mutex guard;
+  static std::map<std::string, std::weak_ptr<std::mutex>> writers;
+  std::lock_guard<std::mutex> lock(guard);
+  for (auto i = writers.begin(); i != writers.end(); i = i->second.expired() ? writers.erase(i) : std::next(i));
+  auto& writer = writers[indexFile];
+  auto result = writer.lock();
+  if (!result)
+  {
+    result = std::make_shared<std::mutex>();
+    writer = result;
+  }
+
+  return result;
+}
+
 struct TagFileInfo{
-  TagFileInfo(char const* fname, bool singleFileRepos)
+  TagFileInfo(char const* fname, bool singleFileRepos, Tags::IndexOptions const& options, std::shared_ptr<Tags::Internal::ResidentBudget> budget)
     : filename(fname)
     , indexFile(filename + ".idx")
+    , fieldsFile(filename + ".fields")
     , singlefilerepos(singleFileRepos)
+    , indexOptions(options)
+    , Budget(budget ? std::move(budget) : std::make_shared<Tags::Internal::ResidentBudget>(options.ResidentMemoryLimit))
+    , fullpathrepo(false)
+    , IndexWriterGuard(GetIndexWriterGuard(indexFile))
     , IndexModTime(0)
     , CacheModTime(0)
+    , MappingPinned(false)
     , NamesCache(Tags::Internal::CreateTagsCache(0))
     , FilesCache(Tags::Internal::CreateTagsCache(0))
     , OwnerInfo(std::make_shared<TagInfo::OwnerInfo>(TagInfo::OwnerInfo{filename}))
@@ -136,12 +479,41 @@ struct TagFileInfo{
     return reporoot;
   }
 
-  std::shared_ptr<FILE> OpenTags(OffsetCont& offsets, IndexType index) const;
+  std::shared_ptr<TagsMapping const> OpenTags() const;
+
+  // Size of tags, index and fields files kept in memory by resident repository
+  size_t GetResidentSize() const;
+
+  // Files are mapped again by the next lookup, lookups in progress keep their mapping
+  void ResetMapping() const
+  {
+    std::lock_guard<std::mutex> lock(MappingGuard);
+    Mapping.reset();
+  }
+
+  // Unlike ResetMapping, also drops files kept by PinMapping
+  void ReleaseMapping() const
+  {
+    std::lock_guard<std::mutex> lock(MappingGuard);
+    Mapping.reset();
+    PinnedMapping.reset();
+    MappingPinned = false;
+  }
+
+  // Files mapped now or by the next lookup are used by lookups when changed files can not be mapped
+  void PinMapping() const;
+
+  int Load(size_t& symbolsLoaded, Tags::IndexProgress const& progress = Tags::IndexProgress());
 
-  int Load(size_t& symbolsLoaded);
+  // Patches offset tables of synchronized index, returns false if index should be rebuilt
+  bool UpdateIndex(IndexPatch const& patch) const;
+
+  // True if existing tags file is not the one index is built for, own updates of tags file patch index as well
+  bool TagsModified() const;
 
   void CacheTag(TagInfo const& tag, size_t cacheSize)
   {
+    std::lock_guard<std::mutex> lock(CacheGuard);
     Tags::Internal::TagsCache& cache = tag.name.empty() ? *FilesCache : *NamesCache;
     cache.SetCapacity(cacheSize);
     cache.Insert(tag.name.empty() ? MakeFileTag(TagInfo(tag)) : tag);
@@ -150,6 +522,7 @@ struct TagFileInfo{
 
   void EraseCachedTag(TagInfo const& tag)
   {
+    std::lock_guard<std::mutex> lock(CacheGuard);
     Tags::Internal::TagsCache& cache = tag.name.empty() ? *FilesCache : *NamesCache;
     cache.Erase(tag);
     CacheModTime = time(nullptr);
@@ -157,6 +530,7 @@ struct TagFileInfo{
 
   std::vector<TagInfo> GetCachedTags(bool getFiles, size_t limit) const
   {
+    std::lock_guard<std::mutex> lock(CacheGuard);
     return getFiles ? FilesCache->Get(limit) : NamesCache->Get(limit);
   }
 
@@ -164,11 +538,13 @@ struct TagFileInfo{
 
   time_t ElapsedSinceCached() const
   {
+    std::lock_guard<std::mutex> lock(CacheGuard);
     return !CacheModTime ? CacheModTime : time(nullptr) - CacheModTime;
   }
 
   void ResetCacheCounters()
   {
+    std::lock_guard<std::mutex> lock(CacheGuard);
     NamesCache->ResetCounters();
     FilesCache->ResetCounters();
     CacheModTime = time(nullptr);
@@ -176,50 +552,89 @@ struct TagFileInfo{
 
   std::string GetLastVisited() const
   {
+    std::lock_guard<std::mutex> lock(CacheGuard);
     return LastVisited;
   }
 
   void SetLastVisited(std::string const& lastVisited)
   {
+    std::lock_guard<std::mutex> lock(CacheGuard);
     LastVisited = lastVisited;
   }
 
 private:
-  bool CreateIndex(time_t tagsModTime, bool singleFileRepos);
+  // Index is written to temporary file and renamed, so it is never seen partially written
+  bool CreateIndex(time_t tagsModTime, bool singleFileRepos, Tags::IndexProgress const& progress);
+  void SetRepositoryPaths(RepositoryPaths const& paths, bool singleFileRepos);
+  void WriteIndexHeader(FILE* f, time_t tagsModTime, size_t offsetSize) const;
+  bool WriteIndex(Tags::Internal::MappedFile const& tags, std::string const& index, time_t tagsModTime, bool singleFileRepos, size_t threads, Tags::IndexProgress const& progress);
+  // Sorted runs are spilled to temporary files to keep parsed lines within IndexOptions::MemoryLimit
+  bool WriteIndexExternally(Tags::Internal::MappedFile const& tags, std::string const& index, time_t tagsModTime, bool singleFileRepos, size_t threads, Tags::IndexProgress const& progress);
+  bool AppendCacheStat(std::string const& index, time_t tagsModTime);
+  // Fields file lets lookups make tags without parsing lines of tags file, see IndexOptions::StoreFields
+  bool WriteFields(Tags::Internal::MappedFile const& tags, time_t tagsModTime) const;
+  bool UpdateFields(Tags::Internal::MappedFile const& tags, IndexPatch const& patch, time_t tagsModTime) const;
+  std::shared_ptr<StoredFields const> MapFields(time_t tagsModTime, bool resident = false) const;
   bool LoadCache();
-  std::shared_ptr<FILE> OpenIndex(char const* mode = "rb") const;
-  OffsetCont GetOffsets(FILE* f, IndexType type) const;
+  std::shared_ptr<FILE> OpenIndex(char const* mode, size_t& offsetSize) const;
+  // Files are read into memory if size is reserved for them in Budget, 0 means files are mapped
+  std::shared_ptr<TagsMapping const> MapTags(std::string const& index, time_t tagsModTime, time_t indexModTime, size_t reserved) const;
   bool Synchronized() const
   {
-    return !!OpenIndex();
+    return !!OpenTags();
   }
 
   bool IndexModified() const
   {
-    struct stat st;
-    return !IndexModTime || stat(indexFile.c_str(), &st) == -1 || IndexModTime != st.st_mtime;
+    FileStat st;
+    return !IndexModTime || GetFileStat(indexFile.c_str(), &st) == -1 || IndexModTime != st.st_mtime;
   }
 
   void CloseIndexFile(std::shared_ptr<FILE>&& f)
   {
     f.reset();
-    struct stat st;
-    IndexModTime = stat(indexFile.c_str(), &st) != -1 ? st.st_mtime : 0;
+    IndexWritten(false);
+  }
+
+  // Own writes of index are seen by the next lookup even within IndexOptions::ChangesCheckInterval,
+  // resident mapping is kept if only cached tags are written
+  void IndexWritten(bool tablesWritten) const
+  {
+    FileStat st;
+    IndexModTime = GetFileStat(indexFile.c_str(), &st) != -1 ? st.st_mtime : 0;
+    std::lock_guard<std::mutex> lock(MappingGuard);
+    if (Mapping && (tablesWritten || !Mapping->ResidentSize))
+      Mapping.reset();
   }
 
   std::string filename;
   std::string indexFile;
+  std::string fieldsFile;
   std::string reporoot;
   std::string singlefile;
   bool singlefilerepos;
+  Tags::IndexOptions indexOptions;
+  // Limits size of files read into memory by this and other repositories sharing it
+  std::shared_ptr<Tags::Internal::ResidentBudget> Budget;
   bool fullpathrepo;
-  time_t IndexModTime;
+  // Taken before CacheGuard and MappingGuard by loads, index patches and cache flushes, see GetIndexWriterGuard
+  std::shared_ptr<std::mutex> IndexWriterGuard;
+  // Cache flushes and index patches of other threads update modification time of index checked by lookups
+  mutable std::atomic<time_t> IndexModTime;
+  // Cached tags are changed by the UI thread concurrently with background loads
+  mutable std::mutex CacheGuard;
   time_t CacheModTime;
   std::string LastVisited;
   std::shared_ptr<Tags::Internal::TagsCache> NamesCache;
   std::shared_ptr<Tags::Internal::TagsCache> FilesCache;
   std::shared_ptr<TagInfo::OwnerInfo> OwnerInfo;
-  OffsetCont NamesOffsets;
+  // Lookups open tags concurrently with background loads and updates of repository
+  mutable std::mutex MappingGuard;
+  mutable std::shared_ptr<TagsMapping const> Mapping;
+  // When files of Mapping were last found unchanged, see IndexOptions::ChangesCheckInterval
+  mutable std::chrono::steady_clock::time_point MappingCheckTime;
+  mutable bool MappingPinned;
+  mutable std::shared_ptr<TagsMapping const> PinnedMapping;
 };
 
 using Tags::SortingOptions;
@@ -240,14 +655,35 @@ static std::string GetDirOfFile(std::string const& filePath)
     return !pos || pos == std::string::npos ? std::string() : filePath.substr(0, pos);
 }
 
-char const IndexFileSignature[] = "tags.idx.v7";
+// Signature defines size of stored offsets, index of tags file larger than 4 Gb stores 64-bit offsets
+char const IndexFileSignature[] = "tags.idx.v11";
+char const WideIndexFileSignature[] = "tags.idx.v12";
+static_assert(sizeof(IndexFileSignature) == sizeof(WideIndexFileSignature), "Index signatures must have the same size");
+
+static size_t GetStoredOffsetSize(uint64_t tagsSize)
+{
+  return tagsSize > std::numeric_limits<uint32_t>::max() ? sizeof(uint64_t) : sizeof(uint32_t);
+}
+
+static size_t GetStoredOffsetSize(char const* signature)
+{
+  return !memcmp(signature, IndexFileSignature, sizeof(IndexFileSignature)) ? sizeof(uint32_t)
+       : !memcmp(signature, WideIndexFileSignature, sizeof(WideIndexFileSignature)) ? sizeof(uint64_t)
+       : 0;
+}
+
+static void WriteSignature(FILE* f, size_t offsetSize)
+{
+  fwrite(offsetSize == sizeof(uint32_t) ? IndexFileSignature : WideIndexFileSignature, 1, sizeof(IndexFileSignature), f);
+}
 
-static bool ReadSignature(FILE* f)
+static bool ReadSignature(FILE* f, size_t& offsetSize)
 {
   char signature[sizeof(IndexFileSignature)];
-  if (fread(signature, 1, sizeof(IndexFileSignature), f) != sizeof(IndexFileSignature) || memcmp(signature, IndexFileSignature, sizeof(IndexFileSignature)))
+  offsetSize = fread(signature, 1, sizeof(signature), f) != sizeof(signature) ? 0 : GetStoredOffsetSize(signature);
+  if (!offsetSize)
   {
-    fseek(f, 0, SEEK_SET);
+    Seek(f, 0, SEEK_SET);
     return false;
   }
 
@@ -338,8 +774,7 @@ static bool SkipString(FILE* f)
   if (!ReadUnsignedInt(f, len) || len > stringLengthThreshold)
     return false;
 
-  fseek(f, len, SEEK_CUR);
-  return true;
+  return !Seek(f, len, SEEK_CUR);
 }
 
 static void WriteString(FILE* f, std::string const& str)
@@ -348,6 +783,38 @@ static void WriteString(FILE* f, std::string const& str)
   fwrite(str.c_str(), 1, str.length(), f);
 }
 
+static bool ReadSignature(char const*& cur, char const* end, size_t& offsetSize)
+{
+  offsetSize = static_cast<size_t>(end - cur) < sizeof(IndexFileSignature) ? 0 : GetStoredOffsetSize(cur);
+  if (!offsetSize)
+    return false;
+
+  cur += sizeof(IndexFileSignature);
+  return true;
+}
+
+template<typename StoredType, typename ValueType> bool ReadInt(char const*& cur, char const* end, ValueType& value)
+{
+  auto val = static_cast<StoredType>(0);
+  if (static_cast<size_t>(end - cur) < sizeof(val))
+    return false;
+
+  memcpy(&val, cur, sizeof(val));
+  cur += sizeof(val);
+  value = static_cast<ValueType>(val);
+  return true;
+}
+
+static bool SkipString(char const*& cur, char const* end)
+{
+  unsigned int len = 0;
+  if (!ReadInt<uint32_t>(cur, end, len) || len > stringLengthThreshold || static_cast<size_t>(end - cur) < len)
+    return false;
+
+  cur += len;
+  return true;
+}
+
 static bool ReadRepoRoot(FILE* f, std::string& repoRoot, std::string& singleFile)
 {
   return ReadString(f, repoRoot) && ReadString(f, singleFile);
@@ -435,15 +902,7 @@ static int ToInt(std::string const& str)
 
 static bool LineMatches(char const* lineText, TagInfo const& tag)
 {
-  try
-  {
-    return !tag.re.empty() ? std::regex_match(lineText, std::regex(tag.re)) : false;
-  }
-  catch(std::exception const&)
-  {
-  }
-
-  return false;
+  return Tags::Internal::ExcmdPattern(tag.re).Matches(lineText);
 }
 
 static void QuoteMeta(std::string& str)
@@ -545,20 +1004,19 @@ inline bool IsFieldEnd(char c)
   return IsLineEnd(c) || c == '\t';
 }
 
+// Separator ends with tab, so only tabs found by field scanning are checked to complete it
 inline bool NextField(char const*& cur, char const*& next, std::string const& separator = "\t")
 {
   if (IsLineEnd(*next))
     return false;
 
   cur = cur != next ? next + 1 : cur;
-  size_t separatorPos = 0;
-  for (next = cur; separatorPos != separator.length() && !IsLineEnd(*next); ++next)
-  {
-    separatorPos = *next == separator[separatorPos] ? separatorPos + 1 :
-                   *next == separator.front() ? 1 : 0;
-  }
+  auto isSeparator = [&cur, &separator](char const* tab) {
+    return static_cast<size_t>(tab + 1 - cur) >= separator.length() && !separator.compare(0, separator.length() - 1, tab + 1 - separator.length(), separator.length() - 1);
+  };
 
-  next = separatorPos == separator.length() ? next - separator.length() : next;
+  for (next = Tags::Internal::FindFieldEnd(cur); *next == '\t' && !isSeparator(next); next = Tags::Internal::FindFieldEnd(next + 1));
+  next = *next == '\t' ? next + 1 - separator.length() : next;
   return next != cur;
 }
 
@@ -625,12 +1083,31 @@ static bool ParseLine(const char* buf, TagFields& result)
   return true;
 }
 
+// Same as MakeFilename(fi.GetFullPath(path)) but allocates once
+static void MakeFullFilename(TagFileInfo const& fi, char const* begin, char const* end, std::string& result)
+{
+  bool const fullPath = end - begin > 1 && begin[1] == ':';
+  auto const& root = fi.GetRoot();
+  result.clear();
+  result.reserve((fullPath ? 0 : root.length() + 1) + (end - begin));
+  if (!fullPath)
+  {
+    result += root;
+    if (!root.empty() && !IsPathSeparator(root.back()))
+      result += '\\';
+  }
+
+  result.append(begin, end);
+  std::replace(result.begin(), result.end(), '/', '\\');
+  result.erase(std::unique(result.begin(), result.end(), [](char a, char b) {return a == '\\' && a == b; }), result.end());
+}
+
 static TagInfo MakeTag(TagFields const& fields, TagFileInfo const& fi)
 {
   TagInfo result;
   result.Owner = fi.GetOwnerInfo();
-  result.name = std::string(fields.Name.first, fields.Name.second);
-  result.file = MakeFilename(fi.GetFullPath(std::string(fields.File.first, fields.File.second)));
+  result.name.assign(fields.Name.first, fields.Name.second);
+  MakeFullFilename(fi, fields.File.first, fields.File.second, result.file);
   if (fields.Excmd.first)
   {
     std::string excmd(fields.Excmd.first, fields.Excmd.second);
@@ -641,14 +1118,27 @@ static TagInfo MakeTag(TagFields const& fields, TagFileInfo const& fi)
 
   result.kind = fields.Kind.first ? *fields.Kind.first : result.kind;
   result.lineno = fields.Lineno.first ? ToInt(std::string(fields.Lineno.first, fields.Lineno.second)) : result.lineno;
-  result.info = fields.Info.first ? std::string(fields.Info.first, fields.Info.second) : result.info;
+  if (fields.Info.first)
+    result.info.assign(fields.Info.first, fields.Info.second);
+
   return std::move(result);
 }
 
-static char strbuf[16384];
+static TagInfo MakeTag(StoredFields const& stored, FieldsRecord const& record, TagFileInfo const& fi)
+{
+  TagInfo result;
+  result.Owner = fi.GetOwnerInfo();
+  result.name = stored.GetString(record.Name);
+  result.file = stored.GetFile(record.File);
+  result.re = stored.GetString(record.Re);
+  result.kind = record.Kind;
+  result.lineno = record.Lineno;
+  result.info = stored.GetString(record.Info);
+  return std::move(result);
+}
 
 struct LineInfo{
-  int pos;
+  OffsetType pos;
   char const *name;
   char const *name_lower;
   char const *path;
@@ -665,8 +1155,20 @@ inline int CharCmp(unsigned char left, unsigned char right, bool caseInsensitive
   return caseInsensitive ? static_cast<unsigned char>(tolower(left)) - static_cast<unsigned char>(tolower(right)) : left - right;
 }
 
+// Equal prefix is skipped block-wise, characters with locale dependent case and the first difference are compared one by one
+inline void SkipEqualPrefix(char const*& left, char const*& right, bool caseInsensitive, bool stopAtSeparators)
+{
+  if (!left || !right)
+    return;
+
+  auto length = Tags::Internal::GetEqualPrefixLength(left, right, caseInsensitive, stopAtSeparators);
+  left += length;
+  right += length;
+}
+
 inline int FieldCompare(char const* left, char const*& right, bool caseInsensitive, bool partialCompare)
 {
+  SkipEqualPrefix(left, right, caseInsensitive, false);
   for (; left && !IsFieldEnd(*left) && right && !IsFieldEnd(*right) && !CharCmp(*left, *right, caseInsensitive); ++left, ++right);
   char leftChar = left && !IsFieldEnd(*left) ? *left : 0;
   char rightChar = right && !IsFieldEnd(*right) ? *right : 0;
@@ -682,12 +1184,14 @@ inline bool FieldLess(char const* left, char const* left_end, char const* right,
 inline int PathCompare(char const* left, char const* &right, bool partialCompare, bool caseInsensitive = CaseInsensitive)
 {
   int cmp = 0;
+  SkipEqualPrefix(left, right, caseInsensitive, true);
   while (left && !IsFieldEnd(*left) && right && !IsFieldEnd(*right) && !cmp)
   {
     if (IsPathSeparator(*left) && IsPathSeparator(*right))
     {
       while (IsPathSeparator(*(++right)));
       while (IsPathSeparator(*(++left)));
+      SkipEqualPrefix(left, right, caseInsensitive, true);
     }
     else if (!(cmp = CharCmp(*left, *right, caseInsensitive)))
     {
@@ -726,8 +1230,7 @@ static char const* GetFilename(char const* path)
 
 inline char const* GetFieldEnd(char const* str)
 {
-  for (; !IsFieldEnd(*str); ++str);
-  return str;
+  return Tags::Internal::FindFieldEnd(str);
 }
 
 static char const* FindClassFullQualification(char const* str)
@@ -738,9 +1241,11 @@ static char const* FindClassFullQualification(char const* str)
                                                ,"\tunion:"
                                               };
 
+  auto end = Tags::Internal::FindLineEnd(str);
   for (const auto& fieldName : fieldNames)
   {    
-    if (auto ptr = strstr(str, fieldName.c_str()))
+    auto ptr = std::search(str, end, fieldName.begin(), fieldName.end());
+    if (ptr != end)
       return ptr + fieldName.length();
   }
 
@@ -769,18 +1274,24 @@ static char const* ExtractClassName(char const* fullQualification)
   return className && !IsFieldEnd(*className) ? className : nullptr;
 }
 
-//TODO: rework
-char const* GetLine(std::string& buffer, FILE *f)
+static size_t NextLine(Tags::Internal::MappedFile const& file, size_t pos)
 {
-  buffer.clear();
-  char const* ptr = 0;
-  do
-  {
-    ptr = fgets(strbuf, sizeof(strbuf), f);
-    buffer += ptr ? ptr : "";
-  }
-  while(ptr && *buffer.rbegin() != '\n'); 
-  return !ptr && !buffer.length() ? nullptr : buffer.c_str();
+  auto lineEnd = pos < file.Size() ? static_cast<char const*>(memchr(file.Data() + pos, '\n', file.Size() - pos)) : nullptr;
+  return lineEnd ? lineEnd - file.Data() + 1 : file.Size();
+}
+
+// Returns pointer into mapped file. Last line that is not terminated with line end is copied into buffer
+static char const* GetLine(Tags::Internal::MappedFile const& file, size_t pos, std::string& buffer)
+{
+  if (pos >= file.Size())
+    return nullptr;
+
+  auto next = NextLine(file, pos);
+  if (file.Data()[next - 1] == '\n')
+    return file.Data() + pos;
+
+  buffer.assign(file.Data() + pos, file.Data() + next);
+  return buffer.c_str();
 }
 
 static std::string GetIntersection(char const* left, char const* right)
@@ -795,82 +1306,352 @@ static std::string GetIntersection(char const* left, char const* right)
   return std::string(begining, right);
 }
 
-static void WriteOffsets(FILE* f, std::vector<LineInfo*>::iterator begin, std::vector<LineInfo*>::iterator end)
+static void WriteOffset(FILE* f, OffsetType offset, size_t offsetSize)
 {
-  WriteUnsignedInt(f, static_cast<unsigned int>(std::distance(begin, end)));
-  for (; begin != end; ++begin)
+  if (offsetSize == sizeof(uint32_t))
+    WriteInt<uint32_t>(f, offset);
+  else
+    WriteInt<uint64_t>(f, offset);
+}
+
+static void WriteOffsets(FILE* f, OffsetCont const& offsets, size_t offsetSize)
+{
+  WriteUnsignedInt(f, static_cast<unsigned int>(offsets.size()));
+  for (auto offset : offsets)
   {
-    WriteInt<OffsetType>(f, (*begin)->pos);
+    WriteOffset(f, offset, offsetSize);
   }
 }
 
-static bool ReadOffsets(FILE* f, OffsetCont& offsets)
+static bool ReadOffsets(char const*& cur, char const* end, OffsetsView& offsets, size_t offsetSize)
 {
   unsigned int sz = 0;
-  if (!ReadUnsignedInt(f, sz))
+  if (!ReadInt<uint32_t>(cur, end, sz) || static_cast<size_t>(end - cur) / offsetSize < sz)
     return false;
 
-  offsets.resize(sz);
-  return !sz ? true : fread(&offsets[0], sizeof(offsets[0]), sz, f) == offsets.size();
+  offsets = OffsetsView(cur, sz, offsetSize);
+  cur += sz * offsetSize;
+  return true;
 }
 
-static bool SkipOffsets(FILE* f)
+static bool SkipOffsets(FILE* f, size_t offsetSize)
 {
   unsigned int sz = 0;
   if (!ReadUnsignedInt(f, sz))
     return false;
 
-  fseek(f, sizeof(OffsetType) * sz, SEEK_CUR);
-  return true;
+  return !Seek(f, static_cast<int64_t>(offsetSize) * sz, SEEK_CUR);
 }
 
-std::shared_ptr<FILE> TagFileInfo::OpenTags(OffsetCont& offsets, IndexType index) const
+// Name signatures are stored after offsets tables as a table of 32-bit values
+size_t const NameSignatureSize = sizeof(uint32_t);
+// Filter of names is stored after name suffixes as a table of 32-bit words
+size_t const NameFilterWordSize = sizeof(uint32_t);
+
+static bool SkipTables(FILE* f, size_t offsetSize)
 {
-  auto f = OpenIndex();
-  if (!f)
-    throw std::logic_error("Not synchronized");
+  for (int i = 0; i != static_cast<int>(IndexType::EndOfEnum); ++i)
+  {
+    if (!SkipOffsets(f, offsetSize))
+      return false;
+  }
 
-  if (index == IndexType::Names)
-    offsets = NamesOffsets;
-  else
-    GetOffsets(&*f, index).swap(offsets);
+  unsigned int textSize = 0;
+  if (!SkipOffsets(f, NameSignatureSize) || !ReadUnsignedInt(f, textSize))
+    return false;
 
-  return FOpen(filename.c_str(), "rb");
+  return !Seek(f, textSize, SEEK_CUR) && SkipOffsets(f, NameSignatureSize) && SkipOffsets(f, NameFilterWordSize);
 }
 
-OffsetCont TagFileInfo::GetOffsets(FILE* f, IndexType type) const
+static uint32_t GetNameSignature(char const* name)
 {
-  for (int i = 0; i != static_cast<int>(type); ++i)
-  {
-    if (!SkipOffsets(f))
-      throw std::runtime_error("Invalid file format");
-  }
+  return Tags::Internal::FuzzyPattern::GetSignature(name, name + strlen(name));
+}
 
-  OffsetCont result;
-  if (!ReadOffsets(f, result))
-    throw std::runtime_error("Invalid file format");
+// Suffix positions are stored as 32-bit values after text of names
+size_t const NameSuffixSize = sizeof(uint32_t);
 
-  return std::move(result);
+static bool NameSuffixLess(char const* text, OffsetType left, OffsetType right)
+{
+  auto cmp = strcmp(text + left, text + right);
+  return cmp < 0 || (!cmp && left < right);
 }
 
-void TagFileInfo::FlushCache()
+// Adds suffixes of names appended to text after position begin
+static OffsetCont AddNameSuffixes(std::string const& text, size_t begin, OffsetsView const& suffixes)
 {
-  auto f = OpenIndex("r+b");
-  if (!f)
-    return;
-
-  for (int i = 0; i != static_cast<int>(IndexType::EndOfEnum); ++i)
+  OffsetCont added;
+  for (auto pos = begin; pos < text.size(); ++pos)
   {
-    if (!SkipOffsets(&*f))
-      return;
+    if (text[pos])
+      added.push_back(pos);
   }
-  
-  WriteTagsStat(&*f, CorrectStatFilePaths(*this, NamesCache->GetStat()));
-  WriteTagsStat(&*f, CorrectStatFilePaths(*this, FilesCache->GetStat()));
-  WriteTimeT(&*f, CacheModTime);
-  WriteString(&*f, LastVisited);
-  Truncate(&*f, ftell(&*f));
-  CloseIndexFile(std::move(f));
+
+  auto less = [&text](OffsetType left, OffsetType right) { return NameSuffixLess(text.c_str(), left, right); };
+  std::sort(added.begin(), added.end(), less);
+  OffsetCont result;
+  result.reserve(suffixes.size() + added.size());
+  size_t i = 0;
+  for (auto suffix : added)
+  {
+    for (; i < suffixes.size() && less(suffixes[i], suffix); ++i)
+      result.push_back(suffixes[i]);
+
+    result.push_back(suffix);
+  }
+
+  for (; i < suffixes.size(); ++i)
+    result.push_back(suffixes[i]);
+
+  return result;
+}
+
+static void WriteNameSuffixes(FILE* f, std::string const& text, OffsetCont const& suffixes)
+{
+  WriteUnsignedInt(f, static_cast<unsigned int>(text.size()));
+  fwrite(text.data(), 1, text.size(), f);
+  WriteOffsets(f, suffixes, NameSuffixSize);
+}
+
+static bool ReadNameSuffixes(char const*& cur, char const* end, NameSuffixes& result)
+{
+  unsigned int textSize = 0;
+  if (!ReadInt<uint32_t>(cur, end, textSize) || static_cast<size_t>(end - cur) < textSize || (textSize > 0 && cur[textSize - 1]))
+    return false;
+
+  result.Text = cur;
+  result.TextSize = textSize;
+  cur += textSize;
+  return ReadOffsets(cur, end, result.Suffixes, NameSuffixSize);
+}
+
+// Range of suffixes starting with part
+static std::pair<size_t, size_t> FindNameSuffixes(NameSuffixes const& names, std::string const& part)
+{
+  size_t left = 0;
+  size_t right = 0;
+  for (auto count = names.Suffixes.size(); count > 0;)
+  {
+    auto step = count / 2;
+    if (strncmp(names.Text + names.Suffixes[left + step], part.c_str(), part.length()) < 0)
+    {
+      left += step + 1;
+      count -= step + 1;
+    }
+    else
+    {
+      count = step;
+    }
+  }
+
+  right = left;
+  for (auto count = names.Suffixes.size() - left; count > 0;)
+  {
+    auto step = count / 2;
+    if (!strncmp(names.Text + names.Suffixes[right + step], part.c_str(), part.length()))
+    {
+      right += step + 1;
+      count -= step + 1;
+    }
+    else
+    {
+      count = step;
+    }
+  }
+
+  return std::make_pair(left, right);
+}
+
+// Text of one empty name without suffixes is stored when suffixes exceed IndexOptions::MemoryLimit,
+// so index is not built again for infix search and names are scanned instead
+static std::string const SkippedNameSuffixes(1, '\0');
+
+static bool AreNameSuffixesSkipped(NameSuffixes const& names)
+{
+  return names.TextSize > 0 && names.Suffixes.empty();
+}
+
+static char const* GetSuffixName(NameSuffixes const& names, size_t suffix)
+{
+  auto pos = names.Suffixes[suffix];
+  for (; pos > 0 && names.Text[pos - 1]; --pos);
+  return names.Text + pos;
+}
+
+static bool HasSuffixName(NameSuffixes const& names, std::string const& name)
+{
+  auto range = FindNameSuffixes(names, name);
+  for (auto i = range.first; i < range.second; ++i)
+  {
+    auto pos = names.Suffixes[i];
+    if ((!pos || !names.Text[pos - 1]) && !names.Text[pos + name.length()])
+      return true;
+  }
+
+  return false;
+}
+
+// Blocked Bloom filter of case sensitive names: bits of a name are set in a single block of 512 bits,
+// so checking a name touches one cache line of index
+size_t const NameFilterBlockWords = 16;
+size_t const NameFilterBlockBits = NameFilterBlockWords * 32;
+size_t const NameFilterBitsPerName = 10;
+size_t const NameFilterProbes = 7;
+
+static uint64_t GetNameHash(char const* name)
+{
+  uint64_t hash = 14695981039346656037ull;
+  for (; *name; ++name)
+    hash = (hash ^ static_cast<unsigned char>(*name)) * 1099511628211ull;
+
+  return hash;
+}
+
+// Calls func with word and bit of every probe of name
+template <typename Func>
+static void ForEachNameFilterBit(size_t words, char const* name, Func&& func)
+{
+  auto const hash = GetNameHash(name);
+  auto const block = (hash % (words / NameFilterBlockWords)) * NameFilterBlockWords;
+  // Probes are taken from high bits of rehashed value, block is selected by low bits of the hash
+  auto const probes = ((hash >> 32) | (hash << 32)) * 0x9e3779b97f4a7c15ull;
+  for (size_t i = 0; i < NameFilterProbes; ++i)
+  {
+    auto bit = static_cast<size_t>(probes >> (64 - 9 * (i + 1))) % NameFilterBlockBits;
+    if (!func(block + bit / 32, static_cast<uint32_t>(1) << (bit % 32)))
+      return;
+  }
+}
+
+// Filter is sized by number of lines, so it does not depend on the way index is built
+static OffsetCont CreateNameFilter(size_t linesCount)
+{
+  auto blocks = (linesCount * NameFilterBitsPerName + NameFilterBlockBits - 1) / NameFilterBlockBits;
+  return OffsetCont(std::max<size_t>(blocks, 1) * NameFilterBlockWords, 0);
+}
+
+static void AddFilteredName(OffsetCont& filter, char const* name)
+{
+  ForEachNameFilterBit(filter.size(), name, [&filter](size_t word, uint32_t mask) { filter[word] |= mask; return true; });
+}
+
+// False means there are no tags with the name, empty filter may have any name
+static bool MayHaveName(OffsetsView const& filter, char const* name)
+{
+  if (!filter.size())
+    return true;
+
+  bool result = true;
+  ForEachNameFilterBit(filter.size(), name, [&filter, &result](size_t word, uint32_t mask) { return result = !!(filter[word] & mask); });
+  return result;
+}
+
+// Resident files are not checked for changes, they are read again after index is rebuilt or patched and when repository is loaded again.
+// Mapped files are checked at most once per IndexOptions::ChangesCheckInterval, own changes of index reset Mapping, so they are seen at once.
+// Files which can not be mapped anymore give pinned mapping, if any
+std::shared_ptr<TagsMapping const> TagFileInfo::OpenTags() const
+{
+  std::lock_guard<std::mutex> lock(MappingGuard);
+  if (Mapping && Mapping->ResidentSize)
+    return Mapping;
+
+  auto const now = std::chrono::steady_clock::now();
+  if (Mapping && now - MappingCheckTime < std::chrono::milliseconds(indexOptions.ChangesCheckInterval))
+    return Mapping;
+
+  FileStat tagsStat;
+  FileStat indexStat;
+  if (!IndexModTime || GetFileStat(filename.c_str(), &tagsStat) == -1 || GetFileStat(indexFile.c_str(), &indexStat) == -1 || IndexModTime != indexStat.st_mtime)
+  {
+    Mapping.reset();
+    return PinnedMapping;
+  }
+
+  bool remap = !Mapping
+            || Mapping->TagsModTime != tagsStat.st_mtime
+            || Mapping->IndexModTime != indexStat.st_mtime
+            || Mapping->Tags->Size() != static_cast<size_t>(tagsStat.st_size)
+            || Mapping->Index->Size() != static_cast<size_t>(indexStat.st_size);
+  if (remap)
+  {
+    // Previous files release their part of budget unless lookups in progress keep them
+    Mapping.reset();
+    FileStat fieldsStat;
+    auto size = static_cast<uint64_t>(tagsStat.st_size) + static_cast<uint64_t>(indexStat.st_size);
+    size += indexOptions.ResidentMemoryLimit > 0 && GetFileStat(fieldsFile.c_str(), &fieldsStat) != -1 ? static_cast<uint64_t>(fieldsStat.st_size) : 0;
+    bool const resident = size <= indexOptions.ResidentMemoryLimit && Budget->Reserve(static_cast<size_t>(size));
+    Mapping = MapTags(indexFile, tagsStat.st_mtime, indexStat.st_mtime, resident ? static_cast<size_t>(size) : 0);
+  }
+
+  if (!Mapping)
+    return PinnedMapping;
+
+  MappingCheckTime = now;
+  PinnedMapping = MappingPinned ? Mapping : PinnedMapping;
+  return Mapping;
+}
+
+// Files are not mapped here, so pinning is cheap for repositories which are not looked up
+void TagFileInfo::PinMapping() const
+{
+  std::lock_guard<std::mutex> lock(MappingGuard);
+  MappingPinned = true;
+  PinnedMapping = Mapping ? Mapping : PinnedMapping;
+}
+
+size_t TagFileInfo::GetResidentSize() const
+{
+  std::lock_guard<std::mutex> lock(MappingGuard);
+  return Mapping ? Mapping->ResidentSize : 0;
+}
+
+std::shared_ptr<TagsMapping const> TagFileInfo::MapTags(std::string const& index, time_t tagsModTime, time_t indexModTime, size_t reserved) const
+{
+  bool const resident = reserved > 0;
+  auto const open = resident ? &Tags::Internal::LoadFile : &Tags::Internal::MapFile;
+  auto result = std::make_shared<TagsMapping>();
+  result->Budget = resident ? Budget : nullptr;
+  result->Reserved = reserved;
+  result->TagsModTime = tagsModTime;
+  result->IndexModTime = indexModTime;
+  result->Index = open(index.c_str());
+  if (!result->Index)
+    return std::shared_ptr<TagsMapping const>();
+
+  char const* cur = result->Index->Data();
+  char const* end = cur + result->Index->Size();
+  time_t storedTagsModTime = 0;
+  size_t offsetSize = 0;
+  if (!ReadSignature(cur, end, offsetSize) || !ReadInt<int64_t>(cur, end, storedTagsModTime) || storedTagsModTime != tagsModTime || !SkipString(cur, end) || !SkipString(cur, end))
+    return std::shared_ptr<TagsMapping const>();
+
+  for (auto& offsets : result->Offsets)
+  {
+    if (!ReadOffsets(cur, end, offsets, offsetSize))
+      return std::shared_ptr<TagsMapping const>();
+  }
+
+  if (!ReadOffsets(cur, end, result->NameSignatures, NameSignatureSize) || result->NameSignatures.size() != result->GetOffsets(IndexType::NamesCaseInsensitive).size()
+   || !ReadNameSuffixes(cur, end, result->Suffixes)
+   || !ReadOffsets(cur, end, result->NameFilter, NameFilterWordSize) || result->NameFilter.size() % NameFilterBlockWords)
+    return std::shared_ptr<TagsMapping const>();
+
+  result->Tags = open(filename.c_str());
+  result->Fields = MapFields(tagsModTime, resident);
+  if (!result->Tags)
+    return std::shared_ptr<TagsMapping const>();
+
+  result->ResidentSize = resident ? result->Tags->Size() + result->Index->Size() + (result->Fields ? result->Fields->FileSize() : 0) : 0;
+  return std::move(result);
+}
+
+static std::shared_ptr<TagsMapping const> OpenSynchronizedTags(TagFileInfo const& fi)
+{
+  auto mapping = fi.OpenTags();
+  if (!mapping)
+    throw std::logic_error("Not synchronized");
+
+  return mapping;
 }
 
 using MemBlock = std::tuple<size_t, size_t, std::unique_ptr<char[]>>;
@@ -938,84 +1719,1192 @@ static LineInfo StoreIndexedFields(TagFields const& fields, MemBlocks& linespool
   if (fields.Info.first)
     ptr = StoreField(fields.Info, ptr, CaseSensitive);
 
-  return result;
-}
+  return result;
+}
+
+struct IndexedChunk
+{
+  size_t Begin;
+  size_t End;
+  std::forward_list<LineInfo> Pool;
+  MemBlocks Strings;
+  std::vector<LineInfo*> Lines;
+  std::vector<LineInfo*> Classes;
+  // Consecutive equal full paths are stored at most twice, it is enough to reproduce sequential paths intersection
+  std::vector<std::string> FullPaths;
+  bool SingleFile;
+};
+
+static size_t const MinIndexedChunkSize = 1024 * 1024;
+
+// Memory taken by parsed line besides its strings: list node, pointers in chunk and sort keys of all tables
+static size_t const IndexedLineOverhead = sizeof(LineInfo) + sizeof(void*) + 2 * sizeof(LineInfo*) + static_cast<size_t>(IndexType::EndOfEnum) * 2 * sizeof(void*);
+
+// Parsing stops earlier than chunk end if parsed lines take more than memoryLimit, chunk end is moved accordingly
+static bool ParseChunk(Tags::Internal::MappedFile const& tags, IndexedChunk& chunk, size_t memoryLimit = std::numeric_limits<size_t>::max())
+{
+  std::string buffer;
+  size_t repeatedPaths = 0;
+  chunk.SingleFile = true;
+  for (size_t pos = chunk.Begin; pos < chunk.End; pos = NextLine(tags, pos))
+  {
+    if (chunk.Strings.size() * MemBlockSize + chunk.Lines.size() * IndexedLineOverhead >= memoryLimit)
+    {
+      chunk.End = pos;
+      break;
+    }
+
+    auto line = GetLine(tags, pos, buffer);
+    if(line[0]=='!' || line[0]=='\t')
+      continue;
+
+    TagFields fields;
+    if (!ParseIndexedFields(line, fields))
+      return false;
+
+    chunk.Pool.push_front(StoreIndexedFields(fields, chunk.Strings));
+    LineInfo* li = &chunk.Pool.front();
+    li->pos = pos;
+    if (IsFullPath(fields.File.first))
+    {
+      bool repeated = !chunk.FullPaths.empty() && !chunk.FullPaths.back().compare(0, std::string::npos, fields.File.first, fields.File.second - fields.File.first);
+      repeatedPaths = repeated ? repeatedPaths + 1 : 0;
+      if (repeatedPaths < 2)
+        chunk.FullPaths.push_back(std::string(fields.File.first, fields.File.second));
+    }
+
+    chunk.SingleFile = chunk.SingleFile && (chunk.Lines.empty() || PathsEqual(chunk.Lines.back()->path, li->path, CaseSensitive));
+    chunk.Lines.push_back(li);
+    if (*li->cls)
+      chunk.Classes.push_back(li);
+  }
+
+  return true;
+}
+
+static std::vector<IndexedChunk> SplitIntoChunks(Tags::Internal::MappedFile const& tags, size_t begin, size_t threads)
+{
+  size_t count = std::max(static_cast<size_t>(1), std::min(threads, (tags.Size() - begin) / MinIndexedChunkSize));
+  std::vector<IndexedChunk> result(count);
+  for (size_t i = 0; i < count; ++i)
+  {
+    auto pos = begin + (tags.Size() - begin) / count * i;
+    result[i].Begin = i == 0 ? begin : NextLine(tags, pos - 1);
+    result[i].End = tags.Size();
+    if (i > 0)
+      result[i - 1].End = result[i].Begin;
+  }
+
+  return result;
+}
+
+// Sort key keeps leading bytes of the normalized value packed big-endian, so most comparisons
+// are a single integer compare and do not touch lines memory
+struct SortKey
+{
+  uint64_t Prefix;
+  LineInfo* Line;
+};
+
+static size_t const SortPrefixSize = sizeof(uint64_t);
+
+static uint64_t MakeSortPrefix(char const* str)
+{
+  uint64_t result = 0;
+  for (size_t i = 0; i < SortPrefixSize; ++i)
+  {
+    result <<= 8;
+    if (*str)
+      result |= static_cast<unsigned char>(*str++);
+  }
+
+  return result;
+}
+
+// Same normalization as PathCompare: runs of separators are collapsed into single backslash
+static uint64_t MakePathSortPrefix(char const* path)
+{
+  uint64_t result = 0;
+  for (size_t i = 0; i < SortPrefixSize; ++i)
+  {
+    result <<= 8;
+    if (IsFieldEnd(*path))
+      continue;
+
+    if (IsPathSeparator(*path))
+    {
+      result |= '\\';
+      while (IsPathSeparator(*(++path)));
+    }
+    else
+    {
+      result |= static_cast<unsigned char>(*path++);
+    }
+  }
+
+  return result;
+}
+
+// Equal prefixes without terminating zero mean both strings are longer than prefix
+inline int CompareAfterPrefix(uint64_t prefix, char const* left, char const* right)
+{
+  return !(prefix & 0xFF) ? 0 : strcmp(left + SortPrefixSize, right + SortPrefixSize);
+}
+
+template <typename PrefixType>
+std::vector<SortKey> MakeSortKeys(std::vector<LineInfo*> const& lines, PrefixType prefix)
+{
+  std::vector<SortKey> result;
+  result.reserve(lines.size());
+  for (auto line : lines)
+    result.push_back(SortKey{prefix(line), line});
+
+  return result;
+}
+
+// Offset is the last key of every order, so sorted tables do not depend on input order and number of threads
+template <typename CompareType>
+void SortLines(std::vector<SortKey>& keys, CompareType compare)
+{
+  std::sort(keys.begin(), keys.end(), [&compare](SortKey const& left, SortKey const& right)
+  {
+    if (left.Prefix != right.Prefix)
+      return left.Prefix < right.Prefix;
+
+    auto cmp = compare(left.Prefix, left.Line, right.Line);
+    return cmp < 0 || (!cmp && left.Line->pos < right.Line->pos);
+  });
+}
+
+static OffsetCont GetSortedOffsets(std::vector<SortKey> const& keys)
+{
+  OffsetCont result;
+  result.reserve(keys.size());
+  for (auto const& key : keys)
+    result.push_back(key.Line->pos);
+
+  return result;
+}
+
+static char const* GetIndexKey(IndexType type, LineInfo const& line)
+{
+  switch (type)
+  {
+  case IndexType::Names:
+    return line.name;
+  case IndexType::NamesCaseInsensitive:
+    return line.name_lower;
+  case IndexType::Paths:
+    return line.path;
+  case IndexType::Classes:
+    return line.cls;
+  case IndexType::Filenames:
+    return GetFilename(line.path);
+  default:
+    throw std::logic_error("Unexpected index type");
+  }
+}
+
+// Full orders of index tables, offset is compared separately
+static int CompareIndexKeys(IndexType type, char const* left, char const* right)
+{
+  return type == IndexType::Paths ? PathCompare(left, right, FullCompare, CaseSensitive) : strcmp(left, right);
+}
+
+static int CompareIndexedLines(IndexType type, LineInfo const& left, LineInfo const& right)
+{
+  return CompareIndexKeys(type, GetIndexKey(type, left), GetIndexKey(type, right));
+}
+
+static std::vector<SortKey> SortIndexedLines(IndexType type, std::vector<LineInfo*> const& lines)
+{
+  if (type == IndexType::Paths)
+  {
+    auto keys = MakeSortKeys(lines, [](LineInfo* line) { return MakePathSortPrefix(line->path); });
+    SortLines(keys, [](uint64_t, LineInfo* left, LineInfo* right) { return CompareIndexedLines(IndexType::Paths, *left, *right); });
+    return keys;
+  }
+
+  auto keys = MakeSortKeys(lines, [type](LineInfo* line) { return MakeSortPrefix(GetIndexKey(type, *line)); });
+  SortLines(keys, [type](uint64_t prefix, LineInfo* left, LineInfo* right) { return CompareAfterPrefix(prefix, GetIndexKey(type, *left), GetIndexKey(type, *right)); });
+  return keys;
+}
+
+// Paths and single file are folded over chunks in file order
+struct RepositoryPaths
+{
+  std::string Intersection;
+  std::string LastPath;
+  bool Empty = true;
+  bool SingleFile = true;
+};
+
+static void AddChunkPaths(RepositoryPaths& paths, IndexedChunk const& chunk)
+{
+  for (auto const& path : chunk.FullPaths)
+    paths.Intersection = GetIntersection(paths.Intersection.c_str(), path.c_str());
+
+  paths.SingleFile = paths.SingleFile && chunk.SingleFile && (paths.Empty || chunk.Lines.empty() || PathsEqual(paths.LastPath.c_str(), chunk.Lines.front()->path, CaseSensitive));
+  if (!chunk.Lines.empty())
+  {
+    paths.LastPath = chunk.Lines.back()->path;
+    paths.Empty = false;
+  }
+}
+
+// Sorted runs of external index build are stored as key length, key and offset
+struct RunRecord
+{
+  std::string Key;
+  OffsetType Offset;
+};
+
+static void WriteRunRecord(FILE* f, char const* key, size_t length, OffsetType offset)
+{
+  WriteUnsignedInt(f, static_cast<unsigned int>(length));
+  fwrite(key, 1, length, f);
+  WriteInt<OffsetType>(f, offset);
+}
+
+static bool ReadRunRecord(FILE* f, RunRecord& record)
+{
+  unsigned int length = 0;
+  if (!ReadUnsignedInt(f, length))
+    return false;
+
+  record.Key.resize(length);
+  return (!length || fread(&record.Key[0], 1, length, f) == length) && ReadInt<OffsetType>(f, record.Offset);
+}
+
+static bool RunRecordLess(IndexType type, RunRecord const& left, RunRecord const& right)
+{
+  auto cmp = CompareIndexKeys(type, left.Key.c_str(), right.Key.c_str());
+  return cmp < 0 || (!cmp && left.Offset < right.Offset);
+}
+
+static bool CloseRun(std::shared_ptr<FILE>&& f)
+{
+  bool success = !fflush(f.get()) && !ferror(f.get());
+  f.reset();
+  return success;
+}
+
+// Stages of index build reported to IndexProgress in this order
+enum class IndexBuildStage
+{
+  Parsed,
+  IndexWritten,
+  FieldsWritten,
+  Published,
+  EndOfEnum
+};
+
+static void ReportProgress(Tags::IndexProgress const& progress, IndexBuildStage stage)
+{
+  if (progress)
+    progress(static_cast<size_t>(stage) + 1, static_cast<size_t>(IndexBuildStage::EndOfEnum));
+}
+
+// Temporary files are removed when index build is finished or failed
+// Names include process id, so processes indexing the same repository do not write the same files
+class TemporaryFiles
+{
+public:
+  explicit TemporaryFiles(std::string const& prefix)
+    : Prefix(prefix + std::to_string(GetProcessNumber()) + ".")
+    , Count(0)
+  {
+  }
+
+  ~TemporaryFiles()
+  {
+    for (auto const& name : Names)
+      remove(name.c_str());
+  }
+
+  TemporaryFiles(TemporaryFiles const&) = delete;
+  TemporaryFiles& operator=(TemporaryFiles const&) = delete;
+
+  std::string Create()
+  {
+    Names.push_back(Prefix + std::to_string(Count++));
+    return Names.back();
+  }
+
+  void Remove(std::vector<std::string> const& names)
+  {
+    for (auto const& name : names)
+    {
+      remove(name.c_str());
+      Names.erase(std::remove(Names.begin(), Names.end(), name), Names.end());
+    }
+  }
+
+private:
+  std::string const Prefix;
+  size_t Count;
+  std::vector<std::string> Names;
+};
+
+static bool WriteRun(std::string const& fileName, IndexType type, std::vector<SortKey> const& keys)
+{
+  auto f = FOpen(fileName.c_str(), "wb");
+  if (!f)
+    return false;
+
+  for (auto const& key : keys)
+  {
+    auto str = GetIndexKey(type, *key.Line);
+    WriteRunRecord(f.get(), str, strlen(str), key.Line->pos);
+  }
+
+  return CloseRun(std::move(f));
+}
+
+static bool WriteRun(std::string const& fileName, IndexType type, std::vector<RunRecord>& records)
+{
+  std::sort(records.begin(), records.end(), [type](RunRecord const& left, RunRecord const& right) { return RunRecordLess(type, left, right); });
+  auto f = FOpen(fileName.c_str(), "wb");
+  if (!f)
+    return false;
+
+  for (auto const& record : records)
+    WriteRunRecord(f.get(), record.Key.c_str(), record.Key.length(), record.Offset);
+
+  return CloseRun(std::move(f));
+}
+
+static size_t const MaxMergedRuns = 64;
+
+template <typename ConsumerType>
+void MergeRunsOnce(IndexType type, std::vector<std::string>::const_iterator begin, std::vector<std::string>::const_iterator end, ConsumerType& consume)
+{
+  std::vector<std::shared_ptr<FILE>> files;
+  std::vector<RunRecord> records;
+  std::vector<size_t> heap;
+  auto greater = [type, &records](size_t left, size_t right) { return RunRecordLess(type, records[right], records[left]); };
+  for (; begin != end; ++begin)
+  {
+    files.push_back(FOpen(begin->c_str(), "rb"));
+    records.push_back(RunRecord());
+    if (files.back() && ReadRunRecord(files.back().get(), records.back()))
+      heap.push_back(files.size() - 1);
+  }
+
+  std::make_heap(heap.begin(), heap.end(), greater);
+  while (!heap.empty())
+  {
+    std::pop_heap(heap.begin(), heap.end(), greater);
+    auto i = heap.back();
+    consume(records[i]);
+    if (ReadRunRecord(files[i].get(), records[i]))
+      std::push_heap(heap.begin(), heap.end(), greater);
+    else
+      heap.pop_back();
+  }
+}
+
+// Merges runs by MaxMergedRuns at once, so number of simultaneously opened files is limited
+template <typename ConsumerType>
+bool MergeRuns(IndexType type, std::vector<std::string> runs, TemporaryFiles& temporary, ConsumerType consume)
+{
+  while (runs.size() > MaxMergedRuns)
+  {
+    std::vector<std::string> merged;
+    for (size_t i = 0; i < runs.size(); i += MaxMergedRuns)
+    {
+      merged.push_back(temporary.Create());
+      auto f = FOpen(merged.back().c_str(), "wb");
+      if (!f)
+        return false;
+
+      auto write = [&f](RunRecord const& record) { WriteRunRecord(f.get(), record.Key.c_str(), record.Key.length(), record.Offset); };
+      MergeRunsOnce(type, runs.begin() + i, runs.begin() + std::min(i + MaxMergedRuns, runs.size()), write);
+      if (!CloseRun(std::move(f)))
+        return false;
+    }
+
+    temporary.Remove(runs);
+    runs = std::move(merged);
+  }
+
+  MergeRunsOnce(type, runs.begin(), runs.end(), consume);
+  return true;
+}
+
+static TagsStat RefreshNamesCache(TagFileInfo* fi, TagsMapping const& mapping, IndexType index, TagsStat&& tagsWithFreq);
+static TagsStat RefreshFilesCache(TagFileInfo* fi, TagsMapping const& mapping, IndexType index, TagsStat&& tagsWithFreq);
+
+void TagFileInfo::SetRepositoryPaths(RepositoryPaths const& paths, bool singleFileRepos)
+{
+  auto pathIntersection = paths.Intersection;
+  for (; !pathIntersection.empty() && IsPathSeparator(pathIntersection.back()); pathIntersection.resize(pathIntersection.length() - 1));
+  fullpathrepo = !pathIntersection.empty();
+  reporoot = pathIntersection.empty() ? GetDirOfFile(filename) : MakeFilename(pathIntersection);
+  singlefile = singleFileRepos && paths.SingleFile && !paths.Empty ? std::string(GetFilename(paths.LastPath.c_str()), GetFieldEnd(paths.LastPath.c_str())) : "";
+}
+
+void TagFileInfo::WriteIndexHeader(FILE* f, time_t tagsModTime, size_t offsetSize) const
+{
+  WriteSignature(f, offsetSize);
+  WriteTimeT(f, tagsModTime);
+  WriteString(f, fullpathrepo ? reporoot : std::string());
+  WriteString(f, singlefile);
+}
+
+bool TagFileInfo::WriteIndex(Tags::Internal::MappedFile const& tags, std::string const& index, time_t tagsModTime, bool singleFileRepos, size_t threads, Tags::IndexProgress const& progress)
+{
+  auto chunks = SplitIntoChunks(tags, NextLine(tags, 0), threads);
+  std::vector<char> parsed(chunks.size(), false);
+  Tags::Internal::RunParallel(threads, chunks.size(), [&](size_t i) { parsed[i] = ParseChunk(tags, chunks[i]); });
+  if (std::find(parsed.begin(), parsed.end(), false) != parsed.end())
+    return false;
+
+  ReportProgress(progress, IndexBuildStage::Parsed);
+
+  std::vector<LineInfo*> lines;
+  std::vector<LineInfo*> classes;
+  RepositoryPaths paths;
+  for (auto const& chunk : chunks)
+  {
+    AddChunkPaths(paths, chunk);
+    lines.insert(lines.end(), chunk.Lines.begin(), chunk.Lines.end());
+    classes.insert(classes.end(), chunk.Classes.begin(), chunk.Classes.end());
+  }
+
+  SetRepositoryPaths(paths, singleFileRepos);
+  std::array<OffsetCont, static_cast<size_t>(IndexType::EndOfEnum)> tables;
+  auto table = [&tables](IndexType type) -> OffsetCont& { return tables[static_cast<size_t>(type)]; };
+  OffsetCont signatures;
+  std::string names;
+  OffsetCont nameFilter;
+  std::function<void()> const sortTasks[] = {
+    [&]()
+    {
+      table(IndexType::Names) = GetSortedOffsets(SortIndexedLines(IndexType::Names, lines));
+      nameFilter = indexOptions.NameFilter ? CreateNameFilter(lines.size()) : OffsetCont();
+      for (auto line : nameFilter.empty() ? std::vector<LineInfo*>() : lines)
+        AddFilteredName(nameFilter, line->name);
+    },
+    [&]()
+    {
+      auto keys = SortIndexedLines(IndexType::NamesCaseInsensitive, lines);
+      table(IndexType::NamesCaseInsensitive) = GetSortedOffsets(keys);
+      signatures.reserve(keys.size());
+      for (auto i = keys.begin(); i != keys.end(); ++i)
+      {
+        signatures.push_back(GetNameSignature(i->Line->name_lower));
+        if (indexOptions.InfixSearch && (i == keys.begin() || strcmp((i - 1)->Line->name_lower, i->Line->name_lower)))
+          names.append(i->Line->name_lower, strlen(i->Line->name_lower) + 1);
+      }
+    },
+    [&]()
+    {
+      auto keys = SortIndexedLines(IndexType::Paths, lines);
+      table(IndexType::Paths) = GetSortedOffsets(keys);
+      std::vector<LineInfo*> files;
+      for (auto i = keys.begin(); i != keys.end(); ++i)
+      {
+        if (i == keys.begin() || !PathsEqual((i - 1)->Line->path, i->Line->path, CaseSensitive))
+          files.push_back(i->Line);
+      }
+      keys.clear();
+      keys.shrink_to_fit();
+      table(IndexType::Filenames) = GetSortedOffsets(SortIndexedLines(IndexType::Filenames, files));
+    },
+    [&]() { table(IndexType::Classes) = GetSortedOffsets(SortIndexedLines(IndexType::Classes, classes)); },
+  };
+  Tags::Internal::RunParallel(threads, std::extent<decltype(sortTasks)>::value, [&sortTasks](size_t i) { sortTasks[i](); });
+  auto f = FOpen(index.c_str(), "wb");
+  if (!f)
+    return false;
+
+  auto const offsetSize = GetStoredOffsetSize(tags.Size());
+  WriteIndexHeader(f.get(), tagsModTime, offsetSize);
+  for (auto const& offsets : tables)
+    WriteOffsets(f.get(), offsets, offsetSize);
+
+  WriteOffsets(f.get(), signatures, NameSignatureSize);
+  WriteNameSuffixes(f.get(), names, AddNameSuffixes(names, 0, OffsetsView()));
+  WriteOffsets(f.get(), nameFilter, NameFilterWordSize);
+  return CloseRun(std::move(f));
+}
+
+bool TagFileInfo::WriteIndexExternally(Tags::Internal::MappedFile const& tags, std::string const& index, time_t tagsModTime, bool singleFileRepos, size_t threads, Tags::IndexProgress const& progress)
+{
+  IndexType const chunkTables[] = {IndexType::Names, IndexType::NamesCaseInsensitive, IndexType::Paths, IndexType::Classes};
+  TemporaryFiles temporary(indexFile + ".run");
+  std::array<std::vector<std::string>, static_cast<size_t>(IndexType::EndOfEnum)> runs;
+  size_t linesCount = 0;
+  size_t classesCount = 0;
+  RepositoryPaths paths;
+  for (size_t pos = NextLine(tags, 0); pos < tags.Size();)
+  {
+    IndexedChunk chunk;
+    chunk.Begin = pos;
+    chunk.End = tags.Size();
+    if (!ParseChunk(tags, chunk, indexOptions.MemoryLimit))
+      return false;
+
+    pos = chunk.End;
+    AddChunkPaths(paths, chunk);
+    linesCount += chunk.Lines.size();
+    classesCount += chunk.Classes.size();
+    std::vector<std::string> chunkRuns;
+    for (size_t i = 0; i < std::extent<decltype(chunkTables)>::value; ++i)
+      chunkRuns.push_back(temporary.Create());
+
+    std::vector<char> written(chunkRuns.size(), false);
+    Tags::Internal::RunParallel(threads, chunkRuns.size(), [&](size_t i)
+    {
+      auto type = chunkTables[i];
+      written[i] = WriteRun(chunkRuns[i], type, SortIndexedLines(type, type == IndexType::Classes ? chunk.Classes : chunk.Lines));
+    });
+    if (std::find(written.begin(), written.end(), false) != written.end())
+      return false;
+
+    for (size_t i = 0; i < chunkRuns.size(); ++i)
+      runs[static_cast<size_t>(chunkTables[i])].push_back(chunkRuns[i]);
+  }
+
+  ReportProgress(progress, IndexBuildStage::Parsed);
+  SetRepositoryPaths(paths, singleFileRepos);
+  auto f = FOpen(index.c_str(), "wb");
+  if (!f)
+    return false;
+
+  auto const offsetSize = GetStoredOffsetSize(tags.Size());
+  WriteIndexHeader(f.get(), tagsModTime, offsetSize);
+  size_t written = 0;
+  auto writeOffset = [&f, &written, offsetSize](RunRecord const& record) { WriteOffset(f.get(), record.Offset, offsetSize); ++written; };
+  auto merge = [&](IndexType type, size_t count, std::function<void(RunRecord const&)> const& consume)
+  {
+    written = 0;
+    WriteUnsignedInt(f.get(), static_cast<unsigned int>(count));
+    return MergeRuns(type, runs[static_cast<size_t>(type)], temporary, consume) && written == count;
+  };
+  // Name signatures are collected in temporary file while merging case insensitive names and appended after all tables
+  auto const signaturesFile = temporary.Create();
+  auto signatures = FOpen(signaturesFile.c_str(), "w+b");
+  if (!signatures)
+    return false;
+
+  auto nameFilter = indexOptions.NameFilter ? CreateNameFilter(linesCount) : OffsetCont();
+  auto addFilteredName = [&](RunRecord const& record)
+  {
+    writeOffset(record);
+    if (!nameFilter.empty())
+      AddFilteredName(nameFilter, record.Key.c_str());
+  };
+  std::string names;
+  std::string lastName;
+  bool namesSkipped = false;
+  auto addNameSignature = [&](RunRecord const& record)
+  {
+    writeOffset(record);
+    WriteInt<uint32_t>(signatures.get(), GetNameSignature(record.Key.c_str()));
+    if (indexOptions.InfixSearch && !namesSkipped && (names.empty() || record.Key != lastName))
+    {
+      lastName = record.Key;
+      names.append(lastName.c_str(), lastName.length() + 1);
+      // Every character of names text gets at most one suffix
+      namesSkipped = names.size() * (1 + sizeof(OffsetType)) > indexOptions.MemoryLimit;
+      if (namesSkipped)
+        names = SkippedNameSuffixes;
+    }
+  };
+  // Filenames are spilled while merging paths, every file is represented by its first line in paths order
+  std::vector<RunRecord> files;
+  size_t filesMemory = 0;
+  size_t filesCount = 0;
+  bool filesWritten = true;
+  std::string lastPath;
+  auto addFile = [&](RunRecord const& record)
+  {
+    writeOffset(record);
+    if (filesCount > 0 && PathsEqual(lastPath.c_str(), record.Key.c_str(), CaseSensitive))
+      return;
+
+    lastPath = record.Key;
+    files.push_back(RunRecord{GetFilename(record.Key.c_str()), record.Offset});
+    filesMemory += sizeof(RunRecord) + files.back().Key.capacity();
+    ++filesCount;
+    if (filesMemory >= indexOptions.MemoryLimit)
+    {
+      runs[static_cast<size_t>(IndexType::Filenames)].push_back(temporary.Create());
+      filesWritten = filesWritten && WriteRun(runs[static_cast<size_t>(IndexType::Filenames)].back(), IndexType::Filenames, files);
+      files.clear();
+      filesMemory = 0;
+    }
+  };
+  bool merged = merge(IndexType::Names, linesCount, addFilteredName)
+             && merge(IndexType::NamesCaseInsensitive, linesCount, addNameSignature)
+             && merge(IndexType::Paths, linesCount, addFile)
+             && merge(IndexType::Classes, classesCount, writeOffset);
+  if (!merged || !filesWritten)
+    return false;
+
+  runs[static_cast<size_t>(IndexType::Filenames)].push_back(temporary.Create());
+  if (!WriteRun(runs[static_cast<size_t>(IndexType::Filenames)].back(), IndexType::Filenames, files) || !merge(IndexType::Filenames, filesCount, writeOffset))
+    return false;
+
+  WriteUnsignedInt(f.get(), static_cast<unsigned int>(linesCount));
+  Seek(signatures.get(), 0, SEEK_SET);
+  char buffer[64 * 1024];
+  size_t copied = 0;
+  for (size_t read; (read = fread(buffer, 1, sizeof(buffer), signatures.get())) > 0; copied += read)
+    fwrite(buffer, 1, read, f.get());
+
+  if (copied != linesCount * NameSignatureSize)
+    return false;
+
+  WriteNameSuffixes(f.get(), names, namesSkipped ? OffsetCont() : AddNameSuffixes(names, 0, OffsetsView()));
+  WriteOffsets(f.get(), nameFilter, NameFilterWordSize);
+  return CloseRun(std::move(f));
+}
+
+// Fields file: signature, tags modification time, number of records, number of files, size of string pool,
+// records sorted by offset, pool positions of file paths and zero terminated strings of the pool
+char const FieldsFileSignature[] = "tags.fields.v1";
+
+// Records are written in one pass while string pool is collected in temporary file,
+// file is stamped with tags modification time only after it is completely written
+class FieldsWriter
+{
+public:
+  // Pool and files of previous fields are kept, so their records may be added as is
+  FieldsWriter(std::string const& fileName, StoredFields const* previous = nullptr)
+    : Temporary(fileName + ".tmp")
+    , FileName(Temporary.Create())
+    , File(FOpen(FileName.c_str(), "wb"))
+    , Pool(FOpen(Temporary.Create().c_str(), "w+b"))
+    , PoolSize(0)
+    , Count(0)
+  {
+    if (!File || !Pool)
+      return;
+
+    WriteHeader(0);
+    if (!previous)
+    {
+      fputc(0, Pool.get());
+      PoolSize = 1;
+      return;
+    }
+
+    previous->WritePool(Pool.get());
+    PoolSize = previous->GetPoolSize();
+    for (auto pos : previous->GetRelativeFiles())
+      AddFile(previous->GetString(pos), pos);
+  }
+
+  bool IsOpen() const
+  {
+    return File && Pool;
+  }
+
+  uint64_t GetPoolSize() const
+  {
+    return PoolSize;
+  }
+
+  void Add(FieldsRecord const& record)
+  {
+    fwrite(&record, sizeof(record), 1, File.get());
+    ++Count;
+  }
+
+  void Add(OffsetType offset, TagFields const& fields)
+  {
+    FieldsRecord record = {};
+    record.Offset = offset;
+    record.Name = AddString(std::string(fields.Name.first, fields.Name.second));
+    std::string file(fields.File.first, fields.File.second);
+    auto found = FileIndices.find(file);
+    record.File = found != FileIndices.end() ? found->second : AddFile(file, AddString(file));
+    if (fields.Excmd.first)
+    {
+      std::string excmd(fields.Excmd.first, fields.Excmd.second);
+      QuoteMeta(excmd);
+      ReplaceSpaces(excmd);
+      record.Re = AddString(excmd);
+    }
+
+    record.Kind = fields.Kind.first ? *fields.Kind.first : 0;
+    record.Lineno = fields.Lineno.first ? ToInt(std::string(fields.Lineno.first, fields.Lineno.second)) : -1;
+    record.Info = fields.Info.first ? AddString(std::string(fields.Info.first, fields.Info.second)) : 0;
+    Add(record);
+  }
+
+  // Replaces fileName with written file, previous fields should be unmapped
+  bool Commit(std::string const& fileName, time_t tagsModTime)
+  {
+    for (auto pos : Files)
+      WriteInt<uint64_t>(File.get(), pos);
+
+    std::vector<char> buffer(MemBlockSize);
+    rewind(Pool.get());
+    for (size_t read = 0; (read = fread(buffer.data(), 1, buffer.size(), Pool.get())) != 0;)
+      fwrite(buffer.data(), 1, read, File.get());
+
+    bool const written = !ferror(Pool.get()) && !Seek(File.get(), 0, SEEK_SET);
+    WriteHeader(written ? tagsModTime : 0);
+    bool const closed = !fflush(File.get()) && !ferror(File.get());
+    File.reset();
+    if (!written || !closed)
+      return false;
+
+    return Tags::Internal::PublishFile(FileName.c_str(), fileName.c_str());
+  }
+
+private:
+  void WriteHeader(time_t tagsModTime)
+  {
+    fwrite(FieldsFileSignature, 1, sizeof(FieldsFileSignature), File.get());
+    WriteTimeT(File.get(), tagsModTime);
+    WriteInt<uint64_t>(File.get(), Count);
+    WriteInt<uint64_t>(File.get(), Files.size());
+    WriteInt<uint64_t>(File.get(), PoolSize);
+  }
+
+  uint64_t AddString(std::string const& str)
+  {
+    if (str.empty())
+      return 0;
+
+    auto pos = PoolSize;
+    fwrite(str.c_str(), 1, str.length() + 1, Pool.get());
+    PoolSize += str.length() + 1;
+    return pos;
+  }
+
+  uint32_t AddFile(std::string const& file, uint64_t pos)
+  {
+    auto index = static_cast<uint32_t>(Files.size());
+    FileIndices.emplace(file, index);
+    Files.push_back(pos);
+    return index;
+  }
+
+  TemporaryFiles Temporary;
+  std::string const FileName;
+  std::shared_ptr<FILE> File;
+  std::shared_ptr<FILE> Pool;
+  uint64_t PoolSize;
+  uint64_t Count;
+  std::unordered_map<std::string, uint32_t> FileIndices;
+  std::vector<uint64_t> Files;
+};
+
+bool TagFileInfo::WriteFields(Tags::Internal::MappedFile const& tags, time_t tagsModTime) const
+{
+  FieldsWriter writer(fieldsFile);
+  if (!writer.IsOpen())
+    return false;
+
+  std::string buffer;
+  for (size_t pos = 0; pos < tags.Size(); pos = NextLine(tags, pos))
+  {
+    auto line = GetLine(tags, pos, buffer);
+    TagFields fields;
+    if (line[0] != '!' && line[0] != '\t' && ParseLine(line, fields))
+      writer.Add(pos, fields);
+  }
+
+  return writer.Commit(fieldsFile, tagsModTime);
+}
+
+std::shared_ptr<StoredFields const> TagFileInfo::MapFields(time_t tagsModTime, bool resident) const
+{
+  auto file = resident ? Tags::Internal::LoadFile(fieldsFile.c_str()) : Tags::Internal::MapFile(fieldsFile.c_str());
+  if (!file || file->Size() < sizeof(FieldsFileSignature) || memcmp(file->Data(), FieldsFileSignature, sizeof(FieldsFileSignature)))
+    return std::shared_ptr<StoredFields const>();
+
+  char const* cur = file->Data() + sizeof(FieldsFileSignature);
+  char const* end = file->Data() + file->Size();
+  time_t storedTagsModTime = 0;
+  uint64_t count = 0;
+  uint64_t filesCount = 0;
+  uint64_t poolSize = 0;
+  if (!ReadInt<int64_t>(cur, end, storedTagsModTime) || storedTagsModTime != tagsModTime || !ReadInt<uint64_t>(cur, end, count) || !ReadInt<uint64_t>(cur, end, filesCount) || !ReadInt<uint64_t>(cur, end, poolSize))
+    return std::shared_ptr<StoredFields const>();
+
+  auto const size = static_cast<uint64_t>(end - cur);
+  if (count > size / sizeof(FieldsRecord) || filesCount > (size - count * sizeof(FieldsRecord)) / sizeof(uint64_t)
+   || poolSize != size - count * sizeof(FieldsRecord) - filesCount * sizeof(uint64_t) || !poolSize || end[-1])
+    return std::shared_ptr<StoredFields const>();
+
+  auto records = cur;
+  cur += count * sizeof(FieldsRecord);
+  std::vector<uint64_t> relativeFiles(static_cast<size_t>(filesCount));
+  for (auto& pos : relativeFiles)
+    ReadInt<uint64_t>(cur, end, pos);
+
+  std::vector<std::string> files;
+  files.reserve(relativeFiles.size());
+  for (auto pos : relativeFiles)
+    files.push_back(MakeFilename(GetFullPath(pos < poolSize ? cur + pos : cur)));
+
+  return std::make_shared<StoredFields>(std::move(file), records, static_cast<size_t>(count), cur, static_cast<size_t>(poolSize), std::move(relativeFiles), std::move(files));
+}
+
+bool TagFileInfo::AppendCacheStat(std::string const& index, time_t tagsModTime)
+{
+  auto mapping = MapTags(index, tagsModTime, 0, 0);
+  if (!mapping)
+    return false;
+
+  std::unique_lock<std::mutex> lock(CacheGuard);
+  auto namesStat = NamesCache->GetStat();
+  auto filesStat = FilesCache->GetStat();
+  auto const cacheModTime = CacheModTime;
+  lock.unlock();
+  namesStat = CorrectStatFilePaths(*this, RefreshNamesCache(this, *mapping, IndexType::Names, std::move(namesStat)));
+  filesStat = CorrectStatFilePaths(*this, RefreshFilesCache(this, *mapping, IndexType::Filenames, std::move(filesStat)));
+  mapping.reset();
+  auto f = FOpen(index.c_str(), "ab");
+  if (!f)
+    return false;
+
+  WriteTagsStat(f.get(), namesStat);
+  WriteTagsStat(f.get(), filesStat);
+  WriteTimeT(f.get(), cacheModTime);
+  return SyncFile(f.get());
+}
+
+// Index is mapped by lookups and other processes, so cached tags are written after tables copied into temporary file, which replaces index
+void TagFileInfo::FlushCache()
+{
+  std::lock_guard<std::mutex> writerLock(*IndexWriterGuard);
+  // Concurrent flushes of the same cache are written one by one
+  std::lock_guard<std::mutex> cacheLock(CacheGuard);
+  size_t offsetSize = 0;
+  auto index = OpenIndex("rb", offsetSize);
+  if (!index || !SkipTables(&*index, offsetSize))
+    return;
+
+  auto tablesSize = Tell(&*index);
+  TemporaryFiles temporary(indexFile + ".tmp");
+  auto const flushedIndex = temporary.Create();
+  auto f = FOpen(flushedIndex.c_str(), "wb");
+  if (!f || Seek(&*index, 0, SEEK_SET))
+    return;
+
+  std::vector<char> buffer(MemBlockSize);
+  for (size_t read = 0; tablesSize > 0 && (read = fread(buffer.data(), 1, static_cast<size_t>(std::min<int64_t>(tablesSize, buffer.size())), &*index)) != 0; tablesSize -= read)
+    fwrite(buffer.data(), 1, read, &*f);
+
+  index.reset();
+  if (tablesSize > 0)
+    return;
+
+  WriteTagsStat(&*f, CorrectStatFilePaths(*this, NamesCache->GetStat()));
+  WriteTagsStat(&*f, CorrectStatFilePaths(*this, FilesCache->GetStat()));
+  WriteTimeT(&*f, CacheModTime);
+  WriteString(&*f, LastVisited);
+  bool const synced = SyncFile(&*f);
+  f.reset();
+  // Resident mapping is kept, since tables are not changed
+  if (synced && Tags::Internal::PublishFile(flushedIndex.c_str(), indexFile.c_str()))
+    IndexWritten(false);
+}
+
+bool TagFileInfo::CreateIndex(time_t tagsModTime, bool singleFileRepos, Tags::IndexProgress const& progress)
+{
+  ResetMapping();
+  auto tagsFile = Tags::Internal::MapFile(filename.c_str());
+  if(!tagsFile)return false;
+
+  std::string const pattern = "!_TAG_FILE_FORMAT";
+  std::string buffer;
+  auto line = GetLine(*tagsFile, 0, buffer);
+  if(!line || strncmp(line, pattern.c_str(), pattern.length()))
+    return false;
+
+  auto const threads = !indexOptions.Threads ? Tags::Internal::GetDefaultThreadsCount() : indexOptions.Threads;
+  TemporaryFiles temporary(indexFile + ".tmp");
+  auto const builtIndex = temporary.Create();
+  bool written = !indexOptions.MemoryLimit ? WriteIndex(*tagsFile, builtIndex, tagsModTime, singleFileRepos, threads, progress)
+                                           : WriteIndexExternally(*tagsFile, builtIndex, tagsModTime, singleFileRepos, threads, progress);
+  if (written)
+    ReportProgress(progress, IndexBuildStage::IndexWritten);
+
+  if (written && indexOptions.StoreFields)
+    WriteFields(*tagsFile, tagsModTime);
+  else
+    remove(fieldsFile.c_str());
+
+  tagsFile.reset();
+  if (!written || !AppendCacheStat(builtIndex, tagsModTime))
+    return false;
+
+  ReportProgress(progress, IndexBuildStage::FieldsWritten);
+  if (!Tags::Internal::PublishFile(builtIndex.c_str(), indexFile.c_str()))
+    return false;
+
+  ReportProgress(progress, IndexBuildStage::Published);
+  return LoadCache();
+}
+
+static bool IndexedLinesLess(IndexType type, LineInfo const& left, LineInfo const& right)
+{
+  auto cmp = CompareIndexedLines(type, left, right);
+  return cmp < 0 || (!cmp && left.pos < right.pos);
+}
+
+// Parses lines of tags file on demand, patching of index touches only lines probed by binary search
+class IndexedLines
+{
+public:
+  explicit IndexedLines(Tags::Internal::MappedFile const& tags)
+    : TagsFile(tags)
+  {
+  }
+
+  LineInfo const& Get(OffsetType offset)
+  {
+    auto found = Lines.find(offset);
+    if (found != Lines.end())
+      return found->second;
+
+    auto line = GetLine(TagsFile, offset, Buffer);
+    TagFields fields;
+    if (!line || !ParseIndexedFields(line, fields))
+      throw std::runtime_error("Invalid tags file format");
+
+    auto result = StoreIndexedFields(fields, Strings);
+    result.pos = offset;
+    return Lines.emplace(offset, result).first->second;
+  }
+
+private:
+  Tags::Internal::MappedFile const& TagsFile;
+  std::unordered_map<OffsetType, LineInfo> Lines;
+  MemBlocks Strings;
+  std::string Buffer;
+};
+
+static OffsetCont ExcludeOffsets(OffsetsView const& offsets, OffsetCont const& sortedExcluded)
+{
+  OffsetCont result;
+  result.reserve(offsets.size());
+  for (size_t i = 0; i < offsets.size(); ++i)
+  {
+    if (!std::binary_search(sortedExcluded.begin(), sortedExcluded.end(), offsets[i]))
+      result.push_back(offsets[i]);
+  }
+
+  return result;
+}
+
+static OffsetCont MergeOffsets(IndexType type, OffsetCont const& table, OffsetCont const& offsets, IndexedLines& lines)
+{
+  auto less = [type, &lines](OffsetType left, OffsetType right) { return IndexedLinesLess(type, lines.Get(left), lines.Get(right)); };
+  OffsetCont sorted(offsets);
+  std::sort(sorted.begin(), sorted.end(), less);
+  OffsetCont result;
+  result.reserve(table.size() + sorted.size());
+  auto begin = table.begin();
+  for (auto offset : sorted)
+  {
+    auto pos = std::upper_bound(begin, table.end(), offset, less);
+    result.insert(result.end(), begin, pos);
+    result.push_back(offset);
+    begin = pos;
+  }
+
+  result.insert(result.end(), begin, table.end());
+  return result;
+}
+
+// Kept lines preserve their order in patched table, so their signatures are copied and only added lines are signed
+static OffsetCont PatchNameSignatures(OffsetsView const& table, OffsetsView const& signatures, OffsetCont const& sortedRemoved, OffsetCont const& patchedTable, IndexedLines& lines)
+{
+  OffsetCont result;
+  result.reserve(patchedTable.size());
+  size_t kept = 0;
+  for (auto offset : patchedTable)
+  {
+    for (; kept < table.size() && std::binary_search(sortedRemoved.begin(), sortedRemoved.end(), table[kept]); ++kept);
+    if (kept < table.size() && table[kept] == offset)
+      result.push_back(signatures[kept++]);
+    else
+      result.push_back(GetNameSignature(lines.Get(offset).name_lower));
+  }
+
+  return result;
+}
+
+bool TagFileInfo::UpdateIndex(IndexPatch const& patch) const
+{
+  // Index and fields files are patched by one writer at a time
+  std::lock_guard<std::mutex> writerLock(*IndexWriterGuard);
+  // Mapped index file can not be truncated on some platforms
+  ResetMapping();
+  FileStat st;
+  auto index = Tags::Internal::MapFile(indexFile.c_str());
+  auto tags = Tags::Internal::MapFile(filename.c_str());
+  if (!index || !tags || GetFileStat(filename.c_str(), &st) == -1)
+    return false;
+
+  char const* cur = index->Data();
+  char const* end = cur + index->Size();
+  time_t storedTagsModTime = 0;
+  size_t offsetSize = 0;
+  if (!ReadSignature(cur, end, offsetSize) || !ReadInt<int64_t>(cur, end, storedTagsModTime) || storedTagsModTime != patch.TagsModTime)
+    return false;
+
+  auto const repoRootBegin = cur;
+  if (!SkipString(cur, end) || !SkipString(cur, end))
+    return false;
+
+  std::string const repoRoot(repoRootBegin, cur);
+  std::array<OffsetsView, static_cast<size_t>(IndexType::EndOfEnum)> tables;
+  for (auto& offsets : tables)
+  {
+    if (!ReadOffsets(cur, end, offsets, offsetSize))
+      return false;
+  }
+
+  OffsetsView signatures;
+  NameSuffixes suffixes;
+  OffsetsView filter;
+  if (!ReadOffsets(cur, end, signatures, NameSignatureSize) || signatures.size() != tables[static_cast<size_t>(IndexType::NamesCaseInsensitive)].size()
+   || !ReadNameSuffixes(cur, end, suffixes)
+   || !ReadOffsets(cur, end, filter, NameFilterWordSize) || filter.size() % NameFilterBlockWords)
+    return false;
+
+  OffsetCont removed(patch.Removed);
+  std::sort(removed.begin(), removed.end());
+  OffsetCont pathOffsets(patch.PathOffsets);
+  std::sort(pathOffsets.begin(), pathOffsets.end());
+  IndexedLines lines(*tags);
+  OffsetCont withClasses;
+  std::copy_if(patch.Added.begin(), patch.Added.end(), std::back_inserter(withClasses), [&lines](OffsetType offset) { return !!*lines.Get(offset).cls; });
+  // Filenames table keeps the first line of every file
+  OffsetCont fileLines;
+  std::set_difference(pathOffsets.begin(), pathOffsets.end(), removed.begin(), removed.end(), std::back_inserter(fileLines));
+  fileLines.insert(fileLines.end(), patch.Added.begin(), patch.Added.end());
+  OffsetCont firstFileLine;
+  if (!fileLines.empty())
+    firstFileLine.push_back(*std::min_element(fileLines.begin(), fileLines.end()));
+
+  std::array<OffsetCont, static_cast<size_t>(IndexType::EndOfEnum)> patched;
+  for (size_t i = 0; i < patched.size(); ++i)
+  {
+    auto type = static_cast<IndexType>(i);
+    auto const& added = type == IndexType::Classes ? withClasses : type == IndexType::Filenames ? firstFileLine : patch.Added;
+    patched[i] = MergeOffsets(type, ExcludeOffsets(tables[i], type == IndexType::Filenames ? pathOffsets : removed), added, lines);
+  }
+
+  auto const patchedSignatures = PatchNameSignatures(tables[static_cast<size_t>(IndexType::NamesCaseInsensitive)], signatures, removed, patched[static_cast<size_t>(IndexType::NamesCaseInsensitive)], lines);
+  // Names of removed lines are kept, so names text may have names absent in tags until index is rebuilt
+  bool const patchNames = indexOptions.InfixSearch && !AreNameSuffixesSkipped(suffixes) && (suffixes.TextSize > 0 || tables[static_cast<size_t>(IndexType::NamesCaseInsensitive)].empty());
+  bool const keepNames = patchNames || (indexOptions.InfixSearch && AreNameSuffixesSkipped(suffixes));
+  std::string names(keepNames ? suffixes.Text : "", keepNames ? suffixes.TextSize : 0);
+  std::set<std::string> addedNames;
+  for (auto offset : patchNames ? patch.Added : OffsetCont())
+  {
+    std::string name = lines.Get(offset).name_lower;
+    if (!HasSuffixName(suffixes, name) && addedNames.insert(name).second)
+      names.append(name.c_str(), name.length() + 1);
+  }
+
+  auto const patchedSuffixes = patchNames ? AddNameSuffixes(names, suffixes.TextSize, suffixes.Suffixes) : OffsetCont();
+  // Bits of removed names are kept, so filter gives more false positives until index is rebuilt
+  OffsetCont nameFilter;
+  for (size_t i = 0; i < filter.size(); ++i)
+    nameFilter.push_back(filter[i]);
+
+  for (auto offset : nameFilter.empty() ? OffsetCont() : patch.Added)
+    AddFilteredName(nameFilter, lines.Get(offset).name);
+
+  std::string const rest(cur, end);
+  index.reset();
+  if (!indexOptions.StoreFields)
+    remove(fieldsFile.c_str());
+  else if (!UpdateFields(*tags, patch, st.st_mtime))
+    WriteFields(*tags, st.st_mtime);
+
+  tags.reset();
+  TemporaryFiles temporary(this->indexFile + ".tmp");
+  auto const patchedIndex = temporary.Create();
+  auto indexFile = FOpen(patchedIndex.c_str(), "wb");
+  FILE* f = indexFile.get();
+  if (!f)
+    return false;
+
+  // Appended lines may require wider offsets
+  offsetSize = GetStoredOffsetSize(static_cast<uint64_t>(st.st_size));
+  WriteSignature(f, offsetSize);
+  WriteTimeT(f, st.st_mtime);
+  fwrite(repoRoot.data(), 1, repoRoot.size(), f);
+  for (auto const& offsets : patched)
+    WriteOffsets(f, offsets, offsetSize);
+
+  WriteOffsets(f, patchedSignatures, NameSignatureSize);
+  WriteNameSuffixes(f, names, patchedSuffixes);
+  WriteOffsets(f, nameFilter, NameFilterWordSize);
+  fwrite(rest.data(), 1, rest.size(), f);
+  bool const synced = SyncFile(f);
+  indexFile.reset();
+  if (!synced || !Tags::Internal::PublishFile(patchedIndex.c_str(), this->indexFile.c_str()))
+    return false;
 
-static TagsStat RefreshNamesCache(TagFileInfo* fi, FILE* f, OffsetCont const& offsets, TagsStat&& tagsWithFreq);
-static TagsStat RefreshFilesCache(TagFileInfo* fi, FILE* f, OffsetCont const& offsets, TagsStat&& tagsWithFreq);
+  IndexWritten(true);
+  return true;
+}
 
-bool TagFileInfo::CreateIndex(time_t tagsModTime, bool singleFileRepos)
+bool TagFileInfo::UpdateFields(Tags::Internal::MappedFile const& tags, IndexPatch const& patch, time_t tagsModTime) const
 {
-  TagFileInfo* fi = this;
-  auto tagsFile = FOpen(fi->filename.c_str(),"rb");
-  FILE *f=tagsFile.get();
-  if(!f)return false;
-  std::vector<LineInfo*> lines;
-  std::vector<LineInfo*> classes;
-
-  std::string const pattern = "!_TAG_FILE_FORMAT";
-  std::string buffer;
-  if(!GetLine(buffer, f) || buffer.compare(0, pattern.length(), pattern))
+  auto previous = MapFields(patch.TagsModTime);
+  if (!previous)
     return false;
 
-  LineInfo *li;
-  std::forward_list<LineInfo> li_pool;
-  MemBlocks linespool;
+  OffsetCont removed(patch.Removed);
+  std::sort(removed.begin(), removed.end());
+  OffsetCont added(patch.Added);
+  std::sort(added.begin(), added.end());
+  FieldsWriter writer(fieldsFile, previous.get());
+  if (!writer.IsOpen())
+    return false;
 
-  std::string pathIntersection;
-  for (int pos=ftell(f); GetLine(buffer, f); pos=ftell(f))
-  {
-    if(buffer[0]=='!' || buffer[0]=='\t')
-      continue;
+  auto stringSize = [&previous](uint64_t pos) -> uint64_t { return pos ? strlen(previous->GetString(pos)) + 1 : 0; };
+  uint64_t liveSize = 1;
+  for (auto pos : previous->GetRelativeFiles())
+    liveSize += stringSize(pos);
 
-    TagFields fields;
-    if (!ParseIndexedFields(buffer.c_str(), fields))
-      return false;
+  std::string buffer;
+  auto next = added.begin();
+  auto addLines = [&](OffsetType end) {
+    for (; next != added.end() && *next < end; ++next)
+    {
+      auto line = GetLine(tags, *next, buffer);
+      TagFields fields;
+      if (line && ParseLine(line, fields))
+        writer.Add(*next, fields);
+    }
+  };
 
-    li_pool.push_front(StoreIndexedFields(fields, linespool));
-    li = &li_pool.front();
-    li->pos = pos;
-    pathIntersection = IsFullPath(fields.File.first) ? GetIntersection(pathIntersection.c_str(), fields.File.first) : pathIntersection;
-    singleFileRepos = singleFileRepos && (lines.empty() || PathsEqual(lines.back()->path, li->path, CaseSensitive));
-    lines.push_back(li);
-    if (*li->cls)
-      classes.push_back(li);
-  }
-  for (; !pathIntersection.empty() && IsPathSeparator(pathIntersection.back()); pathIntersection.resize(pathIntersection.length() - 1));
-  fullpathrepo = !pathIntersection.empty();
-  reporoot = pathIntersection.empty() ? GetDirOfFile(filename) : MakeFilename(pathIntersection);
-  singlefile = singleFileRepos && !lines.empty() ? std::string(GetFilename(lines.back()->path), GetFieldEnd(lines.back()->path)) : "";
-  auto indexFile = FOpen(fi->indexFile.c_str(),"wb");
-  FILE *g=indexFile.get();
-  if(!g)
+  for (size_t i = 0; i < previous->size(); ++i)
   {
-    return false;
+    auto record = previous->Get(i);
+    addLines(record.Offset);
+    if (!std::binary_search(removed.begin(), removed.end(), record.Offset))
+    {
+      writer.Add(record);
+      liveSize += stringSize(record.Name) + stringSize(record.Re) + stringSize(record.Info);
+    }
   }
-  fwrite(IndexFileSignature, 1, sizeof(IndexFileSignature), g);
-  WriteTimeT(g, tagsModTime);
-  WriteString(g, fullpathrepo ? reporoot : std::string());
-  WriteString(g, singlefile);
-  std::sort(lines.begin(), lines.end(), [](LineInfo* left, LineInfo* right) { return FieldLess(left->name, left->name_lower, right->name, right->name_lower); });
-  OffsetCont namesOffsets;
-  std::transform(lines.begin(), lines.end(), std::back_inserter(namesOffsets), [](LineInfo* line){ return line->pos; });
-  WriteOffsets(g, lines.begin(), lines.end());
-  std::sort(lines.begin(), lines.end(), [](LineInfo* left, LineInfo* right) { return FieldLess(left->name_lower, left->path, right->name_lower, right->path); });
-  WriteOffsets(g, lines.begin(), lines.end());
-  std::sort(lines.begin(), lines.end(), [](LineInfo* left, LineInfo* right) { return PathLess(left->path, right->path, CaseSensitive); });
-  WriteOffsets(g, lines.begin(), lines.end());
-  std::sort(classes.begin(), classes.end(), [](LineInfo* left, LineInfo* right) { auto r = right->cls; return FieldCompare(left->cls, r, CaseSensitive, FullCompare) < 0; });
-  WriteOffsets(g, classes.begin(), classes.end());
-  auto linesEnd = std::unique(lines.begin(), lines.end(), [](LineInfo* left, LineInfo* right) { return PathsEqual(left->path, right->path, CaseSensitive); });
-  std::sort(lines.begin(), linesEnd, [](LineInfo* left, LineInfo* right) { return FieldLess(GetFilename(left->path), left->cls, GetFilename(right->path), right->cls); });
-  OffsetCont filesOffsets;
-  std::transform(lines.begin(), linesEnd, std::back_inserter(filesOffsets), [](LineInfo* line){ return line->pos; });
-  WriteOffsets(g, lines.begin(), linesEnd);
-  WriteTagsStat(g, CorrectStatFilePaths(*fi, RefreshNamesCache(fi, f, namesOffsets, NamesCache->GetStat())));
-  WriteTagsStat(g, CorrectStatFilePaths(*fi, RefreshFilesCache(fi, f, filesOffsets, FilesCache->GetStat())));
-  WriteTimeT(g, CacheModTime);
-  tagsFile.reset();
-  indexFile.reset();
-  return LoadCache();
+
+  addLines(std::numeric_limits<OffsetType>::max());
+  // Strings of removed tags stay in pool, fields are written anew once they take its half
+  liveSize += writer.GetPoolSize() - previous->GetPoolSize();
+  if (liveSize * 2 < writer.GetPoolSize())
+    return false;
+
+  previous.reset();
+  return writer.Commit(fieldsFile, tagsModTime);
 }
 
 static std::shared_ptr<Tags::Internal::TagsCache> TagsStatToTagsCache(TagsStat const& stat)
@@ -1029,38 +2918,42 @@ static std::shared_ptr<Tags::Internal::TagsCache> TagsStatToTagsCache(TagsStat c
 
 bool TagFileInfo::LoadCache()
 {
+  std::lock_guard<std::mutex> lock(CacheGuard);
   IndexModTime = 0;
   CacheModTime = 0;
   LastVisited = "";
-  auto f = FOpen(indexFile.c_str(), "r+b");
-  if (!f || !ReadSignature(&*f))
-    return false;
-
-  fseek(&*f, sizeof(time_t), SEEK_CUR);
-  if (!ReadRepoRoot(&*f, reporoot, singlefile))
+  size_t offsetSize = 0;
+  auto f = FOpen(indexFile.c_str(), "rb");
+  if (!f || !ReadSignature(&*f, offsetSize))
     return false;
 
-  fullpathrepo = !reporoot.empty();
-  reporoot = reporoot.empty() ? GetDirOfFile(filename) : reporoot;
-  if (!ReadOffsets(&*f, NamesOffsets))
+  Seek(&*f, sizeof(time_t), SEEK_CUR);
+  std::string root;
+  std::string single;
+  if (!ReadRepoRoot(&*f, root, single))
     return false;
 
-  for (int i = 1; i != static_cast<int>(IndexType::EndOfEnum); ++i)
+  // Lookups read root while repository of unchanged tags file is loaded again, root of the same tags file is not changed
+  bool const fullPath = !root.empty();
+  root = fullPath ? root : GetDirOfFile(filename);
+  if (fullpathrepo != fullPath || reporoot != root || singlefile != single)
   {
-    if (!SkipOffsets(&*f))
-      return false;
+    fullpathrepo = fullPath;
+    reporoot = std::move(root);
+    singlefile = std::move(single);
   }
+  if (!SkipTables(&*f, offsetSize))
+    return false;
 
   if (!IsEndOfFile(&*f))
   {
     TagsStat namesStat;
     TagsStat filesStat;
-    auto tagsCacheBegins = ftell(&*f);
+    // Cached tags failed to be read are written anew by the next flush
     if (!ReadTagsStat(&*f, GetOwnerInfo(), namesStat) || !ReadTagsStat(&*f, GetOwnerInfo(), filesStat))
     {
       NamesCache = Tags::Internal::CreateTagsCache(0);
       FilesCache = Tags::Internal::CreateTagsCache(0);
-      Truncate(&*f, tagsCacheBegins);
     }
     else
     {
@@ -1075,17 +2968,29 @@ bool TagFileInfo::LoadCache()
   return !!IndexModTime;
 }
 
-std::shared_ptr<FILE> TagFileInfo::OpenIndex(char const* mode) const
+bool TagFileInfo::TagsModified() const
+{
+  FileStat tagsStat;
+  if (GetFileStat(filename.c_str(), &tagsStat) == -1)
+    return false;
+
+  size_t offsetSize = 0;
+  time_t storedTagsModTime = 0;
+  auto f = FOpen(indexFile.c_str(), "rb");
+  return !f || !ReadSignature(&*f, offsetSize) || !ReadTimeT(&*f, storedTagsModTime) || storedTagsModTime != tagsStat.st_mtime;
+}
+
+std::shared_ptr<FILE> TagFileInfo::OpenIndex(char const* mode, size_t& offsetSize) const
 {
   if (IndexModified())
     return std::shared_ptr<FILE>();
 
-  struct stat tagsStat;
-  if (stat(filename.c_str(), &tagsStat) == -1)
+  FileStat tagsStat;
+  if (GetFileStat(filename.c_str(), &tagsStat) == -1)
     return std::shared_ptr<FILE>();
 
   auto f = FOpen(indexFile.c_str(), mode);
-  if (!f || !ReadSignature(&*f))
+  if (!f || !ReadSignature(&*f, offsetSize))
     return std::shared_ptr<FILE>();
 
   time_t storedTagsModTime = 0;
@@ -1095,24 +3000,54 @@ std::shared_ptr<FILE> TagFileInfo::OpenIndex(char const* mode) const
   return SkipRepoRoot(&*f) ? std::move(f) : std::shared_ptr<FILE>();
 }
 
-int TagFileInfo::Load(size_t& symbolsLoaded)
+int TagFileInfo::Load(size_t& symbolsLoaded, Tags::IndexProgress const& progress)
 {
-  struct stat st;
-  if (stat(filename.c_str(), &st) == -1)
+  // Index, which is checked, built and rebuilt here, is not written by other repositories of the same tags file meanwhile
+  std::lock_guard<std::mutex> writerLock(*IndexWriterGuard);
+  // Files of resident repository are checked and read again
+  ResetMapping();
+  FileStat st;
+  if (GetFileStat(filename.c_str(), &st) == -1)
 //TODO: return Error(...)
     return ENOENT;
 
   if (IndexModified())
     LoadCache();
 
-  if ((!IndexModTime || !Synchronized()) && !CreateIndex(st.st_mtime, singlefilerepos))
-  {
-    remove(indexFile.c_str());
+  // Index failed to be built or published is not removed, since other repositories of the tags file may use it, the next load builds it again
+  if ((!IndexModTime || !Synchronized()) && !CreateIndex(st.st_mtime, singlefilerepos, progress))
 //TODO: return Error(...)
     return EIO;
+
+  auto mapping = OpenTags();
+  // Optional sections are added to index built without them
+  bool const rebuild = mapping && ((indexOptions.InfixSearch && !mapping->Suffixes.TextSize && !mapping->GetOffsets(IndexType::NamesCaseInsensitive).empty())
+                                || (indexOptions.NameFilter && !mapping->NameFilter.size()));
+  if (rebuild)
+  {
+    mapping.reset();
+    if (!CreateIndex(st.st_mtime, singlefilerepos, progress))
+      return EIO;
+
+    mapping = OpenTags();
+  }
+
+  if (mapping && indexOptions.StoreFields && !mapping->Fields)
+  {
+    auto tags = mapping->Tags;
+    auto tagsModTime = mapping->TagsModTime;
+    mapping.reset();
+    ResetMapping();
+    WriteFields(*tags, tagsModTime);
+    tags.reset();
+    mapping = OpenTags();
   }
 
-  symbolsLoaded = NamesOffsets.size();
+  // Index is written, but tags or index can not be read
+  if (!mapping)
+    return EIO;
+
+  symbolsLoaded = mapping->GetOffsets(IndexType::Names).size();
   return 0;
 }
 
@@ -1205,7 +3140,7 @@ public:
 
   int Compare(char const*& strbuf) const override
   {
-    for (; !IsFieldEnd(*strbuf); ++strbuf);
+    strbuf = GetFieldEnd(strbuf);
     if (!*strbuf)
     //TODO: replace with Error(MNotTagFile)
       throw std::runtime_error("Invalid tags file format");
@@ -1276,7 +3211,7 @@ public:
 
   int Compare(char const*& strbuf) const override
   {
-    for (; !IsFieldEnd(*strbuf); ++strbuf);
+    strbuf = GetFieldEnd(strbuf);
     if (!*strbuf)
     //TODO: replace with Error(MNotTagFile)
       throw std::runtime_error("Invalid tags file format");
@@ -1286,19 +3221,19 @@ public:
   }
 };
 
-static char const* GetLine(size_t pos, FILE* f, OffsetCont const& offsets, std::string& buffer)
+static char const* GetLine(size_t pos, Tags::Internal::MappedFile const& tags, OffsetsView const& offsets, std::string& buffer)
 {
-  fseek(f, offsets.at(pos), SEEK_SET);
-  return GetLine(buffer, f);
+  auto line = GetLine(tags, offsets.at(pos), buffer);
+  return line ? line : (buffer.clear(), buffer.c_str());
 }
 
-static size_t binary_search(size_t left, size_t right, std::function<bool(char const* strbuf)>&& pred, FILE* f, OffsetCont const& offsets)
+static size_t binary_search(size_t left, size_t right, std::function<bool(char const* strbuf)>&& pred, Tags::Internal::MappedFile const& tags, OffsetsView const& offsets)
 {
   std::string buffer;
   while (left < right)
   {
     auto middle = (left + right) / 2;
-    if (pred(GetLine(middle, f, offsets, buffer)))
+    if (pred(GetLine(middle, tags, offsets, buffer)))
       left = middle + 1;
     else
       right = middle;
@@ -1307,73 +3242,342 @@ static size_t binary_search(size_t left, size_t right, std::function<bool(char c
   return left;
 }
 
-static std::tuple<size_t, size_t, size_t> GetMatchedOffsetRange(FILE* f, OffsetCont const& offsets, MatchVisitor const& visitor)
+static bool GetSampledKey(IndexType index, char const* line, std::string& key)
+{
+  switch (index)
+  {
+  case IndexType::Names:
+  case IndexType::NamesCaseInsensitive:
+    key.assign(line, GetFieldEnd(line));
+    return true;
+  case IndexType::Paths:
+  case IndexType::Filenames:
+  {
+    auto end = GetFieldEnd(line);
+    if (*end != '\t')
+      return false;
+
+    key.assign(line, GetFieldEnd(end + 1));
+    return true;
+  }
+  case IndexType::Classes:
+  {
+    auto cls = ExtractClassName(FindClassFullQualification(line));
+    if (!cls)
+      return false;
+
+    key.assign("\tclass:");
+    key.append(cls, GetFieldEnd(cls));
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+SampledKeys const& TagsMapping::GetSampledKeys(IndexType index) const
+{
+  auto& samples = Samples.at(static_cast<size_t>(index));
+  std::call_once(SamplesOnce.at(static_cast<size_t>(index)), [this, index, &samples]() {
+    auto const& offsets = GetOffsets(index);
+    std::string buffer;
+    std::string key;
+    for (size_t i = 0; i < offsets.size(); i += SampledKeys::Interval)
+    {
+      if (!GetSampledKey(index, GetLine(i, *Tags, offsets, buffer), key))
+      {
+        // Lines are searched in tags file as is
+        samples.Clear();
+        return;
+      }
+
+      samples.Add(key.data(), key.data() + key.length());
+    }
+  });
+  return samples;
+}
+
+// Finds sampled block of [left, right) where pred becomes false, then searches it in tags file
+static size_t binary_search(size_t left, size_t right, std::function<bool(char const* strbuf)>&& pred, Tags::Internal::MappedFile const& tags, OffsetsView const& offsets, SampledKeys const& samples)
+{
+  auto const interval = SampledKeys::Interval;
+  auto first = std::min((left + interval - 1) / interval, samples.size());
+  auto last = std::min((right + interval - 1) / interval, samples.size());
+  auto sample = first;
+  for (auto count = last - first; count > 0;)
+  {
+    auto step = count / 2;
+    if (pred(samples[sample + step]))
+    {
+      sample += step + 1;
+      count -= step + 1;
+    }
+    else
+    {
+      count = step;
+    }
+  }
+
+  auto blockBegin = sample > first ? (sample - 1) * interval + 1 : left;
+  auto blockEnd = sample < last ? sample * interval : right;
+  return binary_search(blockBegin, std::max(blockBegin, blockEnd), std::move(pred), tags, offsets);
+}
+
+// Lines are searched within [begin, end), which must contain all lines matched by visitor
+static std::tuple<size_t, size_t, size_t> GetMatchedOffsetRange(TagsMapping const& mapping, IndexType index, MatchVisitor const& visitor, size_t begin = 0, size_t end = std::numeric_limits<size_t>::max())
 {
+  auto const& offsets = mapping.GetOffsets(index);
   if (offsets.empty() || visitor.GetPattern().empty())
     return std::make_tuple(0, 0, offsets.size());
 
+  end = std::min(end, offsets.size());
+  begin = std::min(begin, end);
+  auto const& tags = *mapping.Tags;
+  auto const& samples = mapping.GetSampledKeys(index);
+  auto left = binary_search(begin, end, [&visitor](char const* str){ return visitor.Compare(str) > 0; }, tags, offsets, samples);
+  auto right = binary_search(left, end, [&visitor](char const* str){ return visitor.Compare(str) >= 0; }, tags, offsets, samples);
+  auto exact = binary_search(left, right, [&visitor](char const* str){ visitor.Compare(str); return IsFieldEnd(*str); }, tags, offsets, samples);
+  return std::make_tuple(left, exact, right);
+}
+
+static TagInfo GetTag(TagFileInfo const* fi, TagsMapping const& mapping, OffsetsView const& offsets, size_t pos, std::string& buffer)
+{
+  FieldsRecord record;
+  if (mapping.Fields && mapping.Fields->Find(offsets.at(pos), record))
+    return MakeTag(*mapping.Fields, record, *fi);
+
+  TagFields fields;
+  return ParseLine(GetLine(pos, *mapping.Tags, offsets, buffer), fields) ? MakeTag(fields, *fi) : TagInfo();
+}
+
+// Lookup by pattern extending the pattern of previous lookup in the same index is narrowed to its range, range is updated then
+static std::tuple<size_t, size_t, size_t> GetMatchedOffsetRange(std::shared_ptr<TagsMapping const> const& mapping, IndexType index, MatchVisitor const& visitor, Tags::Internal::LookupRange* range)
+{
+  if (!range)
+    return GetMatchedOffsetRange(*mapping, index, visitor);
+
+  bool const narrowed = range->Index.lock() == mapping && range->Table == static_cast<int>(index) && !visitor.GetPattern().compare(0, range->Part.length(), range->Part);
+  auto matched = narrowed ? GetMatchedOffsetRange(*mapping, index, visitor, range->Begin, range->End) : GetMatchedOffsetRange(*mapping, index, visitor);
+  range->Part = visitor.GetPattern();
+  range->Index = mapping;
+  range->Table = static_cast<int>(index);
+  range->Begin = std::get<0>(matched);
+  range->End = std::get<2>(matched);
+  return matched;
+}
+
+size_t const LookupBatchSize = 256;
+
+// Tags are passed in batches, so lookup may be stopped by receiver. Returns false if it is stopped
+static bool StreamMatchedTagsInRange(TagFileInfo const* fi, TagsMapping const& mapping, IndexType index, MatchVisitor const& visitor, std::tuple<size_t, size_t, size_t> const& range, size_t maxCount, size_t maxTotal, Tags::Internal::TagsReceiver const& receiver)
+{
+  std::vector<TagInfo> batch;
   std::string buffer;
-  size_t left = 0;
-  size_t right = offsets.size();
-  while (left < right)
+  size_t found = 0;
+  auto const& offsets = mapping.GetOffsets(index);
+  for(auto i = std::get<0>(range); found < maxTotal && (i < std::get<1>(range) || (found < maxCount && i < std::get<2>(range))); ++i)
   {
-    auto middle = (left + right) / 2;
-    auto strbuf = GetLine(middle, f, offsets, buffer);
-    auto cmp = visitor.Compare(strbuf);
-    if (cmp > 0)
-      left = middle + 1;
-    else if(cmp < 0)
-      right = middle;
-    else
-      break;
+    auto tag = GetTag(fi, mapping, offsets, i, buffer);
+    if (!tag.Owner || !visitor.Filter(tag))
+      continue;
+
+    batch.push_back(std::move(tag));
+    ++found;
+    if (batch.size() == LookupBatchSize && !receiver(std::move(batch)))
+      return false;
+
+    if (batch.size() == LookupBatchSize)
+      batch.clear();
   }
+  return batch.empty() || receiver(std::move(batch));
+}
 
-  left = binary_search(left, right, [&visitor](char const* str){ return visitor.Compare(str) > 0; }, f, offsets);
-  right = binary_search(left, right, [&visitor](char const* str){ return visitor.Compare(str) >= 0; }, f, offsets);
-  auto exact = binary_search(left, right, [&visitor](char const* str){ visitor.Compare(str); return IsFieldEnd(*str); }, f, offsets);
-  return std::make_tuple(left, exact, right);
+static Tags::Internal::TagsReceiver CollectTags(std::vector<TagInfo>& result)
+{
+  return [&result](std::vector<TagInfo>&& tags) {
+    std::move(tags.begin(), tags.end(), std::back_inserter(result));
+    return true;
+  };
+}
+
+static std::vector<TagInfo> GetMatchedTagsInRange(TagFileInfo const* fi, TagsMapping const& mapping, IndexType index, MatchVisitor const& visitor, std::tuple<size_t, size_t, size_t> const& range, size_t maxCount, size_t maxTotal)
+{
+  std::vector<TagInfo> result;
+  StreamMatchedTagsInRange(fi, mapping, index, visitor, range, maxCount, maxTotal, CollectTags(result));
+  return std::move(result);
+}
+
+static std::vector<TagInfo> GetMatchedTagsImpl(TagFileInfo const* fi, TagsMapping const& mapping, IndexType index, MatchVisitor const& visitor, size_t maxCount, size_t maxTotal = std::numeric_limits<size_t>::max())
+{
+  return GetMatchedTagsInRange(fi, mapping, index, visitor, GetMatchedOffsetRange(mapping, index, visitor), maxCount, maxTotal);
 }
 
-static std::vector<TagInfo> GetMatchedTagsImpl(TagFileInfo const* fi, FILE* f, OffsetCont const& offsets, MatchVisitor const& visitor, size_t maxCount, size_t maxTotal = std::numeric_limits<size_t>::max())
+static bool StreamMatchedTags(TagFileInfo const* fi, IndexType index, MatchVisitor const& visitor, size_t maxCount, size_t maxTotal, Tags::Internal::LookupRange* range, Tags::Internal::TagsReceiver const& receiver)
 {
+  auto mapping = OpenSynchronizedTags(*fi);
+  return StreamMatchedTagsInRange(fi, *mapping, index, visitor, GetMatchedOffsetRange(mapping, index, visitor, range), maxCount, maxTotal, receiver);
+}
+
+static std::vector<TagInfo> GetMatchedTags(TagFileInfo const* fi, IndexType index, MatchVisitor const& visitor, size_t maxCount, size_t maxTotal, Tags::Internal::LookupRange* range = nullptr)
+{
+  auto mapping = OpenSynchronizedTags(*fi);
+  return GetMatchedTagsInRange(fi, *mapping, index, visitor, GetMatchedOffsetRange(mapping, index, visitor, range), maxCount, maxTotal);
+}
+
+static std::vector<TagInfo> GetMatchedTags(TagFileInfo const* fi, IndexType index, MatchVisitor const& visitor, size_t maxTotal = std::numeric_limits<size_t>::max(), Tags::Internal::LookupRange* range = nullptr)
+{
+  return visitor.GetPattern().empty() ? std::vector<TagInfo>() : GetMatchedTags(fi, index, visitor, maxTotal, maxTotal, range);
+}
+
+// Score, length of name and position in case insensitive names table, better matches go first
+using FuzzyMatch = std::tuple<int, size_t, size_t>;
+
+static bool FuzzyMatchBetter(FuzzyMatch const& left, FuzzyMatch const& right)
+{
+  return std::get<0>(left) != std::get<0>(right) ? std::get<0>(left) > std::get<0>(right) : std::make_pair(std::get<1>(left), std::get<2>(left)) < std::make_pair(std::get<1>(right), std::get<2>(right));
+}
+
+// Lines are read only if signature of name has all characters of pattern, equal names are adjacent in the table and scored once
+static std::vector<TagInfo> GetFuzzyMatchedTags(TagFileInfo const* fi, char const* pattern, size_t maxCount)
+{
+  Tags::Internal::FuzzyPattern const fuzzy(pattern);
+  if (!*pattern || !maxCount)
+    return std::vector<TagInfo>();
+
+  auto mapping = OpenSynchronizedTags(*fi);
+  auto const& offsets = mapping->GetOffsets(IndexType::NamesCaseInsensitive);
+  auto const signature = fuzzy.GetSignature();
+  std::vector<FuzzyMatch> best;
+  std::string buffer;
+  std::string name;
+  bool matched = false;
+  int score = 0;
+  for (size_t i = 0; i < offsets.size(); ++i)
+  {
+    if ((mapping->NameSignatures[i] & signature) != signature)
+      continue;
+
+    auto line = GetLine(i, *mapping->Tags, offsets, buffer);
+    auto nameEnd = GetFieldEnd(line);
+    if (name.length() != static_cast<size_t>(nameEnd - line) || name.compare(0, name.length(), line, nameEnd - line))
+    {
+      name.assign(line, nameEnd);
+      matched = fuzzy.Matches(line, nameEnd, score);
+    }
+
+    FuzzyMatch match(score, name.length(), i);
+    if (!matched || (best.size() == maxCount && !FuzzyMatchBetter(match, best.front())))
+      continue;
+
+    if (best.size() == maxCount)
+    {
+      std::pop_heap(best.begin(), best.end(), FuzzyMatchBetter);
+      best.pop_back();
+    }
+
+    best.push_back(match);
+    std::push_heap(best.begin(), best.end(), FuzzyMatchBetter);
+  }
+
+  std::sort_heap(best.begin(), best.end(), FuzzyMatchBetter);
   std::vector<TagInfo> result;
-  auto range = GetMatchedOffsetRange(&*f, offsets, visitor);
-  for(auto i = std::get<0>(range); result.size() < maxTotal && (i < std::get<1>(range) || (result.size() < maxCount && i < std::get<2>(range))); ++i)
+  for (auto const& match : best)
   {
-    fseek(&*f, offsets[i], SEEK_SET);
-    std::string line;
-    GetLine(line, &*f);
-    TagFields fields;
-    auto tag = ParseLine(line.c_str(), fields) ? MakeTag(fields, *fi) : TagInfo();
-    if (!!tag.Owner && visitor.Filter(tag))
+    auto tag = GetTag(fi, *mapping, offsets, std::get<2>(match), buffer);
+    if (!!tag.Owner)
       result.push_back(std::move(tag));
   }
-  return std::move(result);
+
+  return result;
+}
+
+// Names absent in filter of names are not searched in tags file
+static std::vector<TagInfo> GetNamedTags(TagFileInfo const* fi, char const* name)
+{
+  auto mapping = OpenSynchronizedTags(*fi);
+  if (!*name || !MayHaveName(mapping->NameFilter, name))
+    return std::vector<TagInfo>();
+
+  return GetMatchedTagsImpl(fi, *mapping, IndexType::Names, NameMatch(name, FullCompare, CaseSensitive), std::numeric_limits<size_t>::max());
 }
 
-static std::vector<TagInfo> GetMatchedTags(TagFileInfo const* fi, IndexType index, MatchVisitor const& visitor, size_t maxCount, size_t maxTotal)
+// Visits distinct lower case names containing part until visitor returns false, names starting with part go first
+static void VisitInfixMatchedNames(TagsMapping const& mapping, std::string const& part, std::function<bool(char const*)> const& visitor)
 {
-  OffsetCont offsets;
-  auto f = fi->OpenTags(offsets, index);
-  return !f ? std::vector<TagInfo>() : GetMatchedTagsImpl(fi, &*f, offsets, visitor, maxCount, maxTotal);
+  if (!mapping.Suffixes.Suffixes.empty())
+  {
+    auto range = FindNameSuffixes(mapping.Suffixes, part);
+    // Names are stored once, so names starting with part are suffixes at starts of names
+    for (auto i = range.first; i < range.second; ++i)
+    {
+      auto suffix = mapping.Suffixes.Text + mapping.Suffixes.Suffixes[i];
+      if (GetSuffixName(mapping.Suffixes, i) == suffix && !visitor(suffix))
+        return;
+    }
+
+    // Name is found once for every occurrence of part
+    std::unordered_set<char const*> visited;
+    for (auto i = range.first; i < range.second; ++i)
+    {
+      auto name = GetSuffixName(mapping.Suffixes, i);
+      if (strncmp(name, part.c_str(), part.length()) && visited.insert(name).second && !visitor(name))
+        return;
+    }
+
+    return;
+  }
+
+  // Index is built without infix search, so names are scanned
+  auto const& offsets = mapping.GetOffsets(IndexType::NamesCaseInsensitive);
+  std::string buffer;
+  for (auto prefix : {true, false})
+  {
+    std::string name;
+    for (size_t i = 0; i < offsets.size(); ++i)
+    {
+      auto line = GetLine(i, *mapping.Tags, offsets, buffer);
+      auto nameEnd = GetFieldEnd(line);
+      if (i > 0 && static_cast<size_t>(nameEnd - line) == name.length() && std::equal(line, nameEnd, name.begin(), [](char c, char lower) { return tolower(static_cast<unsigned char>(c)) == lower; }))
+        continue;
+
+      name.assign(line, nameEnd);
+      std::transform(name.begin(), name.end(), name.begin(), [](char c) { return static_cast<char>(tolower(static_cast<unsigned char>(c))); });
+      auto pos = name.find(part);
+      if (pos != std::string::npos && !pos == prefix && !visitor(name.c_str()))
+        return;
+    }
+  }
 }
 
-static std::vector<TagInfo> GetMatchedTags(TagFileInfo const* fi, IndexType index, MatchVisitor const& visitor, size_t maxTotal = std::numeric_limits<size_t>::max())
+static std::vector<TagInfo> GetInfixMatchedTags(TagFileInfo const* fi, char const* part, size_t maxCount)
 {
-  return visitor.GetPattern().empty() ? std::vector<TagInfo>() : GetMatchedTags(fi, index, visitor, maxTotal, maxTotal);
+  std::string lowerPart(part);
+  std::transform(lowerPart.begin(), lowerPart.end(), lowerPart.begin(), [](char c) { return static_cast<char>(tolower(static_cast<unsigned char>(c))); });
+  std::vector<TagInfo> result;
+  if (lowerPart.empty() || !maxCount)
+    return result;
+
+  auto mapping = OpenSynchronizedTags(*fi);
+  // Names of removed tags may stay in index and match no tags, so names are visited until enough tags are found
+  VisitInfixMatchedNames(*mapping, lowerPart, [&](char const* name)
+  {
+    auto tags = GetMatchedTagsImpl(fi, *mapping, IndexType::NamesCaseInsensitive, NameMatch(name, FullCompare, CaseInsensitive), 0, maxCount - result.size());
+    std::move(tags.begin(), tags.end(), std::back_inserter(result));
+    return result.size() < maxCount;
+  });
+  return result;
 }
 
 OffsetCont GetMatchedOffsets(TagFileInfo const& fi, IndexType index, MatchVisitor const& visitor)
 {
-  OffsetCont offsets;
-  auto f = fi.OpenTags(offsets, index);
-  if (!f)
-    throw std::runtime_error("Failed to load offests");
+  auto mapping = OpenSynchronizedTags(fi);
+  auto const& offsets = mapping->GetOffsets(index);
+  auto range = GetMatchedOffsetRange(*mapping, index, visitor);
+  OffsetCont result;
+  for (auto i = std::get<0>(range); i < std::get<2>(range); ++i)
+    result.push_back(offsets[i]);
 
-  auto range = GetMatchedOffsetRange(&*f, offsets, visitor);
-  std::copy(offsets.begin() + std::get<0>(range), offsets.begin() + std::get<2>(range), offsets.begin());
-  offsets.resize(std::get<2>(range) - std::get<0>(range));
-  return std::move(offsets);
+  return std::move(result);
 }
 
 static std::vector<TagInfo> MatchTags(std::vector<TagInfo>&& tags, MatchVisitor const& visitor)
@@ -1386,22 +3590,17 @@ static std::vector<TagInfo> MatchTags(std::vector<TagInfo>&& tags, MatchVisitor
   return std::move(tags);
 }
 
+// Tags of current file are partitioned before sorting, so paths are not compared on every comparison
 class TagsLess
 {
 public:
-  TagsLess(char const* file, SortingOptions sortOptions)
-    : File(file)
-    , Options(sortOptions)
+  explicit TagsLess(SortingOptions sortOptions)
+    : Options(sortOptions)
   {
   }
 
   bool operator() (TagInfo const& left, TagInfo const& right) const
   {
-    auto leftSamePath = !!(Options & SortingOptions::CurFileFirst) && PathsEqual(left.file.c_str(), File);
-    auto rightSamePath = !!(Options & SortingOptions::CurFileFirst) && PathsEqual(right.file.c_str(), File);
-    if (leftSamePath != rightSamePath)
-      return leftSamePath && !rightSamePath;
-  
     int cmp = 0;
     if (!!(Options & SortingOptions::SortByName) && (cmp = left.name.compare(right.name)))
       return cmp < 0;
@@ -1413,33 +3612,60 @@ public:
   }
 
 private:
-  char const* File;
   SortingOptions const Options;
 };
 
 std::vector<TagInfo> Tags::SortTags(std::vector<TagInfo>&& tags, char const* file, SortingOptions sortOptions)
 {
   if (sortOptions != SortingOptions::DoNotSort)
-    std::sort(tags.begin(), tags.end(), TagsLess(file, sortOptions));
+  {
+    TagsLess const less(sortOptions);
+    auto curFileEnd = !(sortOptions & SortingOptions::CurFileFirst) ? tags.begin() : std::partition(tags.begin(), tags.end(), [file](TagInfo const& tag) {
+      return PathsEqual(tag.file.c_str(), file);
+    });
+    std::sort(tags.begin(), curFileEnd, less);
+    std::sort(curFileEnd, tags.end(), less);
+  }
 
   return std::move(tags);
 }
 
+// Looks tags up without copying them
+struct TagInfoPtrLess
+{
+  bool operator() (TagInfo const* left, TagInfo const* right) const
+  {
+    return *left < *right;
+  }
+};
+
+using TagsLookup = std::set<TagInfo const*, TagInfoPtrLess>;
+
+static TagsLookup MakeTagsLookup(std::vector<TagInfo> const& tags)
+{
+  TagsLookup result;
+  for (auto const& tag : tags)
+    result.insert(&tag);
+
+  return result;
+}
+
 static std::vector<TagInfo>::iterator PartitionTopTags(std::vector<TagInfo>& tags, std::vector<TagInfo> const& tagsOnTop)
 {
-  std::set<TagInfo> topTags(tagsOnTop.begin(), tagsOnTop.end());
-  return std::stable_partition(tags.begin(), tags.end(), [&topTags](TagInfo const& tag) { return topTags.count(tag) > 0; });
+  auto topTags = MakeTagsLookup(tagsOnTop);
+  return std::stable_partition(tags.begin(), tags.end(), [&topTags](TagInfo const& tag) { return topTags.count(&tag) > 0; });
 }
 
+// Partitioned tags are moved into order of tags on top instead of being copied
 static void OrderPartitionedTags(std::vector<TagInfo>::iterator begin, std::vector<TagInfo>::iterator end, std::vector<TagInfo> const& tagsOnTop)
 {
-  std::set<TagInfo> partitionedTags(begin, end);
-  for (auto tagOnTop = tagsOnTop.begin(); tagOnTop != tagsOnTop.end() && begin != end; ++tagOnTop)
-  {
-    auto found = partitionedTags.find(*tagOnTop);
-    if (found != partitionedTags.end())
-      *begin++ = *found;
-  }
+  std::map<TagInfo const*, size_t, TagInfoPtrLess> positions;
+  for (size_t i = 0; i < tagsOnTop.size(); ++i)
+    positions.emplace(&tagsOnTop[i], i);
+
+  std::stable_sort(begin, end, [&positions](TagInfo const& left, TagInfo const& right) {
+    return positions.find(&left)->second < positions.find(&right)->second;
+  });
 }
 
 std::vector<TagInfo> Tags::MoveOnTop(std::vector<TagInfo>&& tags, std::vector<TagInfo> const& tagsOnTop)
@@ -1450,11 +3676,26 @@ std::vector<TagInfo> Tags::MoveOnTop(std::vector<TagInfo>&& tags, std::vector<Ta
 
 std::vector<TagInfo> MergeUnique(std::vector<TagInfo>&& into, std::vector<TagInfo>&& what)
 {
-  std::set<TagInfo> lookup(into.begin(), into.end());
-  std::copy_if(std::make_move_iterator(what.begin()), std::make_move_iterator(what.end()), std::back_inserter(into), [&lookup](TagInfo const& tag) {return lookup.count(tag) == 0; });
+  // Lookup points into tags, so they must not be reallocated
+  into.reserve(into.size() + what.size());
+  auto lookup = MakeTagsLookup(into);
+  std::copy_if(std::make_move_iterator(what.begin()), std::make_move_iterator(what.end()), std::back_inserter(into), [&lookup](TagInfo const& tag) {return lookup.count(&tag) == 0; });
   return std::move(into);
 }
 
+// Streaming counterpart of MergeUnique: tags passed first go at once, then batches without tags equal to them
+static bool StreamUnique(std::vector<TagInfo>&& first, std::function<bool(Tags::Internal::TagsReceiver const&)> const& stream, Tags::Internal::TagsReceiver const& receiver)
+{
+  auto lookup = MakeTagsLookup(first);
+  if (!first.empty() && !receiver(std::vector<TagInfo>(first)))
+    return false;
+
+  return stream([&lookup, &receiver](std::vector<TagInfo>&& tags) {
+    tags.erase(std::remove_if(tags.begin(), tags.end(), [&lookup](TagInfo const& tag) { return lookup.count(&tag) > 0; }), tags.end());
+    return tags.empty() || receiver(std::move(tags));
+  });
+}
+
 static bool IsDecimal(char c)
 {
   return c >= '0' && c <= '9';
@@ -1591,13 +3832,13 @@ private:
   TagInfo const& Tag;
 };
 
-static TagsStat RefreshNamesCache(TagFileInfo* fi, FILE* f, OffsetCont const& offsets, TagsStat&& tagsWithFreq)
+static TagsStat RefreshNamesCache(TagFileInfo* fi, TagsMapping const& mapping, IndexType index, TagsStat&& tagsWithFreq)
 {
   auto cur = tagsWithFreq.begin();
   for (auto i = tagsWithFreq.begin(); i != tagsWithFreq.end(); ++i)
   {
     auto visitor = TagMatch(i->first);
-    auto foundTags = GetMatchedTagsImpl(fi, f, offsets, visitor, std::numeric_limits<size_t>::max());
+    auto foundTags = GetMatchedTagsImpl(fi, mapping, index, visitor, std::numeric_limits<size_t>::max());
     if (!foundTags.empty())
       (cur++)->first = std::move(foundTags.back());
   }
@@ -1608,7 +3849,7 @@ static TagsStat RefreshNamesCache(TagFileInfo* fi, FILE* f, OffsetCont const& of
 
 using Tags::GetNamePathLine;
 
-static TagsStat RefreshFilesCache(TagFileInfo* fi, FILE* f, OffsetCont const& offsets, TagsStat&& tagsWithFreq)
+static TagsStat RefreshFilesCache(TagFileInfo* fi, TagsMapping const& mapping, IndexType index, TagsStat&& tagsWithFreq)
 {
 //TODO: refactor duplicated code
   auto cur = tagsWithFreq.begin();
@@ -1616,7 +3857,7 @@ static TagsStat RefreshFilesCache(TagFileInfo* fi, FILE* f, OffsetCont const& of
   {
     auto namePathLine = GetNamePathLine(i->first.file.c_str());
     auto visitor = FilenameMatch(std::move(std::get<0>(namePathLine)), std::move(std::get<1>(namePathLine)), FullCompare);
-    auto foundTags = GetMatchedTagsImpl(fi, f, offsets, visitor, std::numeric_limits<size_t>::max());
+    auto foundTags = GetMatchedTagsImpl(fi, mapping, index, visitor, std::numeric_limits<size_t>::max());
     if (!foundTags.empty())
       (cur++)->first = MakeFileTag(std::move(foundTags.back()));
   }
@@ -1739,10 +3980,12 @@ namespace
     return StrReplace(std::move(line), fields.File.first - line.c_str(), fields.File.second - line.c_str(), newPath);
   }
 
-  void AddRemoveLines(std::pair<OffsetCont, LinePositionCont> lines, std::string crlf, std::string pathSubst, std::fstream fromStream, std::fstream intoStream)
+  // Returns offsets of added lines
+  OffsetCont AddRemoveLines(std::pair<OffsetCont, LinePositionCont> lines, std::string crlf, std::string pathSubst, std::fstream fromStream, std::fstream intoStream)
   {
       auto const addLines = std::move(lines.first);
       auto removeLines = std::move(lines.second);
+      OffsetCont added;
       std::sort(removeLines.begin(), removeLines.end(), [](LinePosition const& left, LinePosition const& right){return left.second < right.second;});
       for (auto const& addLine : addLines)
       {
@@ -1751,10 +3994,12 @@ namespace
         if (found == removeLines.end())
         {
           intoStream.seekp(0, std::ios_base::end);
+          added.push_back(static_cast<OffsetType>(intoStream.tellp()));
           intoStream << line << crlf;
         }
         else
         {
+          added.push_back(found->first);
           OverwriteLine(intoStream, *found, line);
           found->second = 0;
         }
@@ -1764,6 +4009,8 @@ namespace
       {
         OverwriteLine(intoStream, removeLine, std::string());
       }
+
+      return added;
   }
 }
 
@@ -1772,14 +4019,14 @@ namespace
   class RepositoryImpl : public Tags::Internal::Repository
   {
   public:
-    RepositoryImpl(char const* filename, bool singleFileRepos)
-      : Info(filename, singleFileRepos)
+    RepositoryImpl(char const* filename, bool singleFileRepos, Tags::IndexOptions const& options, std::shared_ptr<Tags::Internal::ResidentBudget> budget)
+      : Info(filename, singleFileRepos, options, std::move(budget))
     {
     }
 
-    int Load(size_t& symbolsLoaded) override
+    int Load(size_t& symbolsLoaded, Tags::IndexProgress const& progress) override
     {
-      return Info.Load(symbolsLoaded);
+      return Info.Load(symbolsLoaded, progress);
     }
 
     bool Belongs(char const* file) const override
@@ -1804,30 +4051,46 @@ namespace
 
     std::vector<TagInfo> FindByName(const char* name) const override
     {
-      return GetMatchedTags(&Info, IndexType::Names, NameMatch(name, FullCompare, CaseSensitive));
+      return GetNamedTags(&Info, name);
     }
 
-    std::vector<TagInfo> FindByName(const char* part, size_t maxCount, size_t maxTotal, bool caseInsensitive, bool useCached) const override
+    std::vector<TagInfo> FindByName(const char* part, size_t maxCount, size_t maxTotal, bool caseInsensitive, bool useCached, Tags::Internal::LookupRange* range) const override
     {
-      maxCount = maxTotal > 0 ? std::min(maxCount, maxTotal) : maxCount;
-      maxTotal = maxTotal == 0 ? std::numeric_limits<size_t>::max() : maxTotal;
-      auto cachedTags = maxCount > 0 && useCached ? GetCachedTags(false, maxCount) : std::vector<TagInfo>();
-      auto visitor = NameMatch(part, PartialCompare, caseInsensitive);
-      cachedTags = MatchTags(std::move(cachedTags), visitor);
-      auto indexType = caseInsensitive ? IndexType::NamesCaseInsensitive : IndexType::Names;
-      auto matched = !maxCount ? GetMatchedTags(&Info, indexType, visitor, maxTotal - cachedTags.size())
-                               : GetMatchedTags(&Info, indexType, visitor, maxCount - cachedTags.size(), maxTotal - cachedTags.size());
-      return MergeUnique(std::move(cachedTags), std::move(matched));
+      std::vector<TagInfo> result;
+      FindByNameImpl(part, maxCount, maxTotal, caseInsensitive, useCached, range, CollectTags(result));
+      return std::move(result);
+    }
+
+    void FindByPart(const char* part, bool getFiles, size_t maxCount, size_t maxTotal, bool caseInsensitive, bool useCached, Tags::Internal::LookupRange* range, Tags::Internal::TagsReceiver const& receiver) const override
+    {
+      if (getFiles)
+        FindFilesImpl(part, PartialCompare, maxCount, useCached, range, receiver);
+      else
+        FindByNameImpl(part, maxCount, maxTotal, caseInsensitive, useCached, range, receiver);
+    }
+
+    std::vector<TagInfo> FindByNameFuzzy(const char* pattern, size_t maxCount) const override
+    {
+      return GetFuzzyMatchedTags(&Info, pattern, maxCount);
+    }
+
+    std::vector<TagInfo> FindByNameInfix(const char* part, size_t maxCount) const override
+    {
+      return GetInfixMatchedTags(&Info, part, maxCount);
     }
 
     std::vector<TagInfo> FindFiles(const char* path) const override
     {
-      return FindFilesImpl(path, FullCompare, 0, false);
+      std::vector<TagInfo> result;
+      FindFilesImpl(path, FullCompare, 0, false, nullptr, CollectTags(result));
+      return std::move(result);
     }
 
-    std::vector<TagInfo> FindFiles(const char* part, size_t maxCount, bool useCached) const override
+    std::vector<TagInfo> FindFiles(const char* part, size_t maxCount, bool useCached, Tags::Internal::LookupRange* range) const override
     {
-      return FindFilesImpl(part, PartialCompare, maxCount, useCached);
+      std::vector<TagInfo> result;
+      FindFilesImpl(part, PartialCompare, maxCount, useCached, range, CollectTags(result));
+      return std::move(result);
     }
 
     std::vector<TagInfo> FindClassMembers(const char* classname) const override
@@ -1865,6 +4128,26 @@ namespace
       return Info.ElapsedSinceCached();
     }
 
+    size_t ResidentSize() const override
+    {
+      return Info.GetResidentSize();
+    }
+
+    void ReleaseFiles() override
+    {
+      Info.ReleaseMapping();
+    }
+
+    void PinFiles() override
+    {
+      Info.PinMapping();
+    }
+
+    bool TagsModified() const override
+    {
+      return Info.TagsModified();
+    }
+
     void ResetCacheCounters(bool flush) override
     {
       Info.ResetCacheCounters();
@@ -1891,34 +4174,62 @@ namespace
     {
       auto relativePath = GetRelativePath(Info, file); // check that file belongs to repository
       auto pathInTags = Info.IsFullPathRepo() ? std::string(file) : std::string(std::move(relativePath));
-      auto const bypathsOffsets = GetMatchedOffsets(Info, IndexType::Paths, PathMatch(pathInTags.c_str()));
+      IndexPatch patch;
+      patch.TagsModTime = OpenSynchronizedTags(Info)->TagsModTime;
+      patch.PathOffsets = GetMatchedOffsets(Info, IndexType::Paths, PathMatch(pathInTags.c_str()));
       auto fromStream = OpenStream(fileTagsPath, std::ios_base::badbit, std::ios_base::in);
       auto intoStream = OpenStream(Info.GetName().c_str(), std::ios_base::failbit | std::ios_base::badbit, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
-      auto lines = GetAddRemoveLines(ReadMergeTags(fromStream), intoStream, bypathsOffsets);
+      auto lines = GetAddRemoveLines(ReadMergeTags(fromStream), intoStream, patch.PathOffsets);
+      std::transform(lines.second.begin(), lines.second.end(), std::back_inserter(patch.Removed), [](LinePosition const& line) { return line.first; });
       auto crlf = ReadCrlf(intoStream);
-      return std::bind([](std::pair<OffsetCont, LinePositionCont>& lines, std::string& crlf, std::string& pathSubst,
+      // Index is patched after streams are closed, so it is stamped with final tags modification time
+      return std::bind([](TagFileInfo const* info, IndexPatch& patch, std::pair<OffsetCont, LinePositionCont>& lines, std::string& crlf, std::string& pathSubst,
                           std::shared_ptr<std::fstream> const& fromStream, std::shared_ptr<std::fstream> const& intoStream)
                       {
-                        AddRemoveLines(std::move(lines), std::move(crlf), std::move(pathSubst), std::move(*fromStream), std::move(*intoStream));
+                        // Tags file mapped on Windows can be written but not truncated, other programs may not be able to open it at all
+                        info->ResetMapping();
+                        patch.Added = AddRemoveLines(std::move(lines), std::move(crlf), std::move(pathSubst), std::move(*fromStream), std::move(*intoStream));
+                        if (!info->UpdateIndex(patch))
+                          throw std::runtime_error("Index is not patched, repository should be loaded again");
                       },
-                      std::move(lines), std::move(crlf), std::move(pathInTags),
+                      &Info, std::move(patch), std::move(lines), std::move(crlf), std::move(pathInTags),
                       std::make_shared<std::fstream>(std::move(fromStream)), std::make_shared<std::fstream>(std::move(intoStream))
       );
     }
 
   private:
-    std::vector<TagInfo> FindFilesImpl(const char* part, bool comparationType, size_t maxCount, bool useCached) const
+    void FindByNameImpl(const char* part, size_t maxCount, size_t maxTotal, bool caseInsensitive, bool useCached, Tags::Internal::LookupRange* range, Tags::Internal::TagsReceiver const& receiver) const
+    {
+      maxCount = maxTotal > 0 ? std::min(maxCount, maxTotal) : maxCount;
+      maxTotal = maxTotal == 0 ? std::numeric_limits<size_t>::max() : maxTotal;
+      auto cachedTags = maxCount > 0 && useCached ? GetCachedTags(false, maxCount) : std::vector<TagInfo>();
+      auto visitor = NameMatch(part, PartialCompare, caseInsensitive);
+      cachedTags = MatchTags(std::move(cachedTags), visitor);
+      auto indexType = caseInsensitive ? IndexType::NamesCaseInsensitive : IndexType::Names;
+      auto const left = maxTotal - cachedTags.size();
+      auto const count = !maxCount ? left : maxCount - cachedTags.size();
+      StreamUnique(std::move(cachedTags), [this, &visitor, indexType, maxCount, count, left, range](Tags::Internal::TagsReceiver const& matched) {
+        return (!maxCount && visitor.GetPattern().empty()) || StreamMatchedTags(&Info, indexType, visitor, count, left, range, matched);
+      }, receiver);
+    }
+
+    void FindFilesImpl(const char* part, bool comparationType, size_t maxCount, bool useCached, Tags::Internal::LookupRange* range, Tags::Internal::TagsReceiver const& receiver) const
     {
       auto cachedTags = maxCount > 0 && useCached ? GetCachedTags(true, maxCount) : std::vector<TagInfo>();
       auto namePathLine = GetNamePathLine(part);
       auto visitor = FilenameMatch(std::move(std::get<0>(namePathLine)), std::move(std::get<1>(namePathLine)), comparationType);
       cachedTags = MatchTags(std::move(cachedTags), visitor);
-      auto tags = !maxCount ? GetMatchedTags(&Info, IndexType::Filenames, visitor)
-                            : GetMatchedTags(&Info, IndexType::Filenames, visitor, maxCount - cachedTags.size(), std::numeric_limits<size_t>::max());
       auto lineNum = std::get<2>(namePathLine);
-      std::transform(std::make_move_iterator(tags.begin()), std::make_move_iterator(tags.end()), tags.begin(), [lineNum](TagInfo&& tag){ return MakeFileTag(std::move(tag), lineNum); });
-      std::transform(std::make_move_iterator(cachedTags.begin()), std::make_move_iterator(cachedTags.end()), cachedTags.begin(), [lineNum](TagInfo&& tag){ return MakeFileTag(std::move(tag), lineNum); });
-      return MergeUnique(std::move(cachedTags), std::move(tags));
+      auto toFileTags = [lineNum](std::vector<TagInfo>&& tags) {
+        std::transform(std::make_move_iterator(tags.begin()), std::make_move_iterator(tags.end()), tags.begin(), [lineNum](TagInfo&& tag){ return MakeFileTag(std::move(tag), lineNum); });
+        return std::move(tags);
+      };
+      auto const count = !maxCount ? std::numeric_limits<size_t>::max() : maxCount - cachedTags.size();
+      StreamUnique(toFileTags(std::move(cachedTags)), [this, &visitor, &toFileTags, maxCount, count, range](Tags::Internal::TagsReceiver const& unique) {
+        return (!maxCount && visitor.GetPattern().empty()) || StreamMatchedTags(&Info, IndexType::Filenames, visitor, count, std::numeric_limits<size_t>::max(), range, [&toFileTags, &unique](std::vector<TagInfo>&& tags) {
+          return unique(toFileTags(std::move(tags)));
+        });
+      }, receiver);
     }
 
     TagFileInfo Info;
@@ -1929,9 +4240,31 @@ namespace Tags
 {
   namespace Internal
   {
-    std::unique_ptr<Repository> Repository::Create(const char* filename, bool singleFileRepos)
+    ResidentBudget::ResidentBudget(size_t limit)
+      : Limit(limit)
+      , Used(0)
+    {
+    }
+
+    bool ResidentBudget::Reserve(size_t size)
+    {
+      std::lock_guard<std::mutex> lock(Guard);
+      if (size > Limit - Used)
+        return false;
+
+      Used += size;
+      return true;
+    }
+
+    void ResidentBudget::Release(size_t size)
+    {
+      std::lock_guard<std::mutex> lock(Guard);
+      Used -= std::min(size, Used);
+    }
+
+    std::unique_ptr<Repository> Repository::Create(const char* filename, bool singleFileRepos, IndexOptions const& options, std::shared_ptr<ResidentBudget> budget)
     {
-      return std::unique_ptr<Repository>(new RepositoryImpl(filename, singleFileRepos));
+      return std::unique_ptr<Repository>(new RepositoryImpl(filename, singleFileRepos, options, std::move(budget)));
     }
   }
 }
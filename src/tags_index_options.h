@@ -0,0 +1,34 @@
+#pragma once
+
+#include <functional>
+#include <stddef.h>
+
+namespace Tags
+{
+  // Receives number of done stages of index build and number of all stages, called on thread building index
+  using IndexProgress = std::function<void(size_t done, size_t total)>;
+
+  struct IndexOptions
+  {
+    // Number of threads used to build index, 0 means number of hardware threads
+    size_t Threads = 0;
+    // Approximate memory for parsed tags, 0 means unlimited. If set, sorted parts of index are spilled to temporary files next to index
+    size_t MemoryLimit = 0;
+    // Store parsed fields of tags next to index, so found tags are made without parsing lines of tags file
+    bool StoreFields = false;
+    // Store suffix array of names in index, so names are found by any part, not only by prefix.
+    // It is held in memory while index is built, so it is not stored if it exceeds MemoryLimit and names are scanned then
+    bool InfixSearch = false;
+    // Store Bloom filter of names in index, so names absent in repository are not searched in tags file
+    bool NameFilter = false;
+    // Tags, index and fields files taking at most this size are read into memory and not checked for changes on lookups,
+    // 0 means files are mapped. Storage applies it to total size of files of its permanent repositories
+    size_t ResidentMemoryLimit = 0;
+    // Milliseconds during which mapped tags and index files are not checked for changes made by other processes again,
+    // 0 means they are checked on every lookup
+    size_t ChangesCheckInterval = 0;
+    // Milliseconds between checks of tags files of storage for changes made by other processes, changed repositories are loaded
+    // anew in background. 0 means tags files are not watched
+    size_t WatchInterval = 0;
+  };
+}
@@ -1,38 +1,89 @@
 #pragma once
 
 #include "tag_info.h"
+#include "tags_index_options.h"
 
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 
 namespace Tags
 {
   namespace Internal
   {
+    // Lines of index table matched by a lookup, lookup by part extending Part searches only them while index is the same
+    struct LookupRange
+    {
+      std::string Part;
+      std::weak_ptr<void const> Index;
+      int Table = -1;
+      size_t Begin = 0;
+      size_t End = 0;
+    };
+
+    // Receives next batch of found tags, returns false to stop lookup
+    using TagsReceiver = std::function<bool(std::vector<TagInfo>&&)>;
+
+    // Total size of files read into memory by repositories sharing it, see IndexOptions::ResidentMemoryLimit
+    class ResidentBudget
+    {
+    public:
+      explicit ResidentBudget(size_t limit);
+      // False if size does not fit into the rest of limit
+      bool Reserve(size_t size);
+      void Release(size_t size);
+
+    private:
+      std::mutex Guard;
+      size_t const Limit;
+      size_t Used;
+    };
+
     class Repository
     {
     public:
-      static std::unique_ptr<Repository> Create(const char* filename, bool singleFileRepos);
+      // Repository not given budget has its own one of options.ResidentMemoryLimit
+      static std::unique_ptr<Repository> Create(const char* filename, bool singleFileRepos, IndexOptions const& options = IndexOptions(), std::shared_ptr<ResidentBudget> budget = nullptr);
       virtual ~Repository() = default;
-      virtual int Load(size_t& symbolsLoaded) = 0;
+      // Progress of index build is reported if index is built. Other methods may be called concurrently,
+      // but not with Load, unless tags file is not changed since the previous load
+      virtual int Load(size_t& symbolsLoaded, IndexProgress const& progress = IndexProgress()) = 0;
       virtual bool Belongs(char const* file) const = 0;
       virtual int CompareTagsPath(const char* tagsPath) const = 0;
       virtual std::string TagsPath() const = 0;
       virtual std::string Root() const = 0;
       virtual std::vector<TagInfo> FindByName(const char* name) const = 0;
-      virtual std::vector<TagInfo> FindByName(const char* part, size_t maxCount, size_t maxTotal, bool caseInsensitive, bool useCached) const = 0;
+      // If range is given, lookup extending its part searches only its lines and range is narrowed to lines of this lookup
+      virtual std::vector<TagInfo> FindByName(const char* part, size_t maxCount, size_t maxTotal, bool caseInsensitive, bool useCached, LookupRange* range = nullptr) const = 0;
+      // Names having characters of pattern in the same order, at most maxCount best matches go first
+      virtual std::vector<TagInfo> FindByNameFuzzy(const char* pattern, size_t maxCount) const = 0;
+      // Names containing part ignoring case, names starting with part go first
+      virtual std::vector<TagInfo> FindByNameInfix(const char* part, size_t maxCount) const = 0;
       virtual std::vector<TagInfo> FindFiles(const char* path) const = 0;
-      virtual std::vector<TagInfo> FindFiles(const char* part, size_t maxCount, bool useCached) const = 0;
+      virtual std::vector<TagInfo> FindFiles(const char* part, size_t maxCount, bool useCached, LookupRange* range = nullptr) const = 0;
+      // Passes tags found by FindByName or FindFiles with the same arguments in batches, maxTotal is ignored for files
+      virtual void FindByPart(const char* part, bool getFiles, size_t maxCount, size_t maxTotal, bool caseInsensitive, bool useCached, LookupRange* range, TagsReceiver const& receiver) const = 0;
       virtual std::vector<TagInfo> FindClassMembers(const char* classname) const = 0;
       virtual std::vector<TagInfo> FindByFile(const char* file) const = 0;
       virtual void CacheTag(TagInfo const& tag, size_t cacheSize, bool flush) = 0;
       virtual void EraseCachedTag(TagInfo const& tag, bool flush) = 0;
       virtual std::vector<TagInfo> GetCachedTags(bool getFiles, size_t maxCount) const = 0;
       virtual time_t ElapsedSinceCached() const = 0;
+      // Memory taken by files of repository read into memory, 0 if they are mapped
+      virtual size_t ResidentSize() const = 0;
+      // True if tags file is changed by other process since index was built, may be called from any thread
+      virtual bool TagsModified() const = 0;
+      // Unmaps tags and index files, so other programs may rewrite them, files are mapped again by the next lookup. Files are unpinned as well
+      virtual void ReleaseFiles() = 0;
+      // Lookups keep using files mapped last when changed files can not be mapped, so repository answers them until one loaded anew
+      // replaces it. Files are not mapped by the call, they are pinned by the next lookup if they are not mapped yet
+      virtual void PinFiles() = 0;
       virtual void ResetCacheCounters(bool flush) = 0;
       virtual std::string GetLastVisited() const = 0;
       virtual void SetLastVisited(std::string const& lastVisited, bool flush) = 0;
+      // Returned function writes tags file and patches index, it throws if index should be built anew by Load
       virtual std::function<void()> UpdateTagsByFile(char const* file, const char* fileTagsPath) const = 0;
     };
   }
@@ -1,13 +1,21 @@
 #include "tags_repository_storage.h"
+#include "tags_index_options.h"
 #include "tags_repository.h"
 #include "tags_selector_impl.h"
 #include "tags_selector.h"
 #include "tags_sorting_options.h"
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <errno.h>
+#include <exception>
 #include <functional>
 #include <iterator>
 #include <list>
+#include <mutex>
+#include <thread>
+#include <utility>
 
 namespace
 {
@@ -34,28 +42,238 @@ namespace
 
   RepositoryInfo ToRepositoryInfo(RepositoryRuntimeInfo const& info)
   {
-    return {info.Repository->TagsPath(), info.Repository->Root(), info.Type, info.Repository->ElapsedSinceCached(), info.Repository->GetLastVisited()};
+    return {info.Repository->TagsPath(), info.Repository->Root(), info.Type, info.Repository->ElapsedSinceCached(), info.Repository->GetLastVisited(), info.Repository->ResidentSize()};
   }
 
+  // Repository loaded in background and repository it replaces, if any
+  using LoadedRepository = std::pair<RepositoryPtr, RepositoryRuntimeInfo>;
+
+  // Loads repositories on its own thread in order of requests. If watch interval is given, it also checks tags files of watched repositories
+  // and loads repositories, which tags files are changed by other processes, anew. Repository is loaded if its tags file is found changed
+  // by two checks in a row, so files being written are mostly not indexed halfway
+  class RepositoryLoader
+  {
+  public:
+    // Repositories are loaded one at a time under loadGuard, since loads of the same repository write the same index
+    RepositoryLoader(RepositoryFactoryFunction const& repoFactory, size_t watchInterval, std::mutex& loadGuard)
+      : RepoFactory(repoFactory)
+      , WatchInterval(watchInterval)
+      , LoadGuard(loadGuard)
+      , Stopped(false)
+    {
+      Worker = std::thread([this]() { Run(); });
+    }
+
+    // Waits for repository being loaded, requested loads are dropped
+    ~RepositoryLoader()
+    {
+      std::unique_lock<std::mutex> lock(Guard);
+      Stopped = true;
+      lock.unlock();
+      Wakeup.notify_all();
+      Worker.join();
+    }
+
+    void Watch(RepositoryRuntimeInfo const& info)
+    {
+      std::lock_guard<std::mutex> lock(Guard);
+      Erase(info.Repository->TagsPath().c_str());
+      if (WatchInterval > 0)
+        AddWatched(info);
+    }
+
+    void Unwatch(char const* tagsPath)
+    {
+      std::lock_guard<std::mutex> lock(Guard);
+      Erase(tagsPath);
+    }
+
+    // Created repository is loaded in place of replaced one, if any
+    void Load(RepositoryRuntimeInfo&& info, RepositoryPtr const& replaced, Tags::IndexProgress&& progress, Tags::LoadReceiver&& receiver)
+    {
+      std::unique_lock<std::mutex> lock(Guard);
+      Requests.push_back({std::move(info), replaced, std::move(progress), std::move(receiver)});
+      lock.unlock();
+      Wakeup.notify_all();
+    }
+
+    std::vector<LoadedRepository> TakeLoaded()
+    {
+      std::lock_guard<std::mutex> lock(Guard);
+      return std::move(Loaded);
+    }
+
+  private:
+    struct WatchedRepository
+    {
+      RepositoryRuntimeInfo Info;
+      bool Modified;
+    };
+
+    struct LoadRequest
+    {
+      RepositoryRuntimeInfo Info;
+      RepositoryPtr Replaced;
+      Tags::IndexProgress Progress;
+      Tags::LoadReceiver Receiver;
+    };
+
+    void Erase(char const* tagsPath)
+    {
+      Watched.erase(std::remove_if(Watched.begin(), Watched.end(), [tagsPath](WatchedRepository const& w) { return !w.Info.Repository->CompareTagsPath(tagsPath); }), Watched.end());
+    }
+
+    // Changed tags file of watched repository is loaded anew, the repository answers lookups until it is replaced
+    void AddWatched(RepositoryRuntimeInfo const& info)
+    {
+      info.Repository->PinFiles();
+      Watched.push_back({info, false});
+    }
+
+    int LoadRepository(RepositoryRuntimeInfo const& info, Tags::IndexProgress const& progress, size_t& symbolsLoaded)
+    {
+      std::lock_guard<std::mutex> loading(LoadGuard);
+      try
+      {
+        return info.Repository->Load(symbolsLoaded, progress);
+      }
+      catch (std::exception const&)
+      {
+        return EIO;
+      }
+    }
+
+    // Repositories are loaded without lock
+    void Run()
+    {
+      std::unique_lock<std::mutex> lock(Guard);
+      auto nextCheck = std::chrono::steady_clock::now() + std::chrono::milliseconds(WatchInterval);
+      while (!Stopped)
+      {
+        auto const requested = [this]() { return Stopped || !Requests.empty(); };
+        if (!WatchInterval)
+          Wakeup.wait(lock, requested);
+        else if (!Wakeup.wait_until(lock, nextCheck, requested))
+        {
+          CheckWatched(lock);
+          nextCheck = std::chrono::steady_clock::now() + std::chrono::milliseconds(WatchInterval);
+        }
+
+        if (Stopped || Requests.empty())
+          continue;
+
+        auto request = std::move(Requests.front());
+        Requests.pop_front();
+        lock.unlock();
+        size_t symbolsLoaded = 0;
+        auto err = LoadRepository(request.Info, request.Progress, symbolsLoaded);
+        lock.lock();
+        if (!err && WatchInterval > 0)
+        {
+          Erase(request.Info.Repository->TagsPath().c_str());
+          AddWatched(request.Info);
+        }
+
+        // Receiver may use storage at once, so repository is taken by calls it makes
+        if (!err)
+          Loaded.emplace_back(request.Replaced, std::move(request.Info));
+
+        lock.unlock();
+        if (request.Receiver)
+          request.Receiver(err, symbolsLoaded);
+
+        lock.lock();
+      }
+    }
+
+    // Repositories loaded anew replace watched ones only if they are still watched
+    void CheckWatched(std::unique_lock<std::mutex>& lock)
+    {
+      auto watched = Watched;
+      for (auto const& w : watched)
+      {
+        lock.unlock();
+        bool const modified = w.Info.Repository->TagsModified();
+        auto reloaded = modified && w.Modified ? CreateRuntimeInfo(w.Info.Repository->TagsPath().c_str(), w.Info.Type, RepoFactory) : RepositoryRuntimeInfo();
+        size_t symbolsLoaded = 0;
+        if (!Empty(reloaded) && LoadRepository(reloaded, Tags::IndexProgress(), symbolsLoaded))
+          reloaded = RepositoryRuntimeInfo();
+
+        lock.lock();
+        auto current = std::find_if(Watched.begin(), Watched.end(), [&w](WatchedRepository const& r) { return r.Info.Repository == w.Info.Repository; });
+        if (Stopped || current == Watched.end())
+          continue;
+
+        current->Modified = modified && Empty(reloaded);
+        if (Empty(reloaded))
+          continue;
+
+        Loaded.emplace_back(current->Info.Repository, reloaded);
+        reloaded.Repository->PinFiles();
+        current->Info = std::move(reloaded);
+      }
+    }
+
+    RepositoryFactoryFunction const RepoFactory;
+    size_t const WatchInterval;
+    std::mutex& LoadGuard;
+    std::mutex Guard;
+    std::condition_variable Wakeup;
+    bool Stopped;
+    std::vector<WatchedRepository> Watched;
+    std::list<LoadRequest> Requests;
+    std::vector<LoadedRepository> Loaded;
+    std::thread Worker;
+  };
+
   class RepositoryStorageImpl : public Tags::RepositoryStorage
   {
   public:
-    RepositoryStorageImpl(RepositoryFactoryFunction&& repoFactory)
+    RepositoryStorageImpl(RepositoryFactoryFunction&& repoFactory, size_t watchInterval = 0)
       : RepoFactory(std::move(repoFactory))
+      , Repositories(std::make_shared<RepositoriesCont const>())
+      , Loader(new RepositoryLoader(RepoFactory, watchInterval, LoadGuard))
     {
     }
 
+    // Loaded repository of unchanged tags file is loaded again. Repository of changed one is loaded anew, its path and type are kept,
+    // lookups in progress keep using the loaded one, which files are released, so index built anew replaces index it does not map
     int Load(char const* tagsPath, RepositoryType type, size_t& symbolsLoaded) override
     {
-      auto info = Release(tagsPath);
-      info = Empty(info) ? CreateRuntimeInfo(tagsPath, type, RepoFactory) : std::move(info);
+      ReplaceLoaded();
+      std::lock_guard<std::mutex> loading(LoadGuard);
+      auto current = GetRuntimeInfo(tagsPath);
+      bool const reload = !Empty(current) && !current.Repository->TagsModified();
+      if (!Empty(current) && !reload)
+        current.Repository->ReleaseFiles();
+
+      auto info = reload ? current : Empty(current) ? CreateRuntimeInfo(tagsPath, type, RepoFactory) : CreateRuntimeInfo(current.Repository->TagsPath().c_str(), current.Type, RepoFactory);
       auto err = info.Repository->Load(symbolsLoaded);
-      if (!err)
-        Insert(std::move(info));
+      Update([&](RepositoriesCont& repositories) {
+        Release(repositories, tagsPath);
+        if (!err)
+          Insert(repositories, info);
 
+        if (!err)
+          Loader->Watch(info);
+        else
+          Loader->Unwatch(tagsPath);
+      });
       return err;
     }
 
+    // Loaded repository answers lookups with files it mapped until the new one replaces it, path and type of loaded repository are kept
+    void LoadAsync(char const* tagsPath, RepositoryType type, Tags::IndexProgress&& progress, Tags::LoadReceiver&& receiver) override
+    {
+      ReplaceLoaded();
+      auto current = GetRuntimeInfo(tagsPath);
+      if (!Empty(current))
+        current.Repository->PinFiles();
+
+      auto info = Empty(current) ? CreateRuntimeInfo(tagsPath, type, RepoFactory) : CreateRuntimeInfo(current.Repository->TagsPath().c_str(), current.Type, RepoFactory);
+      Loader->Load(std::move(info), current.Repository, std::move(progress), std::move(receiver));
+    }
+
     std::vector<RepositoryInfo> GetOwners(char const* currentFile) const override
     {
       return Filter([&currentFile](RepositoryRuntimeInfo const& info){ return info.Repository->Belongs(currentFile); });
@@ -74,11 +292,23 @@ namespace
 
     void Remove(char const* tagsPath) override
     {
-      Release(tagsPath);
+      ReplaceLoaded();
+      Update([this, tagsPath](RepositoriesCont& repositories) {
+        Release(repositories, tagsPath);
+        Loader->Unwatch(tagsPath);
+      });
+    }
+
+    void ReleaseFiles(char const* tagsPath) override
+    {
+      auto info = GetRuntimeInfo(tagsPath);
+      if (!Empty(info))
+        info.Repository->ReleaseFiles();
     }
 
     void CacheTag(TagInfo const& tag, size_t cacheSize, bool flush) override
     {
+      ReplaceLoaded();
       auto info = GetRuntimeInfo(tag.Owner->TagsFile.c_str());
       if (!Empty(info))
         info.Repository->CacheTag(tag, cacheSize, flush);
@@ -86,6 +316,7 @@ namespace
 
     void EraseCachedTag(TagInfo const& tag, bool flush) override
     {
+      ReplaceLoaded();
       auto info = GetRuntimeInfo(tag.Owner->TagsFile.c_str());
       if (!Empty(info))
         info.Repository->EraseCachedTag(tag, flush);
@@ -93,6 +324,7 @@ namespace
 
     void ResetCacheCounters(char const* tagsPath, bool flush) override
     {
+      ReplaceLoaded();
       auto info = GetRuntimeInfo(tagsPath);
       if (!Empty(info))
         info.Repository->ResetCacheCounters(flush);
@@ -100,6 +332,7 @@ namespace
 
     void SetLastVisited(char const* tagsPath, std::string const& lastVisited, bool flush) override
     {
+      ReplaceLoaded();
       auto info = GetRuntimeInfo(tagsPath);
       if (!Empty(info))
         info.Repository->SetLastVisited(lastVisited, flush);
@@ -107,9 +340,11 @@ namespace
 
     std::unique_ptr<Tags::Selector> GetSelector(char const* currentFile, bool caseInsensitive, Tags::SortingOptions sortOptions, size_t limit) override
     {
+      ReplaceLoaded();
       std::vector<RepositoryPtr> repositories;
       std::vector<RepositoryPtr> permanents;
-      for (auto const& info : Repositories)
+      auto const snapshot = GetRepositories();
+      for (auto const& info : *snapshot)
         if (info.Repository->Belongs(currentFile))
           repositories.push_back(info.Repository);
         else if (info.Type == RepositoryType::Permanent)
@@ -129,41 +364,83 @@ namespace
 
   private:
     using RepositoriesCont = std::list<RepositoryRuntimeInfo>;
+    static void Insert(RepositoriesCont& repositories, RepositoryRuntimeInfo const& info);
+    static void Release(RepositoriesCont& repositories, char const* tagsPath);
     RepositoryRuntimeInfo GetRuntimeInfo(char const* tagsPath) const;
-    void Insert(RepositoryRuntimeInfo&& info);
-    RepositoryRuntimeInfo Release(char const* tagsPath);
+    std::shared_ptr<RepositoriesCont const> GetRepositories() const;
+    // Changes copy of repositories and publishes it, changes are serialized while readers keep snapshots they got.
+    // Watched repositories are changed by the same call, so loader watches published ones
+    void Update(std::function<void(RepositoriesCont&)> const& change);
     std::vector<RepositoryInfo> Filter(std::function<bool(RepositoryRuntimeInfo const&)>&& pred) const;
+    // Repositories loaded in background are put in place of old ones by non-const calls, so lookups never wait for indexing
+    void ReplaceLoaded();
 
     RepositoryFactoryFunction RepoFactory;
-    RepositoriesCont Repositories;
+    mutable std::mutex Guard;
+    std::shared_ptr<RepositoriesCont const> Repositories;
+    std::mutex LoadGuard;
+    std::unique_ptr<RepositoryLoader> Loader;
   };
 
+  void RepositoryStorageImpl::Insert(RepositoriesCont& repositories, RepositoryRuntimeInfo const& info)
+  {
+    auto iter = std::find_if(repositories.begin(), repositories.end(), [&info](RepositoryRuntimeInfo const& r){ return r.Repository->Root() > info.Repository->Root(); });
+    repositories.insert(iter, info);
+  }
+
+  void RepositoryStorageImpl::Release(RepositoriesCont& repositories, char const* tagsPath)
+  {
+    repositories.remove_if([&tagsPath](RepositoryRuntimeInfo const& r){ return !r.Repository->CompareTagsPath(tagsPath); });
+  }
+
   RepositoryRuntimeInfo RepositoryStorageImpl::GetRuntimeInfo(char const* tagsPath) const
   {
-    auto iter = std::find_if(Repositories.begin(), Repositories.end(), [&tagsPath](RepositoryRuntimeInfo const& r){ return !r.Repository->CompareTagsPath(tagsPath); });
-    return iter != Repositories.end() ? *iter : RepositoryRuntimeInfo();
+    auto repositories = GetRepositories();
+    auto iter = std::find_if(repositories->begin(), repositories->end(), [&tagsPath](RepositoryRuntimeInfo const& r){ return !r.Repository->CompareTagsPath(tagsPath); });
+    return iter != repositories->end() ? *iter : RepositoryRuntimeInfo();
   }
 
-  void RepositoryStorageImpl::Insert(RepositoryRuntimeInfo&& info)
+  std::shared_ptr<RepositoryStorageImpl::RepositoriesCont const> RepositoryStorageImpl::GetRepositories() const
   {
-    auto iter = std::find_if(Repositories.begin(), Repositories.end(), [&info](RepositoryRuntimeInfo const& r){ return r.Repository->Root() > info.Repository->Root(); });
-    Repositories.insert(iter, std::move(info));
+    std::lock_guard<std::mutex> lock(Guard);
+    return Repositories;
   }
 
-  RepositoryRuntimeInfo RepositoryStorageImpl::Release(char const* tagsPath)
+  void RepositoryStorageImpl::Update(std::function<void(RepositoriesCont&)> const& change)
   {
-    auto iter = std::find_if(Repositories.begin(), Repositories.end(), [&tagsPath](RepositoryRuntimeInfo const& r){ return !r.Repository->CompareTagsPath(tagsPath); });
-    auto result = iter != Repositories.end() ? std::move(*iter) : RepositoryRuntimeInfo();
-    if (iter != Repositories.end())
-      Repositories.erase(iter);
+    std::lock_guard<std::mutex> lock(Guard);
+    auto repositories = std::make_shared<RepositoriesCont>(*Repositories);
+    change(*repositories);
+    Repositories = std::move(repositories);
+  }
 
-    return std::move(result);
+  // Repository loaded or removed after background load was requested is kept
+  void RepositoryStorageImpl::ReplaceLoaded()
+  {
+    for (auto& loaded : Loader->TakeLoaded())
+    {
+      auto const tagsPath = loaded.second.Repository->TagsPath();
+      Update([&](RepositoriesCont& repositories) {
+        auto current = std::find_if(repositories.begin(), repositories.end(), [&tagsPath](RepositoryRuntimeInfo const& r){ return !r.Repository->CompareTagsPath(tagsPath.c_str()); });
+        auto const found = current != repositories.end();
+        if ((found ? current->Repository : RepositoryPtr()) == loaded.first)
+        {
+          Release(repositories, tagsPath.c_str());
+          Insert(repositories, loaded.second);
+        }
+        else if (!found)
+          Loader->Unwatch(tagsPath.c_str());
+        else
+          Loader->Watch(*current);
+      });
+    }
   }
 
   std::vector<RepositoryInfo> RepositoryStorageImpl::Filter(std::function<bool(RepositoryRuntimeInfo const&)>&& pred) const
   {
     std::vector<RepositoryInfo> result;
-    for (auto const& r : Repositories)
+    auto const snapshot = GetRepositories();
+    for (auto const& r : *snapshot)
       if (pred(r))
         result.push_back(ToRepositoryInfo(r));
 
@@ -175,8 +452,22 @@ namespace Tags
 {
   std::unique_ptr<RepositoryStorage> RepositoryStorage::Create()
   {
-    auto defaultFactory = [](char const* tagsPath, RepositoryType type){ return Tags::Internal::Repository::Create(tagsPath, type == RepositoryType::Temporary); };
-    return Create(std::move(defaultFactory));
+    return Create(IndexOptions());
+  }
+
+  std::unique_ptr<RepositoryStorage> RepositoryStorage::Create(IndexOptions const& indexOptions)
+  {
+    // Permanent repositories share one limit of files read into memory
+    auto budget = std::make_shared<Tags::Internal::ResidentBudget>(indexOptions.ResidentMemoryLimit);
+    auto defaultFactory = [indexOptions, budget](char const* tagsPath, RepositoryType type)
+    {
+      // Only permanent repositories are resident, their tags are made from stored fields without parsing lines
+      auto options = indexOptions;
+      options.ResidentMemoryLimit = type == RepositoryType::Permanent ? options.ResidentMemoryLimit : 0;
+      options.StoreFields = options.StoreFields || options.ResidentMemoryLimit > 0;
+      return Tags::Internal::Repository::Create(tagsPath, type == RepositoryType::Temporary, options, budget);
+    };
+    return std::unique_ptr<RepositoryStorage>(new RepositoryStorageImpl(std::move(defaultFactory), indexOptions.WatchInterval));
   }
 
   std::unique_ptr<RepositoryStorage> RepositoryStorage::Create(RepositoryFactoryFunction&& repoFactory)
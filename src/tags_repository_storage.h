@@ -1,6 +1,7 @@
 #pragma once
 
 #include "tag_info.h"
+#include "tags_index_options.h"
 
 #include <functional>
 #include <memory>
@@ -36,19 +37,32 @@ namespace Tags
     RepositoryType Type;
     time_t ElapsedSinceCached;
     std::string LastVisited;
+    // Memory taken by resident repository, 0 if its files are mapped
+    size_t ResidentSize;
   };
 
+  // Receives error code and number of loaded symbols of repository loaded in background, called on thread loading repository
+  using LoadReceiver = std::function<void(int err, size_t symbolsLoaded)>;
+
+  // Methods may be called from any thread. Lookups get snapshot of repositories, so loads and removals never change repositories
+  // of lookups in progress, loads are done one at a time and cached tags of each repository are changed under its own lock
   class RepositoryStorage
   {
   public:
     static std::unique_ptr<RepositoryStorage> Create();
+    static std::unique_ptr<RepositoryStorage> Create(IndexOptions const& indexOptions);
     static std::unique_ptr<RepositoryStorage> Create(std::function<std::unique_ptr<Internal::Repository>(char const*, RepositoryType)>&& repoFactory);
     virtual ~RepositoryStorage() = default;
     virtual int Load(char const* tagsPath, RepositoryType type, size_t& symbolsLoaded) = 0;
+    // Returns at once, repository is loaded on background thread while repository loaded before serves lookups.
+    // Loaded repository is put in storage by the first non-const call after receiver is called
+    virtual void LoadAsync(char const* tagsPath, RepositoryType type, IndexProgress&& progress, LoadReceiver&& receiver) = 0;
     virtual std::vector<RepositoryInfo> GetOwners(char const* currentFile) const = 0;
     virtual std::vector<RepositoryInfo> GetByType(RepositoryType type) const = 0;
     virtual RepositoryInfo GetInfo(char const* tagsPath) const = 0;
     virtual void Remove(char const* tagsPath) = 0;
+    // Lets other programs rewrite tags file of loaded repository, see Internal::Repository::ReleaseFiles
+    virtual void ReleaseFiles(char const* tagsPath) = 0;
     virtual void CacheTag(TagInfo const& tag, size_t cacheSize, bool flush) = 0;
     virtual void EraseCachedTag(TagInfo const& tag, bool flush) = 0;
     virtual void ResetCacheCounters(char const* tagsPath, bool flush) = 0;
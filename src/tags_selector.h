@@ -2,10 +2,31 @@
 
 #include "tag_info.h"
 
+#include <functional>
+#include <memory>
 #include <vector>
 
 namespace Tags
 {
+  // Index lines matched by the last lookup by part in repositories of selector, kept by caller between lookups
+  struct LookupRanges;
+
+  // Lookup running in background, it is cancelled on destruction
+  class Query
+  {
+  public:
+    virtual ~Query() = default;
+    // Stops lookup and waits until receiver returns
+    virtual void Cancel() = 0;
+    // False if lookup is not complete within timeout, error of lookup is rethrown
+    virtual bool Wait(size_t timeoutMs) = 0;
+    // True if tags of some repository were cut by threshold
+    virtual bool ThresholdReached() const = 0;
+  };
+
+  // Receives tags found in next repository, returns false to stop lookup
+  using TagsBatchReceiver = std::function<bool(std::vector<TagInfo>&&)>;
+
   class Selector
   {
   public:
@@ -15,7 +36,13 @@ namespace Tags
     virtual std::vector<TagInfo> GetClassMembers(const char* classname) const = 0;
     virtual std::vector<TagInfo> GetByFile(const char* file) const = 0;
     virtual std::vector<TagInfo> GetByPart(const char* part, bool getFiles, bool unlimited = false) const = 0;
-    virtual std::vector<TagInfo> GetByPart(const char* part, bool getFiles, bool unlimited, size_t threshold, bool& thresholdReached) const = 0;
+    // Lookup by part extending part of the previous one searches only lines it matched, ranges are created on first lookup
+    virtual std::vector<TagInfo> GetByPart(const char* part, bool getFiles, bool unlimited, size_t threshold, bool& thresholdReached, std::shared_ptr<LookupRanges>& ranges) const = 0;
+    // Finds the same tags as GetByPart with threshold, repositories are searched one by one on background thread and receiver gets sorted tags of each.
+    // Previous query is cancelled and, if part extends its part, lookup searches only lines it matched
+    virtual std::unique_ptr<Query> GetByPartAsync(const char* part, bool getFiles, size_t threshold, TagsBatchReceiver&& receiver, Query* previous = nullptr) const = 0;
+    virtual std::vector<TagInfo> GetByFuzzyPart(const char* part) const = 0;
+    virtual std::vector<TagInfo> GetByInfix(const char* part) const = 0;
     virtual std::vector<TagInfo> GetCachedTags(bool getFiles) const = 0;
   };
 }
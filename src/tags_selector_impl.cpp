@@ -1,18 +1,47 @@
+#include "parallel.h"
 #include "tags.h"
 #include "tags_repository.h"
 #include "tags_selector.h"
 #include "tags_selector_impl.h"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <functional>
 #include <iterator>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
 
 namespace
 {
+  using Tags::Internal::LookupRange;
   using Tags::Internal::Repository;
   using RepositoryPtr = std::shared_ptr<Repository>;
+  using RepositoryRanges = std::vector<std::pair<Repository const*, LookupRange>>;
 
+  // Queries of mapped repositories mostly wait for pages of tags files, so the number of threads is not bound to processors
+  size_t const MaxQueryThreads = 4;
+
+  LookupRange* FindRange(RepositoryRanges& ranges, Repository const& repo)
+  {
+    auto range = std::find_if(ranges.begin(), ranges.end(), [&repo](RepositoryRanges::value_type const& r) { return r.first == &repo; });
+    return range != ranges.end() ? &range->second : nullptr;
+  }
+}
+
+namespace Tags
+{
+  struct LookupRanges
+  {
+    RepositoryRanges Ranges;
+  };
+}
+
+namespace
+{
   class SelectorImpl : public Tags::Selector
   {
   public:
@@ -49,19 +78,40 @@ namespace
 
     std::vector<TagInfo> GetByPart(const char* part, bool getFiles, bool unlimited) const override
     {
-      return ForEach([this, part, getFiles, unlimited](Repository const& repo) { bool unused; return GetByPart(repo, getFiles, part, unlimited, 0, unused); }, true, true, getFiles);
+      return ForEach([this, part, getFiles, unlimited](Repository const& repo) { bool unused; return GetByPart(repo, getFiles, part, unlimited, 0, unused, nullptr); }, true, true, getFiles);
     }
 
-    std::vector<TagInfo> GetByPart(const char* part, bool getFiles, bool unlimited, size_t threshold, bool& thresholdReached) const override
+    std::vector<TagInfo> GetByPart(const char* part, bool getFiles, bool unlimited, size_t threshold, bool& thresholdReached, std::shared_ptr<Tags::LookupRanges>& ranges) const override
     {
-      auto func = [this, part, getFiles, unlimited, threshold, &thresholdReached](Repository const& repo)
+      // Ranges are added before lookup, so concurrent lookups in repositories change only their own ones
+      ranges = ranges ? ranges : std::make_shared<Tags::LookupRanges>();
+      for (auto const& repo : Repositories)
+      {
+        if (!FindRange(ranges->Ranges, *repo))
+          ranges->Ranges.emplace_back(repo.get(), LookupRange());
+      }
+
+      std::atomic<bool> anyReached(false);
+      auto func = [this, part, getFiles, unlimited, threshold, &anyReached, &ranges](Repository const& repo)
       {
           bool reached = false;
-          auto result = GetByPart(repo, getFiles, part, unlimited, threshold, reached);
-          if (reached) thresholdReached = true;
+          auto result = GetByPart(repo, getFiles, part, unlimited, threshold, reached, FindRange(ranges->Ranges, repo));
+          if (reached) anyReached = true;
           return result;
       };
-      return ForEach(std::move(func), true, true, getFiles);
+      auto result = ForEach(std::move(func), true, true, getFiles);
+      thresholdReached = thresholdReached || anyReached;
+      return result;
+    }
+
+    std::vector<TagInfo> GetByFuzzyPart(const char* part) const override
+    {
+      return ForEach([this, part](Repository const& repo) { return repo.FindByNameFuzzy(part, Limit); }, false, false);
+    }
+
+    std::vector<TagInfo> GetByInfix(const char* part) const override
+    {
+      return ForEach([this, part](Repository const& repo) { return repo.FindByNameInfix(part, Limit); }, false, false);
     }
 
     std::vector<TagInfo> GetCachedTags(bool getFiles) const override
@@ -69,16 +119,39 @@ namespace
       return ForEach([this, getFiles](Repository const& repo){ return GetCachedTags(repo, getFiles); }, false, false);
     }
 
+    std::unique_ptr<Tags::Query> GetByPartAsync(const char* part, bool getFiles, size_t threshold, Tags::TagsBatchReceiver&& receiver, Tags::Query* previous) const override;
+
+    // Lookup of query in repository, it stops when cancelled is set
+    std::vector<TagInfo> GetByPart(Repository const& repo, bool getFiles, const char* part, size_t threshold, bool& thresholdReached, LookupRange* range, std::atomic<bool> const& cancelled) const
+    {
+      auto func = [this, getFiles, part, threshold, &thresholdReached, range, &cancelled](Repository const& repo) {
+        std::vector<TagInfo> result;
+        bool useCached = !!(SortOptions & Tags::SortingOptions::CachedTagsOnTop);
+        repo.FindByPart(part, getFiles, Limit, !threshold ? 0 : threshold + 1, CaseInsensitive, useCached, range, [&result, &cancelled](std::vector<TagInfo>&& tags) {
+          std::move(tags.begin(), tags.end(), std::back_inserter(result));
+          return !cancelled;
+        });
+        return CutByThreshold(std::move(result), getFiles, threshold, thresholdReached);
+      };
+      return GetTags(repo, func, true, getFiles);
+    }
+
+    std::vector<RepositoryPtr> const& GetRepositories() const
+    {
+      return Repositories;
+    }
+
   protected:
+    // Unlimited queries go to all repositories concurrently and are joined in order of repositories.
+    // Limited ones stop at the first repositories giving enough tags, so they are run one by one
     std::vector<TagInfo> ForEach(std::function<std::vector<TagInfo>(Repository const&)>&& func, bool unlimited = true, bool sorted = true, bool getFiles = false) const
     {
+      std::vector<std::vector<TagInfo>> found(unlimited ? Repositories.size() : 0);
+      Tags::Internal::RunParallel(MaxQueryThreads, found.size(), [&](size_t i) { found[i] = GetTags(*Repositories[i], func, sorted, getFiles); });
       std::vector<TagInfo> result;
-      for (auto repos = Repositories.begin(); repos != Repositories.end() && (unlimited || result.size() < Limit); ++repos)
+      for (size_t i = 0; i < Repositories.size() && (unlimited || result.size() < Limit); ++i)
       {
-        auto tags = SortTags(func(**repos), CurrentFile.c_str(), sorted ? SortOptions : Tags::SortingOptions::DoNotSort);
-        bool cachedOnTop = sorted && !!(SortOptions & Tags::SortingOptions::CachedTagsOnTop);
-        auto cached = cachedOnTop && !tags.empty() ? (*repos)->GetCachedTags(getFiles, Limit) : std::vector<TagInfo>();
-        tags = !cached.empty() ? Tags::MoveOnTop(std::move(tags), cached) : tags;
+        auto tags = unlimited ? std::move(found[i]) : GetTags(*Repositories[i], func, sorted, getFiles);
         auto tagsEnd = !unlimited && result.size() + tags.size() > Limit ? tags.begin() + (Limit - result.size()) : tags.end();
         std::move(tags.begin(), tagsEnd, std::back_inserter(result));
       }
@@ -86,22 +159,36 @@ namespace
       return std::move(result);
     }
 
-    std::vector<TagInfo> GetByPart(Repository const& repo, bool getFiles, const char* part, bool unlimited, size_t threshold, bool& thresholdReached) const
+    std::vector<TagInfo> GetTags(Repository const& repo, std::function<std::vector<TagInfo>(Repository const&)> const& func, bool sorted, bool getFiles) const
+    {
+      auto tags = func(repo);
+      bool cachedOnTop = sorted && !!(SortOptions & Tags::SortingOptions::CachedTagsOnTop);
+      auto cached = cachedOnTop && !tags.empty() ? repo.GetCachedTags(getFiles, Limit) : std::vector<TagInfo>();
+      tags = SortTags(std::move(tags), CurrentFile.c_str(), sorted ? SortOptions : Tags::SortingOptions::DoNotSort);
+      return cached.empty() ? std::move(tags) : Tags::MoveOnTop(std::move(tags), cached);
+    }
+
+    std::vector<TagInfo> GetByPart(Repository const& repo, bool getFiles, const char* part, bool unlimited, size_t threshold, bool& thresholdReached, LookupRange* range) const
     {
       size_t maxCount = unlimited ? 0 : Limit;
       size_t maxTotal = !threshold ? 0 : threshold + 1;
       bool useCached = !!(SortOptions & Tags::SortingOptions::CachedTagsOnTop);
-      auto result = getFiles ? repo.FindFiles(part, maxCount, useCached) : repo.FindByName(part, maxCount, maxTotal, CaseInsensitive, useCached);
-      thresholdReached = !getFiles && !!threshold && result.size() == threshold + 1;
-      result.resize(thresholdReached ? threshold : result.size());
-      return result;
+      auto result = getFiles ? repo.FindFiles(part, maxCount, useCached, range) : repo.FindByName(part, maxCount, maxTotal, CaseInsensitive, useCached, range);
+      return CutByThreshold(std::move(result), getFiles, threshold, thresholdReached);
+    }
+
+    static std::vector<TagInfo> CutByThreshold(std::vector<TagInfo>&& tags, bool getFiles, size_t threshold, bool& thresholdReached)
+    {
+      thresholdReached = !getFiles && !!threshold && tags.size() == threshold + 1;
+      tags.resize(thresholdReached ? threshold : tags.size());
+      return std::move(tags);
     }
 
     std::vector<TagInfo> GetCachedTags(Repository const& repo, bool getFiles) const
     {
       auto tags = repo.GetCachedTags(getFiles, Limit);
       bool unused;
-      return tags.empty() ? GetByPart(repo, getFiles, "", false, 0, unused) : std::move(tags);
+      return tags.empty() ? GetByPart(repo, getFiles, "", false, 0, unused, nullptr) : std::move(tags);
     }
 
     std::vector<RepositoryPtr> Repositories;
@@ -110,6 +197,117 @@ namespace
     Tags::SortingOptions SortOptions;
     size_t Limit;
   };
+
+  // Query keeps a copy of selector, so it may outlive the selector
+  class QueryImpl : public Tags::Query
+  {
+  public:
+    QueryImpl(SelectorImpl const& selector, std::string&& part, bool getFiles, size_t threshold, RepositoryRanges&& previous, Tags::TagsBatchReceiver&& receiver)
+      : Selector(selector)
+      , Part(std::move(part))
+      , GetFiles(getFiles)
+      , Threshold(threshold)
+      , Receiver(std::move(receiver))
+      , Cancelled(false)
+      , Reached(false)
+      , Done(false)
+    {
+      for (auto const& repo : Selector.GetRepositories())
+      {
+        auto range = FindRange(previous, *repo);
+        Ranges.emplace_back(repo.get(), range ? std::move(*range) : LookupRange());
+      }
+
+      Worker = std::thread([this]() { Run(); });
+    }
+
+    ~QueryImpl() override
+    {
+      Cancel();
+    }
+
+    void Cancel() override
+    {
+      Cancelled = true;
+      if (Worker.joinable())
+        Worker.join();
+    }
+
+    bool Wait(size_t timeoutMs) override
+    {
+      std::unique_lock<std::mutex> lock(Guard);
+      if (!Completed.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this]() { return Done; }))
+        return false;
+
+      if (Error)
+        std::rethrow_exception(Error);
+
+      return true;
+    }
+
+    bool ThresholdReached() const override
+    {
+      return Reached;
+    }
+
+    // Ranges of lines matched in repositories, lookup is cancelled first
+    RepositoryRanges TakeRanges()
+    {
+      Cancel();
+      return std::move(Ranges);
+    }
+
+  private:
+    void Run()
+    {
+      try
+      {
+        for (size_t i = 0; i < Ranges.size() && !Cancelled; ++i)
+        {
+          bool reached = false;
+          auto tags = Selector.GetByPart(*Selector.GetRepositories()[i], GetFiles, Part.c_str(), Threshold, reached, &Ranges[i].second, Cancelled);
+          if (Cancelled)
+            break;
+
+          Reached = Reached || reached;
+          if (!tags.empty() && !Receiver(std::move(tags)))
+            Cancelled = true;
+        }
+      }
+      catch (...)
+      {
+        Error = std::current_exception();
+      }
+
+      std::lock_guard<std::mutex> lock(Guard);
+      Done = true;
+      Completed.notify_all();
+    }
+
+    SelectorImpl const Selector;
+    std::string const Part;
+    bool const GetFiles;
+    size_t const Threshold;
+    Tags::TagsBatchReceiver const Receiver;
+    RepositoryRanges Ranges;
+    std::atomic<bool> Cancelled;
+    std::atomic<bool> Reached;
+    std::mutex Guard;
+    std::condition_variable Completed;
+    bool Done;
+    std::exception_ptr Error;
+    std::thread Worker;
+  };
+
+  std::unique_ptr<Tags::Query> SelectorImpl::GetByPartAsync(const char* part, bool getFiles, size_t threshold, Tags::TagsBatchReceiver&& receiver, Tags::Query* previous) const
+  {
+    auto previousQuery = dynamic_cast<QueryImpl*>(previous);
+    if (previous && !previousQuery)
+      previous->Cancel();
+
+    auto ranges = previousQuery ? previousQuery->TakeRanges() : RepositoryRanges();
+    return std::unique_ptr<Tags::Query>(new QueryImpl(*this, part, getFiles, threshold, std::move(ranges), std::move(receiver)));
+  }
 }
 
 namespace Tags
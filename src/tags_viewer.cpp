@@ -2,7 +2,9 @@
 #include "tags_selector.h"
 #include "tags_viewer.h"
 
+#include <iterator>
 #include <map>
+#include <mutex>
 #include <regex>
 #include <set>
 
@@ -13,6 +15,15 @@ namespace
   using Tags::TagsViewer;
   using Tags::FormatTagFlag;
 
+  // Time to wait for lookup by part before tags found so far are shown
+  size_t const PartialViewTimeoutMs = 300;
+
+  struct FoundTags
+  {
+    std::mutex Guard;
+    std::vector<TagInfo> Tags;
+  };
+
   class PartiallyMatchViewer : public TagsViewer
   {
   public:
@@ -24,12 +35,35 @@ namespace
   
     TagsView GetView(char const* filter, FormatTagFlag, size_t threshold, bool& thresholdReached) const override
     {
-      return TagsView(!*filter ? Selector->GetCachedTags(GetFiles) : Selector->GetByPart(filter, GetFiles, false, threshold, thresholdReached));
+      if (Query)
+        Query->Cancel();
+
+      if (!*filter)
+        return TagsView(Selector->GetCachedTags(GetFiles));
+
+      // Lookup of the previous filter is cancelled, it is still running if the view is asked for after every key
+      auto found = std::make_shared<FoundTags>();
+      Query = Selector->GetByPartAsync(filter, GetFiles, threshold, [found](std::vector<TagInfo>&& tags) {
+        std::lock_guard<std::mutex> lock(found->Guard);
+        std::move(tags.begin(), tags.end(), std::back_inserter(found->Tags));
+        return true;
+      }, Query.get());
+      bool const complete = Query->Wait(PartialViewTimeoutMs);
+      thresholdReached = thresholdReached || !complete || Query->ThresholdReached();
+      std::vector<TagInfo> tags;
+      {
+        std::lock_guard<std::mutex> lock(found->Guard);
+        tags = found->Tags;
+      }
+      // Names typed by their initials, like "gmti" for GetMatchedTagsImpl, are not matched by part
+      return TagsView(tags.empty() && complete && !GetFiles ? Selector->GetByFuzzyPart(filter) : std::move(tags));
     }
   
   private:
-    std::unique_ptr<Tags::Selector>&& Selector;
+    std::unique_ptr<Tags::Selector> Selector;
     bool GetFiles;
+    // Lookup of the last filter, typing one more character searches only lines it matched
+    mutable std::unique_ptr<Tags::Query> Query;
   };
   
   bool GetRegex(char const* filter, bool caseInsensitive, std::regex& result)
@@ -0,0 +1,429 @@
+#include <field_scan.h>
+#include <tags_repository.h>
+
+#include <algorithm>
+#include <ctype.h>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#if defined _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace
+{
+  struct Options
+  {
+    size_t TagsCount = 2000000;
+    size_t TagsPerFile = 50;
+    size_t PathDepth = 4;
+    size_t Words = 16;
+    bool FullPaths = false;
+    size_t Runs = 3;
+    size_t Queries = 1000;
+    size_t Updates = 20;
+    size_t Threads = 0;
+    size_t MemoryLimit = 0;
+    bool StoreFields = false;
+    bool InfixSearch = false;
+    bool NameFilter = false;
+    std::string TagsFile = "benchmark.tags";
+  };
+
+  Options ParseOptions(int argc, char* argv[])
+  {
+    Options result;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+      auto value = strtoul(argv[i + 1], nullptr, 10);
+      if (!strcmp(argv[i], "--tags"))
+        result.TagsCount = std::max(value, 1ul);
+      else if (!strcmp(argv[i], "--tags-per-file"))
+        result.TagsPerFile = std::max(value, 1ul);
+      else if (!strcmp(argv[i], "--path-depth"))
+        result.PathDepth = value;
+      else if (!strcmp(argv[i], "--words"))
+        result.Words = std::max(value, 1ul);
+      else if (!strcmp(argv[i], "--full-paths"))
+        result.FullPaths = !!value;
+      else if (!strcmp(argv[i], "--runs"))
+        result.Runs = std::max(value, 1ul);
+      else if (!strcmp(argv[i], "--queries"))
+        result.Queries = std::max(value, 1ul);
+      else if (!strcmp(argv[i], "--updates"))
+        result.Updates = value;
+      else if (!strcmp(argv[i], "--threads"))
+        result.Threads = value;
+      else if (!strcmp(argv[i], "--memory-limit"))
+        result.MemoryLimit = value * 1024 * 1024;
+      else if (!strcmp(argv[i], "--store-fields"))
+        result.StoreFields = !!value;
+      else if (!strcmp(argv[i], "--infix-search"))
+        result.InfixSearch = !!value;
+      else if (!strcmp(argv[i], "--name-filter"))
+        result.NameFilter = !!value;
+      else if (!strcmp(argv[i], "--file"))
+        result.TagsFile = argv[i + 1];
+      else
+        throw std::invalid_argument(std::string("Unknown option: ") + argv[i]);
+    }
+
+    return result;
+  }
+
+  struct GeneratedTag
+  {
+    std::string Name;
+    std::string Class;
+    std::string Line;
+  };
+
+  // Every file is generated from its own seed, so tags of any file are reproduced without keeping the whole repository.
+  // Names share long common prefixes and files are spread over nested directories like in real projects
+  class SyntheticRepository
+  {
+  public:
+    explicit SyntheticRepository(Options const& options)
+      : Settings(options)
+    {
+      char const* const words[] = {"Get", "Set", "Matched", "Tags", "Impl", "Offset", "Range", "File", "Name", "Path", "Index", "Create", "Load", "Cache", "Info", "Line"};
+      for (size_t i = 0; i < Settings.Words; ++i)
+        Words.push_back(i < sizeof(words) / sizeof(words[0]) ? words[i] : "Word" + std::to_string(i));
+    }
+
+    size_t FilesCount() const
+    {
+      return (Settings.TagsCount + Settings.TagsPerFile - 1) / Settings.TagsPerFile;
+    }
+
+    std::string GetPath(size_t file) const
+    {
+      std::mt19937 random(static_cast<unsigned>(file));
+      std::string path = Settings.FullPaths ? "C:/benchmark/" : "";
+      for (auto n = Settings.PathDepth ? RandomInt(random, 1, Settings.PathDepth) : 0; n > 0; --n)
+        path += "dir" + std::to_string(RandomInt(random, 0, 20)) + "/";
+
+      return path + "file" + std::to_string(file) + ".cpp";
+    }
+
+    // Revision renames some tags and shifts lines like editing of the file does
+    std::vector<GeneratedTag> GetTags(size_t file, size_t revision = 0) const
+    {
+      std::mt19937 random(static_cast<unsigned>(file * 7919 + 1));
+      std::mt19937 revisionRandom(static_cast<unsigned>(file * 7919 + revision * 104729 + 2));
+      auto const path = GetPath(file);
+      auto const count = std::min(Settings.TagsPerFile, Settings.TagsCount - file * Settings.TagsPerFile);
+      std::vector<GeneratedTag> result;
+      for (size_t i = 0; i < count; ++i)
+      {
+        GeneratedTag tag;
+        for (auto n = RandomInt(random, 1, 4); n > 0; --n)
+          tag.Name += Words[RandomInt(random, 0, Words.size() - 1)];
+
+        tag.Name += revision && !RandomInt(revisionRandom, 0, 9) ? "Revision" + std::to_string(revision) : "";
+        tag.Class = RandomInt(random, 0, 1) ? "ns::Cls" + std::to_string(RandomInt(random, 0, 1000)) : "";
+        auto line = RandomInt(random, 1, 5000) + (revision ? RandomInt(revisionRandom, 0, 10) : 0);
+        tag.Line = tag.Name + "\t" + path + "\t/^  void " + tag.Name + "();$/;\"\t" + (tag.Class.empty() ? "f" : "m") + "\tline:" + std::to_string(line) + (tag.Class.empty() ? "" : "\tclass:" + tag.Class);
+        result.push_back(std::move(tag));
+      }
+
+      return result;
+    }
+
+    void Write(std::string const& fileName, std::function<void(FILE*)> const& writeTags) const
+    {
+      FILE* f = fopen(fileName.c_str(), "wb");
+      if (!f)
+        throw std::runtime_error("Failed to create " + fileName);
+
+      fputs("!_TAG_FILE_FORMAT\t2\t/extended format/\n!_TAG_FILE_SORTED\t0\t/0=unsorted/\n", f);
+      writeTags(f);
+      fclose(f);
+    }
+
+    void Write(std::string const& fileName) const
+    {
+      Write(fileName, [this](FILE* f) {
+        for (size_t file = 0; file < FilesCount(); ++file)
+        {
+          for (auto const& tag : GetTags(file))
+            fprintf(f, "%s\n", tag.Line.c_str());
+        }
+      });
+    }
+
+    void Write(std::string const& fileName, std::vector<GeneratedTag> const& tags) const
+    {
+      Write(fileName, [&tags](FILE* f) {
+        for (auto const& tag : tags)
+          fprintf(f, "%s\n", tag.Line.c_str());
+      });
+    }
+
+  private:
+    static size_t RandomInt(std::mt19937& random, size_t from, size_t to)
+    {
+      return std::uniform_int_distribution<size_t>(from, to)(random);
+    }
+
+    Options const Settings;
+    std::vector<std::string> Words;
+  };
+
+  size_t GetPeakRss()
+  {
+#if defined _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? counters.PeakWorkingSetSize : 0;
+#else
+    rusage usage;
+    return !getrusage(RUSAGE_SELF, &usage) ? static_cast<size_t>(usage.ru_maxrss) * 1024 : 0;
+#endif
+  }
+
+  double Measure(std::function<void()> const& func)
+  {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  // Lower case first letters of camelCase words, the way fuzzy search is typed
+  std::string GetInitials(std::string const& name)
+  {
+    std::string result;
+    for (auto c : name)
+    {
+      if (isupper(static_cast<unsigned char>(c)))
+        result += static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    }
+
+    return result;
+  }
+
+  double GetPercentile(std::vector<double> const& sorted, double percentile)
+  {
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(percentile / 100 * sorted.size()))];
+  }
+
+  // Peak RSS never decreases, so it is the largest memory use of all benchmarks run so far
+  void Report(std::string const& name, std::vector<double> latencies, size_t found = 0)
+  {
+    if (latencies.empty())
+      return;
+
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << std::fixed << std::setprecision(3) << name << ", " << latencies.size() << " runs: "
+              << "p50 " << GetPercentile(latencies, 50) << " ms, "
+              << "p90 " << GetPercentile(latencies, 90) << " ms, "
+              << "p99 " << GetPercentile(latencies, 99) << " ms, "
+              << "max " << latencies.back() << " ms";
+    if (found)
+      std::cout << ", " << found << " tags found";
+
+    std::cout << ", peak RSS " << GetPeakRss() / (1024 * 1024) << " MB" << std::endl;
+  }
+
+  class Benchmarks
+  {
+  public:
+    explicit Benchmarks(Options const& options)
+      : Settings(options)
+      , Generated(options)
+      , Random(1)
+    {
+      IndexSettings.Threads = Settings.Threads;
+      IndexSettings.MemoryLimit = Settings.MemoryLimit;
+      IndexSettings.StoreFields = Settings.StoreFields;
+      IndexSettings.InfixSearch = Settings.InfixSearch;
+      IndexSettings.NameFilter = Settings.NameFilter;
+    }
+
+    ~Benchmarks()
+    {
+      for (auto const& suffix : {"", ".idx", ".fields", ".update"})
+        remove((Settings.TagsFile + suffix).c_str());
+    }
+
+    void Run()
+    {
+      auto generation = Measure([this]() { Generated.Write(Settings.TagsFile); });
+      std::cout << "Generated " << Settings.TagsCount << " tags in " << Generated.FilesCount() << " files: " << generation << " ms" << std::endl;
+      ScanFields();
+      Report("Load cold", Repeat(Settings.Runs, [this](size_t) { LoadCold(); }));
+      Report("Load warm", Repeat(Settings.Runs, [this](size_t) { Load(); }));
+      auto repository = Load();
+      RunQueries("FindByName exact", MakeQueries([this]() { return GetRandomTag().Name; }), [&repository](std::string const& name) { return repository->FindByName(name.c_str()); });
+      RunQueries("FindByName absent", MakeQueries([this]() { return GetRandomTag().Name + "Absent"; }), [&repository](std::string const& name) { return repository->FindByName(name.c_str()); });
+      auto const prefixes = MakeQueries([this]() { return GetRandomTag().Name.substr(0, 4); });
+      RunQueries("FindByName partial", prefixes, [&repository](std::string const& part) { return repository->FindByName(part.c_str(), 100, 0, false, false); });
+      RunQueries("FindByName partial case insensitive", prefixes, [&repository](std::string const& part) { return repository->FindByName(part.c_str(), 100, 0, true, false); });
+      RunQueries("FindByNameFuzzy", MakeQueries([this]() { return GetInitials(GetRandomTag().Name); }), [&repository](std::string const& pattern) { return repository->FindByNameFuzzy(pattern.c_str(), 100); });
+      RunQueries("FindByNameInfix", MakeQueries([this]() { auto const name = GetRandomTag().Name; return name.substr(name.length() / 2, 5); }), [&repository](std::string const& part) { return repository->FindByNameInfix(part.c_str(), 100); });
+      std::vector<std::string> files;
+      RunQueries("FindFiles", MakeQueries([this]() { return GetFilename(GetRandomFile()); }), [&repository, &files](std::string const& path) {
+        auto tags = repository->FindFiles(path.c_str());
+        if (!tags.empty())
+          files.push_back(tags.front().file);
+
+        return tags;
+      });
+      RunQueries("FindClassMembers", MakeQueries([this]() { return GetRandomClass(); }), [&repository](std::string const& classname) { return repository->FindClassMembers(classname.c_str()); });
+      RunQueries("FindByFile", files, [&repository](std::string const& file) { return repository->FindByFile(file.c_str()); });
+      std::vector<double> updates;
+      for (size_t revision = 1; revision <= Settings.Updates; ++revision)
+        updates.push_back(UpdateTagsByFile(*repository, revision));
+
+      Report("UpdateTagsByFile", updates);
+    }
+
+  private:
+    std::vector<double> Repeat(size_t count, std::function<void(size_t)> const& func)
+    {
+      std::vector<double> result;
+      for (size_t i = 0; i < count; ++i)
+        result.push_back(Measure([&func, i]() { func(i); }));
+
+      return result;
+    }
+
+    // Splits the whole tags file into fields with every implementation supported by processor, throughput is given for the fastest run
+    void ScanFields()
+    {
+      std::string content;
+      std::unique_ptr<FILE, int(*)(FILE*)> file(fopen(Settings.TagsFile.c_str(), "rb"), &fclose);
+      char buffer[1 << 16];
+      for (size_t sz = 0; file && (sz = fread(buffer, 1, sizeof(buffer), file.get())) > 0; content.append(buffer, sz));
+      if (content.empty())
+        throw std::runtime_error("Failed to read " + Settings.TagsFile);
+
+      for (auto const& scanner : Tags::Internal::GetFieldScanners())
+      {
+        size_t fields = 0;
+        auto latencies = Repeat(Settings.Runs, [&content, &scanner, &fields](size_t) {
+          fields = 0;
+          for (auto cur = content.c_str(); *cur; ++fields)
+          {
+            auto end = scanner.FindFieldEnd(cur);
+            cur = *end ? end + 1 : end;
+          }
+        });
+        Report(std::string("Field scanning ") + scanner.Name, latencies);
+        std::cout << std::fixed << std::setprecision(1) << "  " << content.size() / (1024.0 * 1024.0) / (*std::min_element(latencies.begin(), latencies.end()) / 1000) << " MB/s, " << fields << " fields" << std::endl;
+      }
+    }
+
+    std::vector<std::string> MakeQueries(std::function<std::string()> const& makeQuery)
+    {
+      std::vector<std::string> result;
+      for (size_t i = 0; i < Settings.Queries; ++i)
+        result.push_back(makeQuery());
+
+      return result;
+    }
+
+    void RunQueries(std::string const& name, std::vector<std::string> const& queries, std::function<std::vector<TagInfo>(std::string const&)> const& query)
+    {
+      size_t found = 0;
+      Report(name, Repeat(queries.size(), [&](size_t i) { found += query(queries[i]).size(); }), found);
+    }
+
+    std::unique_ptr<Tags::Internal::Repository> Load()
+    {
+      auto repository = Tags::Internal::Repository::Create(Settings.TagsFile.c_str(), false, IndexSettings);
+      size_t symbolsLoaded = 0;
+      if (repository->Load(symbolsLoaded))
+        throw std::runtime_error("Failed to load " + Settings.TagsFile);
+
+      return repository;
+    }
+
+    void LoadCold()
+    {
+      remove((Settings.TagsFile + ".idx").c_str());
+      remove((Settings.TagsFile + ".fields").c_str());
+      Load();
+    }
+
+    static std::string GetFilename(size_t file)
+    {
+      return "file" + std::to_string(file) + ".cpp";
+    }
+
+    size_t GetRandomFile()
+    {
+      return std::uniform_int_distribution<size_t>(0, Generated.FilesCount() - 1)(Random);
+    }
+
+    GeneratedTag GetRandomTag()
+    {
+      auto tags = Generated.GetTags(GetRandomFile());
+      return tags[std::uniform_int_distribution<size_t>(0, tags.size() - 1)(Random)];
+    }
+
+    std::string GetRandomClass()
+    {
+      for (;;)
+      {
+        auto tag = GetRandomTag();
+        if (!tag.Class.empty())
+          return tag.Class;
+      }
+    }
+
+    // Every update replaces tags of a random file with its next revision, repository is reloaded after update like plugin does
+    double UpdateTagsByFile(Tags::Internal::Repository& repository, size_t revision)
+    {
+      auto file = GetRandomFile();
+      auto tags = repository.FindFiles(GetFilename(file).c_str());
+      if (tags.empty())
+        throw std::runtime_error("File to update is not found: " + GetFilename(file));
+
+      auto const fileTagsFile = Settings.TagsFile + ".update";
+      Generated.Write(fileTagsFile, Generated.GetTags(file, revision));
+      return Measure([&]() {
+        auto commit = repository.UpdateTagsByFile(tags.front().file.c_str(), fileTagsFile.c_str());
+        if (!commit)
+          throw std::runtime_error("Failed to update tags of " + tags.front().file);
+
+        commit();
+        size_t symbolsLoaded = 0;
+        if (repository.Load(symbolsLoaded))
+          throw std::runtime_error("Failed to load updated " + Settings.TagsFile);
+      });
+    }
+
+    Options const Settings;
+    SyntheticRepository const Generated;
+    Tags::IndexOptions IndexSettings;
+    std::mt19937 Random;
+  };
+}
+
+int main(int argc, char* argv[])
+{
+  try
+  {
+    Benchmarks(ParseOptions(argc, argv)).Run();
+  }
+  catch (std::exception const& e)
+  {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,74 @@
+#include <gtest/gtest.h>
+#include <excmd_pattern.h>
+
+#include <regex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Tags
+{
+namespace Internal
+{
+  namespace Tests
+  {
+    bool RegexMatches(std::string const& pattern, std::string const& line)
+    {
+      try
+      {
+        return !pattern.empty() && std::regex_match(line, std::regex(pattern));
+      }
+      catch (std::exception const&)
+      {
+      }
+
+      return false;
+    }
+
+    void TestMatches(std::string const& pattern, std::vector<std::pair<std::string, bool>> const& lines)
+    {
+      ExcmdPattern compiled(pattern);
+      for (auto const& line : lines)
+      {
+        EXPECT_EQ(line.second, compiled.Matches(line.first.c_str())) << "Pattern: " << pattern << ", line: " << line.first;
+        EXPECT_EQ(RegexMatches(pattern, line.first), compiled.Matches(line.first.c_str())) << "Pattern: " << pattern << ", line: " << line.first;
+      }
+    }
+
+    TEST(ExcmdPattern, MatchesLiteralsWithFlexibleSpaces)
+    {
+      TestMatches("void\\s+Foo\\(int\\s+a\\);", {{"void Foo(int a);", true}, {"void  Foo(int\ta);", true}, {"voidFoo(int a);", false}, {"void Foo(int a); ", false}, {"void Foo(int a)", false}});
+      TestMatches("\\s*int\\s+main\\(\\)\\s*", {{"  int main()  ", true}, {"int main()", true}, {"int  main ( )", false}, {"", false}});
+      TestMatches("^class A$", {{"class A", true}, {"class A ", false}, {" class A", false}});
+    }
+
+    TEST(ExcmdPattern, MatchesTruncatedPatterns)
+    {
+      TestMatches("class\\s+A\\s*\\{.+", {{"class A {}", true}, {"class A{ x", true}, {"class A {", false}, {"class A {\r", false}});
+      TestMatches("foo\\s+.+", {{"foo   ", true}, {"foo x", true}, {"foo ", false}});
+    }
+
+    TEST(ExcmdPattern, MatchesEscapedCharacters)
+    {
+      TestMatches("a\\/b\\\\c", {{"a/b\\c", true}, {"a\\/b\\c", false}});
+      TestMatches("cost\\$", {{"cost$", true}, {"cost", false}});
+      TestMatches("a\\s*\\ b", {{"a  b", true}, {"a b", true}, {"ab", false}});
+      TestMatches("x\\.y\\*\\[0\\]", {{"x.y*[0]", true}, {"xzy*[0]", false}});
+    }
+
+    TEST(ExcmdPattern, FallsBackToRegex)
+    {
+      TestMatches("\\d+", {{"123", true}, {"12a", false}});
+      TestMatches("(a|b)c", {{"ac", true}, {"bc", true}, {"c", false}});
+      TestMatches("(", {{"(", false}});
+      TestMatches("", {{"", false}});
+    }
+  }
+}
+}
+
+int main(int argc, char* argv[])
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
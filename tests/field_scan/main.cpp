@@ -0,0 +1,105 @@
+#include <gtest/gtest.h>
+#include <field_scan.h>
+
+#include <ctype.h>
+#include <random>
+#include <string>
+
+namespace Tags
+{
+namespace Internal
+{
+  namespace Tests
+  {
+    // Every end character is put at every offset from every alignment of the string start, so both partial first block and following blocks are covered
+    TEST(FieldScan, ScannersFindSameEnds)
+    {
+      auto const scanners = GetFieldScanners();
+      ASSERT_FALSE(scanners.empty());
+      ASSERT_EQ(std::string("Scalar"), scanners.front().Name);
+      for (auto const& scanner : scanners)
+      {
+        for (char end : {'\t', '\r', '\n', '\0'})
+        {
+          for (size_t start = 0; start < 64; ++start)
+          {
+            for (size_t length = 0; length < 100; ++length)
+            {
+              std::string buffer(start + length + 1, 'a');
+              buffer[start + length] = end;
+              auto str = buffer.c_str() + start;
+              // Tab is followed by terminating zero of the buffer
+              size_t const lineLength = end == '\t' ? length + 1 : length;
+              ASSERT_EQ(length, static_cast<size_t>(scanner.FindFieldEnd(str) - str)) << scanner.Name << ", start: " << start << ", length: " << length;
+              ASSERT_EQ(lineLength, static_cast<size_t>(scanner.FindLineEnd(str) - str)) << scanner.Name << ", start: " << start << ", length: " << length;
+            }
+          }
+        }
+      }
+    }
+
+    TEST(FieldScan, FirstEndIsFound)
+    {
+      std::string const line = std::string(40, 'x') + "\tfile\t/^pattern$/;\"\tf\r\n";
+      for (auto const& scanner : GetFieldScanners())
+      {
+        EXPECT_EQ(line.c_str() + 40, scanner.FindFieldEnd(line.c_str())) << scanner.Name;
+        EXPECT_EQ(line.c_str() + 45, scanner.FindFieldEnd(line.c_str() + 41)) << scanner.Name;
+        EXPECT_EQ(line.c_str() + line.length() - 2, scanner.FindLineEnd(line.c_str())) << scanner.Name;
+      }
+
+      EXPECT_EQ(line.c_str() + 40, FindFieldEnd(line.c_str()));
+      EXPECT_EQ(line.c_str() + line.length() - 2, FindLineEnd(line.c_str()));
+    }
+
+    TEST(FieldScan, EqualPrefixesHaveSameLength)
+    {
+      auto const scanners = GetFieldScanners();
+      std::mt19937 random(1);
+      char const chars[] = {'a', 'A', 'z', 'Z', '@', '[', '`', '{', '/', '\\', '\t', '\r', '\xc0', '\xe0'};
+      for (size_t i = 0; i < 10000; ++i)
+      {
+        // Mostly equal strings of random length with differences after long equal prefixes
+        std::string left(random() % 80, 'x');
+        for (auto& c : left)
+          c = random() % 8 ? chars[random() % 4] : chars[random() % sizeof(chars)];
+
+        std::string right = left;
+        for (auto& c : right)
+          c = random() % 50 ? (random() % 2 ? static_cast<char>(toupper(static_cast<unsigned char>(c))) : c) : chars[random() % sizeof(chars)];
+
+        auto offset = random() % 32;
+        left.insert(0, offset, 'q');
+        right.insert(0, offset / 2, 'q');
+        for (bool caseInsensitive : {false, true})
+        {
+          for (bool stopAtSeparators : {false, true})
+          {
+            auto expected = scanners.front().GetEqualPrefixLength(left.c_str() + offset, right.c_str() + offset / 2, caseInsensitive, stopAtSeparators);
+            for (auto const& scanner : scanners)
+              ASSERT_EQ(expected, scanner.GetEqualPrefixLength(left.c_str() + offset, right.c_str() + offset / 2, caseInsensitive, stopAtSeparators)) << scanner.Name << ", left: " << left << ", right: " << right;
+          }
+        }
+      }
+    }
+
+    TEST(FieldScan, EqualPrefixStopsAtDifferenceFieldEndAndSeparator)
+    {
+      for (auto const& scanner : GetFieldScanners())
+      {
+        EXPECT_EQ(21u, scanner.GetEqualPrefixLength("GetMatchedOffsetRangeX", "getmatchedoffsetrangeY", true, false)) << scanner.Name;
+        EXPECT_EQ(0u, scanner.GetEqualPrefixLength("GetMatchedOffsetRange", "getmatchedoffsetrange", false, false)) << scanner.Name;
+        EXPECT_EQ(21u, scanner.GetEqualPrefixLength("long_enough_file_name\tfile", "long_enough_file_name\tfile", false, false)) << scanner.Name;
+        EXPECT_EQ(9u, scanner.GetEqualPrefixLength("directory/nested\\file.cpp", "DIRECTORY/nested/file.cpp", true, true)) << scanner.Name;
+        EXPECT_EQ(25u, scanner.GetEqualPrefixLength("directory/nested/file.cpp", "DIRECTORY/nested/file.cpp", true, false)) << scanner.Name;
+      }
+    }
+  }
+}
+}
+
+int main(int argc, char* argv[])
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
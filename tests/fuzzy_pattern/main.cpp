@@ -0,0 +1,81 @@
+#include <gtest/gtest.h>
+#include <fuzzy_pattern.h>
+
+#include <string>
+#include <vector>
+
+namespace Tags
+{
+namespace Internal
+{
+  namespace Tests
+  {
+    bool Matches(std::string const& pattern, std::string const& name, int& score)
+    {
+      return FuzzyPattern(pattern).Matches(name.data(), name.data() + name.length(), score);
+    }
+
+    bool Matches(std::string const& pattern, std::string const& name)
+    {
+      int score = 0;
+      return Matches(pattern, name, score);
+    }
+
+    int GetScore(std::string const& pattern, std::string const& name)
+    {
+      int score = 0;
+      EXPECT_TRUE(Matches(pattern, name, score)) << "Pattern: " << pattern << ", name: " << name;
+      return score;
+    }
+
+    // Names are given from the best match to the worst one
+    void TestOrder(std::string const& pattern, std::vector<std::string> const& names)
+    {
+      for (size_t i = 1; i < names.size(); ++i)
+        EXPECT_GT(GetScore(pattern, names[i - 1]), GetScore(pattern, names[i])) << "Pattern: " << pattern << ", names: " << names[i - 1] << ", " << names[i];
+    }
+
+    TEST(FuzzyPattern, MatchesSubsequenceIgnoringCase)
+    {
+      EXPECT_TRUE(Matches("gmti", "GetMatchedTagsImpl"));
+      EXPECT_TRUE(Matches("GMTR", "GetMatchedOffsetRange"));
+      EXPECT_TRUE(Matches("get_tag", "get_matched_tags"));
+      EXPECT_TRUE(Matches("abc", "abc"));
+      EXPECT_FALSE(Matches("gmtr", "GetTagsImpl"));
+      EXPECT_FALSE(Matches("abc", "acb"));
+      EXPECT_FALSE(Matches("abcd", "abc"));
+      EXPECT_FALSE(Matches("", "abc"));
+    }
+
+    TEST(FuzzyPattern, PrefersWordStarts)
+    {
+      TestOrder("gmt", {"GetMatchedTags", "GetMetadata", "agamemnonty"});
+      TestOrder("ftb", {"foo_table_build", "footable_build", "fastable"});
+      TestOrder("v2", {"vec_v2x", "vector2", "avx2"});
+    }
+
+    TEST(FuzzyPattern, PrefersConsecutiveCharacters)
+    {
+      TestOrder("tag", {"TagInfo", "TheAgent", "tXaXg"});
+      TestOrder("info", {"GetInfo", "getinfo", "gixnxfxo"});
+    }
+
+    TEST(FuzzyPattern, SignatureContainsPatternCharacters)
+    {
+      std::string const name = "Get_Tags2";
+      auto nameSignature = FuzzyPattern::GetSignature(name.data(), name.data() + name.length());
+      for (auto const& pattern : {"gt", "GT2", "_s", "tags", "g_2"})
+        EXPECT_EQ(FuzzyPattern(pattern).GetSignature(), FuzzyPattern(pattern).GetSignature() & nameSignature) << "Pattern: " << pattern;
+
+      EXPECT_NE(0u, FuzzyPattern("x").GetSignature() & ~nameSignature);
+      EXPECT_NE(0u, FuzzyPattern("4").GetSignature() & ~nameSignature);
+    }
+  }
+}
+}
+
+int main(int argc, char* argv[])
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
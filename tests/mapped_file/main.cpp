@@ -0,0 +1,122 @@
+#include <gtest/gtest.h>
+#include <mapped_file.h>
+
+#include <fstream>
+#include <stdio.h>
+#include <string>
+
+namespace Tags
+{
+namespace Internal
+{
+  namespace Tests
+  {
+    std::string const TestFile = "mapped_file_test.txt";
+
+    void WriteFile(std::string const& content, std::string const& fileName = TestFile)
+    {
+      std::ofstream file(fileName, std::ios_base::binary | std::ios_base::trunc);
+      file << content;
+    }
+
+    class MappedFileTest : public ::testing::Test
+    {
+    protected:
+      void TearDown() override
+      {
+        remove(TestFile.c_str());
+      }
+    };
+
+    TEST_F(MappedFileTest, MapsFileContent)
+    {
+      std::string const content = "!_TAG_FILE_FORMAT\t2\nname\tfile.cpp\t/^name$/;\"\tf\n";
+      WriteFile(content);
+      auto mapped = MapFile(TestFile.c_str());
+      ASSERT_TRUE(!!mapped);
+      ASSERT_EQ(content.length(), mapped->Size());
+      ASSERT_EQ(content, std::string(mapped->Data(), mapped->Size()));
+    }
+
+    TEST_F(MappedFileTest, MapsEmptyFile)
+    {
+      WriteFile("");
+      auto mapped = MapFile(TestFile.c_str());
+      ASSERT_TRUE(!!mapped);
+      ASSERT_EQ(0, mapped->Size());
+    }
+
+    TEST_F(MappedFileTest, FailsToMapNotExistingFile)
+    {
+      ASSERT_FALSE(!!MapFile("Not/Existing/File"));
+    }
+
+    TEST_F(MappedFileTest, LoadsFileContent)
+    {
+      std::string const content = "!_TAG_FILE_FORMAT\t2\nname\tfile.cpp\t/^name$/;\"\tf\n";
+      WriteFile(content);
+      auto loaded = LoadFile(TestFile.c_str());
+      ASSERT_TRUE(!!loaded);
+      ASSERT_EQ(content, std::string(loaded->Data(), loaded->Size()));
+      WriteFile("changed");
+      ASSERT_EQ(content, std::string(loaded->Data(), loaded->Size()));
+      WriteFile("");
+      loaded = LoadFile(TestFile.c_str());
+      ASSERT_TRUE(!!loaded);
+      ASSERT_EQ(0, loaded->Size());
+      ASSERT_FALSE(!!LoadFile("Not/Existing/File"));
+    }
+
+    TEST_F(MappedFileTest, KeepsContentAfterFileRemoved)
+    {
+      std::string const content = "content";
+      WriteFile(content);
+      auto mapped = MapFile(TestFile.c_str());
+      ASSERT_TRUE(!!mapped);
+      remove(TestFile.c_str());
+      ASSERT_EQ(content, std::string(mapped->Data(), mapped->Size()));
+    }
+
+    TEST_F(MappedFileTest, PublishedFileReplacesTarget)
+    {
+      std::string const publishedFile = TestFile + ".published";
+      WriteFile("previous");
+      WriteFile("published", publishedFile);
+      ASSERT_TRUE(PublishFile(publishedFile.c_str(), TestFile.c_str()));
+      auto loaded = LoadFile(TestFile.c_str());
+      ASSERT_TRUE(!!loaded);
+      ASSERT_EQ("published", std::string(loaded->Data(), loaded->Size()));
+      ASSERT_FALSE(!!LoadFile(publishedFile.c_str()));
+      ASSERT_FALSE(PublishFile(publishedFile.c_str(), TestFile.c_str()));
+    }
+
+    TEST_F(MappedFileTest, PublishedFileReplacesMappedTarget)
+    {
+      std::string const publishedFile = TestFile + ".published";
+      WriteFile("previous");
+      auto mapped = MapFile(TestFile.c_str());
+      ASSERT_TRUE(!!mapped);
+      for (auto const& content : {"published", "published again"})
+      {
+        WriteFile(content, publishedFile);
+        ASSERT_TRUE(PublishFile(publishedFile.c_str(), TestFile.c_str()));
+        auto loaded = LoadFile(TestFile.c_str());
+        ASSERT_TRUE(!!loaded);
+        ASSERT_EQ(content, std::string(loaded->Data(), loaded->Size()));
+        ASSERT_EQ("previous", std::string(mapped->Data(), mapped->Size()));
+      }
+
+      // Target moved aside is removed by publish after it is unmapped
+      mapped.reset();
+      WriteFile("published", publishedFile);
+      ASSERT_TRUE(PublishFile(publishedFile.c_str(), TestFile.c_str()));
+    }
+  }
+}
+}
+
+int main(int argc, char* argv[])
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -1,20 +1,50 @@
 #include <gtest/gtest.h>
+#include <mapped_file.h>
+#include <tags_index_options.h>
+#include <tags_repository.h>
 #include <tags_repository_storage.h>
 #include <tags_selector.h>
+#include <tags_viewer.h>
 #include <tags.h>
 
+#include <chrono>
 #include <fstream>
 #include <functional>
+#include <future>
+#include <iterator>
 #include <memory>
+#include <stdio.h>
 #include <string>
 #include <sys/stat.h>
 #include <regex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <tuple>
 #include <vector>
+#ifdef _WIN32
+#include <process.h>
+#include <sys/utime.h>
+#else
+#include <unistd.h>
+#include <utime.h>
+#endif
 
 namespace
 {
   bool CheckIdxFiles = false;
 
+  // Temporary files of index build are named by process id and number
+  std::string GetTemporaryFile(std::string const& prefix, size_t number)
+  {
+#ifdef _WIN32
+    auto const pid = _getpid();
+#else
+    auto const pid = getpid();
+#endif
+    return prefix + std::to_string(pid) + "." + std::to_string(number);
+  }
+
   std::string GetFilePath(std::string const& file)
   {
     auto pos = file.find_last_of("\\/");
@@ -82,6 +112,12 @@ namespace
     return stat(filename.c_str(), &st) == -1 ? 0 : std::max(st.st_mtime, st.st_ctime);
   }
 
+  bool SetModificationTime(std::string const& filename, time_t modTime)
+  {
+    struct utimbuf times = {modTime, modTime};
+    return utime(filename.c_str(), &times) == 0;
+  }
+
   std::vector<std::string> ToStrings(std::vector<TagInfo>&& tags)
   {
     std::vector<std::string> result;
@@ -156,6 +192,28 @@ namespace
     return result;
   }
 
+  std::string ReadFile(std::string const& fileName)
+  {
+    std::ifstream file(fileName, std::ios_base::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  }
+
+  void WriteFile(std::string const& fileName, std::string const& content)
+  {
+    std::ofstream file(fileName, std::ios_base::binary | std::ios_base::trunc);
+    file << content;
+  }
+
+  // Tags named Name<i> in files folder/file<i>.cpp
+  std::string MakeNumberedTags(size_t count)
+  {
+    std::string result = "!_TAG_FILE_FORMAT\t2\t/extended format/\n";
+    for (size_t i = 0; i < count; ++i)
+      result += "Name" + std::to_string(i) + "\tfolder/file" + std::to_string(i) + ".cpp\t/^void Name();$/;\"\tf\tline:1\n";
+
+    return result;
+  }
+
   MetaClassCont LoadMetaClasses(std::string const& fileName, std::string const& repoRoot)
   {
     std::ifstream file;
@@ -514,6 +572,46 @@ namespace TESTS
       ASSERT_EQ(0, Storage->GetByType(RepositoryType::Regular).size());
     }
 
+    std::string BuildIndex(std::string const& tagsFile, size_t threads, size_t memoryLimit = 0, bool infixSearch = false, bool nameFilter = false)
+    {
+      IndexOptions options;
+      options.Threads = threads;
+      options.MemoryLimit = memoryLimit;
+      options.InfixSearch = infixSearch;
+      options.NameFilter = nameFilter;
+      auto idxFile = tagsFile + ".idx";
+      remove(idxFile.c_str());
+      size_t symbolsLoaded = 0;
+      EXPECT_EQ(LoadSuccess, RepositoryStorage::Create(options)->Load(tagsFile.c_str(), RepositoryType::Regular, symbolsLoaded));
+      auto result = ReadFile(idxFile);
+      remove(idxFile.c_str());
+      return result;
+    }
+
+    // Tags found by every name, class and file of tags file
+    std::vector<TagInfo> FindAllTags(std::string const& tagsFile, IndexOptions const& options)
+    {
+      auto repository = Internal::Repository::Create(tagsFile.c_str(), false, options);
+      size_t symbolsLoaded = 0;
+      EXPECT_EQ(LoadSuccess, repository->Load(symbolsLoaded));
+      std::vector<TagInfo> result;
+      std::istringstream tags(ReadFile(tagsFile));
+      for (std::string line; std::getline(tags, line);)
+      {
+        auto nameEnd = line.find('\t');
+        if (line.empty() || line[0] == '!' || nameEnd == std::string::npos)
+          continue;
+
+        auto name = line.substr(0, nameEnd);
+        auto file = line.substr(nameEnd + 1, line.find('\t', nameEnd + 1) - nameEnd - 1);
+        auto byName = repository->FindByName(name.c_str());
+        for (auto const& found : {byName, repository->FindClassMembers(name.c_str()), repository->FindFiles(file.c_str()), byName.empty() ? EmptyTags : repository->FindByFile(byName.front().file.c_str())})
+          result.insert(result.end(), found.begin(), found.end());
+      }
+
+      return result;
+    }
+
     void ClearCache(std::string const& file)
     {
       auto selector = GetSelector(file.c_str(), true, SortingOptions::Default, UnlimitedMaxCount);
@@ -816,6 +914,856 @@ namespace TESTS
       ASSERT_EQ(123, tag.lineno);
   }
 
+  TEST_F(Tags, TagsOfCurrentFileAreSortedFirst)
+  {
+    std::string const tagsFile = "repeated_files_repos/tags.universal";
+    size_t const tagsInRepository = 32;
+    ASSERT_NO_FATAL_FAILURE(LoadTagsFileImpl(tagsFile.c_str(), RepositoryType::Regular, tagsInRepository));
+    auto tags = Find("bar", tagsFile.c_str(), SortingOptions::DoNotSort);
+    ASSERT_LT(2u, tags.size());
+    auto const currentFile = tags.at(tags.size() / 2).file;
+    auto const options = SortingOptions::SortByName | SortingOptions::CurFileFirst;
+    auto sorted = SortTags(std::vector<TagInfo>(tags), MixCase(currentFile).c_str(), options);
+    ASSERT_EQ(tags.size(), sorted.size());
+    EXPECT_EQ(currentFile, sorted.front().file);
+    EXPECT_TRUE(std::is_sorted(sorted.begin() + 1, sorted.end(), [](TagInfo const& left, TagInfo const& right) { return left.file < right.file; }));
+  }
+
+  TEST_F(Tags, NarrowedLookupByPartFindsSameTags)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal.narrowed";
+    WriteFile(tagsFile, MakeNumberedTags(600));
+    size_t symbolsLoaded = 0;
+    ASSERT_EQ(LoadSuccess, Storage->Load(tagsFile.c_str(), RepositoryType::Regular, symbolsLoaded));
+    for (bool getFiles : {false, true})
+    {
+      auto selector = GetSelector(tagsFile.c_str(), true, SortingOptions::Default, 20);
+      std::shared_ptr<LookupRanges> ranges;
+      // Parts are typed and erased, so lookups are both narrowed and restarted
+      for (auto part : getFiles ? std::vector<char const*>{"f", "fi", "file1", "file12", "file1", "FILE5", "file59", "folder/file5", "x", "file"} : std::vector<char const*>{"n", "na", "name1", "name12", "name1", "NAME5", "name59", "name599x", "x", "name"})
+      {
+        bool expectedReached = false;
+        bool reached = false;
+        std::shared_ptr<LookupRanges> fresh;
+        auto expected = selector->GetByPart(part, getFiles, false, 30, expectedReached, fresh);
+        EXPECT_EQ(expected, selector->GetByPart(part, getFiles, false, 30, reached, ranges)) << "Part: " << part;
+        EXPECT_EQ(expectedReached, reached) << "Part: " << part;
+      }
+    }
+
+    remove(tagsFile.c_str());
+    remove((tagsFile + ".idx").c_str());
+  }
+
+  TEST_F(Tags, AsyncLookupByPartFindsSameTags)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal.async";
+    WriteFile(tagsFile, MakeNumberedTags(600));
+    size_t symbolsLoaded = 0;
+    ASSERT_EQ(LoadSuccess, Storage->Load(tagsFile.c_str(), RepositoryType::Regular, symbolsLoaded));
+    for (bool getFiles : {false, true})
+    {
+      auto selector = GetSelector(tagsFile.c_str(), true, SortingOptions::Default, 20);
+      std::unique_ptr<Query> query;
+      for (auto part : getFiles ? std::vector<char const*>{"f", "fi", "file1", "file12", "file1", "FILE5", "folder/file5", "x"} : std::vector<char const*>{"n", "na", "name1", "name12", "name1", "NAME5", "name599x", "x"})
+      {
+        bool expectedReached = false;
+        std::shared_ptr<LookupRanges> fresh;
+        auto expected = selector->GetByPart(part, getFiles, false, 30, expectedReached, fresh);
+        auto found = std::make_shared<std::vector<TagInfo>>();
+        query = selector->GetByPartAsync(part, getFiles, 30, [found](std::vector<TagInfo>&& tags) {
+          std::move(tags.begin(), tags.end(), std::back_inserter(*found));
+          return true;
+        }, query.get());
+        ASSERT_TRUE(query->Wait(10000)) << "Part: " << part;
+        EXPECT_EQ(expected, *found) << "Part: " << part;
+        EXPECT_EQ(expectedReached, query->ThresholdReached()) << "Part: " << part;
+      }
+    }
+
+    auto repository = Internal::Repository::Create(tagsFile.c_str(), false);
+    ASSERT_EQ(LoadSuccess, repository->Load(symbolsLoaded));
+    size_t batches = 0;
+    size_t received = 0;
+    repository->FindByPart("Name", false, 0, 0, false, false, nullptr, [&batches, &received](std::vector<TagInfo>&& tags) {
+      ++batches;
+      received += tags.size();
+      return false;
+    });
+    EXPECT_EQ(1u, batches);
+    EXPECT_GT(600u, received);
+    repository.reset();
+    remove(tagsFile.c_str());
+    remove((tagsFile + ".idx").c_str());
+  }
+
+  TEST_F(Tags, IndexDoesNotDependOnThreadsCount)
+  {
+    for (auto const& tagsFile : {"classes_repos/tags.universal", "full_path_repos/tags.universal", "repeated_files_repos/tags.universal"})
+    {
+      auto const copiedTagsFile = std::string(tagsFile) + ".threads";
+      WriteFile(copiedTagsFile, ReadFile(tagsFile));
+      auto const singleThreaded = BuildIndex(copiedTagsFile, 1);
+      ASSERT_FALSE(singleThreaded.empty());
+      EXPECT_EQ(singleThreaded, BuildIndex(copiedTagsFile, 4)) << "Tags file: " << tagsFile;
+      EXPECT_EQ(singleThreaded, BuildIndex(copiedTagsFile, 0)) << "Tags file: " << tagsFile;
+      remove(copiedTagsFile.c_str());
+    }
+  }
+
+  TEST_F(Tags, IndexDoesNotDependOnMemoryLimit)
+  {
+    for (auto const& tagsFile : {"classes_repos/tags.universal", "full_path_repos/tags.universal", "repeated_files_repos/tags.universal", "full_path_single_file_repo/tags.universal"})
+    {
+      auto const copiedTagsFile = std::string(tagsFile) + ".external";
+      WriteFile(copiedTagsFile, ReadFile(tagsFile));
+      auto const inMemory = BuildIndex(copiedTagsFile, 0);
+      ASSERT_FALSE(inMemory.empty());
+      // Every line is spilled separately, so runs are merged in several passes
+      EXPECT_EQ(inMemory, BuildIndex(copiedTagsFile, 1, 1)) << "Tags file: " << tagsFile;
+      EXPECT_EQ(inMemory, BuildIndex(copiedTagsFile, 0, 1024 * 1024)) << "Tags file: " << tagsFile;
+      EXPECT_EQ(BuildIndex(copiedTagsFile, 0, 0, true), BuildIndex(copiedTagsFile, 1, 1024 * 1024, true)) << "Tags file: " << tagsFile;
+      EXPECT_EQ(BuildIndex(copiedTagsFile, 0, 0, false, true), BuildIndex(copiedTagsFile, 1, 1, false, true)) << "Tags file: " << tagsFile;
+      EXPECT_TRUE(ReadFile(GetTemporaryFile(copiedTagsFile + ".idx.run", 0)).empty());
+      remove(copiedTagsFile.c_str());
+    }
+  }
+
+  TEST_F(Tags, UpdatedFileTagsPatchIndex)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal.update";
+    std::string const fileTagsFile = tagsFile + ".file";
+    std::string const file = "classes_repos\\test_mixins.py";
+    WriteFile(tagsFile, ReadFile("classes_repos/tags.universal"));
+    std::string fileTags = "!_TAG_FILE_FORMAT\t2\t/extended format/\n";
+    std::istringstream tags(ReadFile(tagsFile));
+    size_t removed = 0;
+    for (std::string line; std::getline(tags, line);)
+    {
+      if (line.find("\ttest_mixins.py\t") != std::string::npos && removed++ >= 2)
+        fileTags += line + "\n";
+    }
+    // Short lines take place of removed ones, the long one is appended
+    fileTags += "AddedFunction\ttest_mixins.py\t/^def AddedFunction():$/;\"\tf\tline:1\n";
+    fileTags += "AddedMethod\ttest_mixins.py\t/^    def AddedMethod(self):$/;\"\tm\tline:2\tclass:AccessMixinTests\n";
+    fileTags += "AddedFunctionWithVeryLongName" + std::string(200, 'X') + "\ttest_mixins.py\t/^def AddedFunctionWithVeryLongName():$/;\"\tf\tline:3\n";
+    WriteFile(fileTagsFile, fileTags);
+    size_t symbolsLoaded = 0;
+    ASSERT_EQ(LoadSuccess, Storage->Load(tagsFile.c_str(), RepositoryType::Regular, symbolsLoaded));
+    auto commit = Storage->UpdateTagsByFile(tagsFile.c_str(), file.c_str(), fileTagsFile.c_str());
+    ASSERT_TRUE(!!commit);
+    commit();
+    auto const patched = ReadFile(tagsFile + ".idx");
+    ASSERT_EQ(LoadSuccess, Storage->Load(tagsFile.c_str(), RepositoryType::Regular, symbolsLoaded));
+    EXPECT_EQ(144, symbolsLoaded);
+    EXPECT_EQ(patched, ReadFile(tagsFile + ".idx"));
+    EXPECT_EQ(1, Find("AddedFunction", file.c_str()).size());
+    auto members = FindClassMembers(file.c_str(), "AccessMixinTests");
+    EXPECT_TRUE(std::find_if(members.begin(), members.end(), [](TagInfo const& tag) { return tag.name == "AddedMethod"; }) != members.end());
+    Storage->Remove(tagsFile.c_str());
+    EXPECT_EQ(BuildIndex(tagsFile, 1), patched);
+    remove(tagsFile.c_str());
+    remove(fileTagsFile.c_str());
+  }
+
+  TEST_F(Tags, StoredFieldsMakeSameTags)
+  {
+    IndexOptions storeFields;
+    storeFields.StoreFields = true;
+    for (auto const& tagsFile : {"classes_repos/tags.universal", "full_path_repos/tags.universal", "include_file_repos/tags.exuberant"})
+    {
+      auto const copiedTagsFile = std::string(tagsFile) + ".fields";
+      auto const fieldsFile = copiedTagsFile + ".fields";
+      WriteFile(copiedTagsFile, ReadFile(tagsFile));
+      auto const parsed = FindAllTags(copiedTagsFile, IndexOptions());
+      ASSERT_FALSE(parsed.empty());
+      EXPECT_TRUE(ReadFile(fieldsFile).empty());
+      EXPECT_EQ(parsed, FindAllTags(copiedTagsFile, storeFields)) << "Tags file: " << tagsFile;
+      EXPECT_FALSE(ReadFile(fieldsFile).empty());
+      remove(copiedTagsFile.c_str());
+      remove((copiedTagsFile + ".idx").c_str());
+      remove(fieldsFile.c_str());
+    }
+  }
+
+  TEST_F(Tags, UpdatedFileTagsPatchStoredFields)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal.fields";
+    std::string const fileTagsFile = tagsFile + ".file";
+    std::string const fieldsFile = tagsFile + ".fields";
+    WriteFile(tagsFile, ReadFile("classes_repos/tags.universal"));
+    WriteFile(fileTagsFile, "!_TAG_FILE_FORMAT\t2\t/extended format/\n"
+                            "AddedFunction\ttest_mixins.py\t/^def AddedFunction():$/;\"\tf\tline:1\n");
+    IndexOptions storeFields;
+    storeFields.StoreFields = true;
+    auto repository = Internal::Repository::Create(tagsFile.c_str(), false, storeFields);
+    size_t symbolsLoaded = 0;
+    ASSERT_EQ(LoadSuccess, repository->Load(symbolsLoaded));
+    auto commit = repository->UpdateTagsByFile("classes_repos\\test_mixins.py", fileTagsFile.c_str());
+    ASSERT_TRUE(!!commit);
+    commit();
+    auto const patched = ReadFile(fieldsFile);
+    auto const stored = FindAllTags(tagsFile, storeFields);
+    EXPECT_EQ(patched, ReadFile(fieldsFile));
+    EXPECT_EQ(1, repository->FindByName("AddedFunction").size());
+    remove(fieldsFile.c_str());
+    EXPECT_EQ(FindAllTags(tagsFile, IndexOptions()), stored);
+    repository.reset();
+    remove(tagsFile.c_str());
+    remove((tagsFile + ".idx").c_str());
+    remove(fileTagsFile.c_str());
+  }
+
+  TEST_F(Tags, StoredFieldsPoolIsCompacted)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal.compacted";
+    std::string const fileTagsFile = tagsFile + ".file";
+    std::string const fieldsFile = tagsFile + ".fields";
+    auto const tags = ReadFile("classes_repos/tags.universal");
+    WriteFile(tagsFile, tags);
+    std::vector<std::string> fileLines;
+    std::istringstream lines(tags);
+    for (std::string line; std::getline(lines, line);)
+      if (line.find("\ttest_mixins.py\t") != std::string::npos)
+        fileLines.push_back(line);
+
+    IndexOptions storeFields;
+    storeFields.StoreFields = true;
+    auto repository = Internal::Repository::Create(tagsFile.c_str(), false, storeFields);
+    size_t symbolsLoaded = 0;
+    ASSERT_EQ(LoadSuccess, repository->Load(symbolsLoaded));
+    auto const written = ReadFile(fieldsFile).size();
+    ASSERT_NE(0, written);
+    for (int i = 0; i < 10; ++i)
+    {
+      // Shifted line numbers make all tags of file replaced
+      std::string fileTags = "!_TAG_FILE_FORMAT\t2\t/extended format/\n";
+      for (auto line : fileLines)
+        fileTags += line.replace(line.find("\tline:"), 6, "\tline:" + std::to_string(i + 1)) + "\n";
+
+      WriteFile(fileTagsFile, fileTags);
+      auto commit = repository->UpdateTagsByFile("classes_repos\\test_mixins.py", fileTagsFile.c_str());
+      ASSERT_TRUE(!!commit);
+      commit();
+    }
+
+    EXPECT_LE(ReadFile(fieldsFile).size(), 2 * written);
+    EXPECT_EQ(FindAllTags(tagsFile, IndexOptions()), FindAllTags(tagsFile, storeFields));
+    repository.reset();
+    remove(tagsFile.c_str());
+    remove((tagsFile + ".idx").c_str());
+    remove(fieldsFile.c_str());
+    remove(fileTagsFile.c_str());
+  }
+
+  TEST_F(Tags, FailedIndexPatchIsReported)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal.unpatched";
+    std::string const indexFile = tagsFile + ".idx";
+    std::string const fileTagsFile = tagsFile + ".file";
+    WriteFile(tagsFile, ReadFile("classes_repos/tags.universal"));
+    WriteFile(fileTagsFile, "!_TAG_FILE_FORMAT\t2\t/extended format/\n"
+                            "AddedFunction\ttest_mixins.py\t/^def AddedFunction():$/;\"\tf\tline:1\n");
+    auto repository = Internal::Repository::Create(tagsFile.c_str(), false);
+    size_t symbolsLoaded = 0;
+    ASSERT_EQ(LoadSuccess, repository->Load(symbolsLoaded));
+    auto commit = repository->UpdateTagsByFile("classes_repos\\test_mixins.py", fileTagsFile.c_str());
+    ASSERT_TRUE(!!commit);
+    remove(indexFile.c_str());
+    EXPECT_THROW(commit(), std::runtime_error);
+    ASSERT_EQ(LoadSuccess, repository->Load(symbolsLoaded));
+    EXPECT_EQ(1, repository->FindByName("AddedFunction").size());
+    repository.reset();
+    remove(tagsFile.c_str());
+    remove(indexFile.c_str());
+    remove(fileTagsFile.c_str());
+  }
+
+  TEST_F(Tags, FuzzyMatchedNamesFound)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal";
+    auto repository = Internal::Repository::Create(tagsFile.c_str(), false);
+    size_t symbolsLoaded = 0;
+    ASSERT_EQ(LoadSuccess, repository->Load(symbolsLoaded));
+    auto isSubsequence = [](std::string const& pattern, std::string const& name)
+    {
+      size_t matched = 0;
+      for (auto c : name)
+        matched += matched < pattern.length() && tolower(static_cast<unsigned char>(c)) == tolower(static_cast<unsigned char>(pattern[matched])) ? 1 : 0;
+
+      return matched == pattern.length();
+    };
+    for (std::string const pattern : {"ansc", "AFV", "mixin", "zzz"})
+    {
+      size_t expected = 0;
+      std::istringstream tags(ReadFile(tagsFile));
+      for (std::string line; std::getline(tags, line);)
+        expected += line[0] != '!' && isSubsequence(pattern, line.substr(0, line.find('\t'))) ? 1 : 0;
+
+      auto found = repository->FindByNameFuzzy(pattern.c_str(), UnlimitedMaxCount);
+      EXPECT_EQ(expected, found.size()) << "Pattern: " << pattern;
+      for (auto const& tag : found)
+        EXPECT_TRUE(isSubsequence(pattern, tag.name)) << "Pattern: " << pattern << ", name: " << tag.name;
+
+      auto best = repository->FindByNameFuzzy(pattern.c_str(), 2);
+      EXPECT_EQ(std::vector<TagInfo>(found.begin(), found.begin() + std::min<size_t>(2, found.size())), best) << "Pattern: " << pattern;
+    }
+
+    EXPECT_EQ("AnonimousNamespaceClass", repository->FindByNameFuzzy("ansc", 1).at(0).name);
+    EXPECT_EQ("AlwaysFalseView", repository->FindByNameFuzzy("AFV", 1).at(0).name);
+  }
+
+  TEST_F(Tags, PartiallyMatchedViewerFindsFuzzyMatchedNames)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal";
+    size_t symbolsLoaded = 0;
+    ASSERT_EQ(LoadSuccess, Storage->Load(tagsFile.c_str(), RepositoryType::Regular, symbolsLoaded));
+    auto viewer = GetPartiallyMatchedViewer(GetSelector(tagsFile.c_str(), true), GetNames);
+    bool thresholdReached = false;
+    auto view = viewer->GetView("ansc", FormatTagFlag::Default, 0, thresholdReached);
+    ASSERT_NE(0, view.Size());
+    EXPECT_EQ("AnonimousNamespaceClass", view[0].GetTag()->name);
+    view = viewer->GetView("AnonimousNamespace", FormatTagFlag::Default, 0, thresholdReached);
+    ASSERT_NE(0, view.Size());
+    EXPECT_EQ("AnonimousNamespaceClass", view[0].GetTag()->name);
+    EXPECT_EQ(0, GetPartiallyMatchedViewer(GetSelector(tagsFile.c_str(), true), true)->GetView("ansc", FormatTagFlag::Default, 0, thresholdReached).Size());
+    Storage->Remove(tagsFile.c_str());
+  }
+
+  TEST_F(Tags, InfixMatchedNamesFound)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal.infix";
+    std::string const fileTagsFile = tagsFile + ".file";
+    WriteFile(tagsFile, ReadFile("classes_repos/tags.universal"));
+    auto const patterns = {"view", "NAMESPACE", "mixin", "a", "zzz"};
+    size_t symbolsLoaded = 0;
+    auto scanned = Internal::Repository::Create(tagsFile.c_str(), false);
+    ASSERT_EQ(LoadSuccess, scanned->Load(symbolsLoaded));
+    std::vector<std::vector<TagInfo>> expected;
+    for (auto pattern : patterns)
+      expected.push_back(scanned->FindByNameInfix(pattern, UnlimitedMaxCount));
+
+    scanned.reset();
+    IndexOptions infixSearch;
+    infixSearch.InfixSearch = true;
+    auto repository = Internal::Repository::Create(tagsFile.c_str(), false, infixSearch);
+    ASSERT_EQ(LoadSuccess, repository->Load(symbolsLoaded));
+    auto expectedTags = expected.begin();
+    for (std::string const pattern : patterns)
+    {
+      auto lowerPattern = ToLower(pattern);
+      size_t count = 0;
+      std::istringstream tags(ReadFile(tagsFile));
+      for (std::string line; std::getline(tags, line);)
+        count += line[0] != '!' && ToLower(line.substr(0, line.find('\t'))).find(lowerPattern) != std::string::npos ? 1 : 0;
+
+      auto found = repository->FindByNameInfix(pattern.c_str(), UnlimitedMaxCount);
+      auto sorted = found;
+      std::sort(sorted.begin(), sorted.end());
+      std::sort(expectedTags->begin(), expectedTags->end());
+      EXPECT_EQ(*expectedTags++, sorted) << "Pattern: " << pattern;
+      EXPECT_EQ(count, found.size()) << "Pattern: " << pattern;
+      auto prefixesEnd = std::partition_point(found.begin(), found.end(), [&lowerPattern](TagInfo const& tag) { return !ToLower(tag.name).find(lowerPattern); });
+      EXPECT_TRUE(std::none_of(prefixesEnd, found.end(), [&lowerPattern](TagInfo const& tag) { return !ToLower(tag.name).find(lowerPattern); })) << "Pattern: " << pattern;
+      EXPECT_EQ(std::min<size_t>(3, found.size()), repository->FindByNameInfix(pattern.c_str(), 3).size()) << "Pattern: " << pattern;
+    }
+
+    WriteFile(fileTagsFile, "!_TAG_FILE_FORMAT\t2\t/extended format/\n"
+                            "AddedFunction\ttest_mixins.py\t/^def AddedFunction():$/;\"\tf\tline:1\n");
+    auto commit = repository->UpdateTagsByFile("classes_repos\\test_mixins.py", fileTagsFile.c_str());
+    ASSERT_TRUE(!!commit);
+    commit();
+    ASSERT_EQ(LoadSuccess, repository->Load(symbolsLoaded));
+    auto added = repository->FindByNameInfix("dedfunc", UnlimitedMaxCount);
+    ASSERT_EQ(1, added.size());
+    EXPECT_EQ("AddedFunction", added.front().name);
+    EXPECT_TRUE(repository->FindByNameInfix("AccessMixinTests", UnlimitedMaxCount).empty());
+    repository.reset();
+    remove(tagsFile.c_str());
+    remove((tagsFile + ".idx").c_str());
+    remove(fileTagsFile.c_str());
+  }
+
+  TEST_F(Tags, InfixSearchOverMemoryLimitScansNames)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal.scanned";
+    std::string const fileTagsFile = tagsFile + ".file";
+    WriteFile(tagsFile, ReadFile("classes_repos/tags.universal"));
+    auto const patterns = {"view", "NAMESPACE", "a"};
+    size_t symbolsLoaded = 0;
+    auto scanned = Internal::Repository::Create(tagsFile.c_str(), false);
+    ASSERT_EQ(LoadSuccess, scanned->Load(symbolsLoaded));
+    std::vector<std::vector<TagInfo>> expected;
+    for (auto pattern : patterns)
+      expected.push_back(scanned->FindByNameInfix(pattern, UnlimitedMaxCount));
+
+    scanned.reset();
+    auto const withSuffixes = BuildIndex(tagsFile, 0, 0, true);
+    IndexOptions limited;
+    limited.InfixSearch = true;
+    limited.MemoryLimit = 1;
+    auto repository = Internal::Repository::Create(tagsFile.c_str(), false, limited);
+    ASSERT_EQ(LoadSuccess, repository->Load(symbolsLoaded));
+    auto const index = ReadFile(tagsFile + ".idx");
+    EXPECT_LT(index.size(), withSuffixes.size());
+    auto expectedTags = expected.begin();
+    for (auto pattern : patterns)
+    {
+      EXPECT_EQ(*expectedTags++, repository->FindByNameInfix(pattern, UnlimitedMaxCount)) << "Pattern: " << pattern;
+      EXPECT_EQ(std::min<size_t>(3, expectedTags[-1].size()), repository->FindByNameInfix(pattern, 3).size()) << "Pattern: " << pattern;
+    }
+
+    WriteFile(fileTagsFile, "!_TAG_FILE_FORMAT\t2\t/extended format/\n"
+                            "AddedFunction\ttest_mixins.py\t/^def AddedFunction():$/;\"\tf\tline:1\n");
+    auto commit = repository->UpdateTagsByFile("classes_repos\\test_mixins.py", fileTagsFile.c_str());
+    ASSERT_TRUE(!!commit);
+    commit();
+    ASSERT_EQ(LoadSuccess, repository->Load(symbolsLoaded));
+    auto added = repository->FindByNameInfix("dedfunc", UnlimitedMaxCount);
+    ASSERT_EQ(1, added.size());
+    EXPECT_EQ("AddedFunction", added.front().name);
+    EXPECT_TRUE(repository->FindByNameInfix("AccessMixinTests", UnlimitedMaxCount).empty());
+    repository.reset();
+    remove(tagsFile.c_str());
+    remove((tagsFile + ".idx").c_str());
+    remove(fileTagsFile.c_str());
+  }
+
+  TEST_F(Tags, NameFilterKeepsFoundNames)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal.filter";
+    std::string const fileTagsFile = tagsFile + ".file";
+    WriteFile(tagsFile, ReadFile("classes_repos/tags.universal"));
+    IndexOptions nameFilter;
+    nameFilter.NameFilter = true;
+    auto const expected = FindAllTags(tagsFile, IndexOptions());
+    ASSERT_FALSE(expected.empty());
+    // Index built without filter is rebuilt
+    EXPECT_EQ(expected, FindAllTags(tagsFile, nameFilter));
+    // Letters of names are shifted keeping order of lines, so index stays valid while filter has none of the new names
+    auto const tags = ReadFile(tagsFile);
+    std::string shiftedTags;
+    std::set<std::string> names;
+    std::set<std::string> shiftedNames;
+    std::istringstream lines(tags);
+    for (std::string line; std::getline(lines, line); shiftedTags += line + "\n")
+    {
+      auto nameEnd = line.find('\t');
+      if (line.empty() || line[0] == '!' || nameEnd == std::string::npos)
+        continue;
+
+      names.insert(line.substr(0, nameEnd));
+      std::transform(line.begin(), line.begin() + nameEnd, line.begin(), [](char c) { return (c >= 'a' && c < 'z') || (c >= 'A' && c < 'Z') ? static_cast<char>(c + 1) : c; });
+      shiftedNames.insert(line.substr(0, nameEnd));
+    }
+
+    for (auto const& name : names)
+      shiftedNames.erase(name);
+
+    ASSERT_EQ(tags.size(), shiftedTags.size());
+    ASSERT_LT(50u, shiftedNames.size());
+    auto countShiftedNames = [&](IndexOptions const& options)
+    {
+      remove((tagsFile + ".idx").c_str());
+      WriteFile(tagsFile, tags);
+      auto repository = Internal::Repository::Create(tagsFile.c_str(), false, options);
+      size_t symbolsLoaded = 0;
+      EXPECT_EQ(LoadSuccess, repository->Load(symbolsLoaded));
+      struct stat st;
+      EXPECT_EQ(0, stat(tagsFile.c_str(), &st));
+      WriteFile(tagsFile, shiftedTags);
+      EXPECT_TRUE(SetModificationTime(tagsFile, st.st_mtime));
+      size_t found = 0;
+      for (auto const& name : shiftedNames)
+        found += repository->FindByName(name.c_str()).empty() ? 0 : 1;
+
+      repository.reset();
+      WriteFile(tagsFile, tags);
+      remove((tagsFile + ".idx").c_str());
+      return found;
+    };
+    EXPECT_EQ(shiftedNames.size(), countShiftedNames(IndexOptions()));
+    // Few false positives of filter are allowed
+    EXPECT_GT(shiftedNames.size() / 10, countShiftedNames(nameFilter));
+
+    auto repository = Internal::Repository::Create(tagsFile.c_str(), false, nameFilter);
+    size_t symbolsLoaded = 0;
+    ASSERT_EQ(LoadSuccess, repository->Load(symbolsLoaded));
+    for (auto name : {"", "AccessMixinTests_", "accessmixintests", "AddedFunction", "zzz"})
+      EXPECT_TRUE(repository->FindByName(name).empty()) << "Name: " << name;
+
+    WriteFile(fileTagsFile, "!_TAG_FILE_FORMAT\t2\t/extended format/\n"
+                            "AddedFunction\ttest_mixins.py\t/^def AddedFunction():$/;\"\tf\tline:1\n");
+    auto commit = repository->UpdateTagsByFile("classes_repos\\test_mixins.py", fileTagsFile.c_str());
+    ASSERT_TRUE(!!commit);
+    commit();
+    ASSERT_EQ(LoadSuccess, repository->Load(symbolsLoaded));
+    EXPECT_EQ(1, repository->FindByName("AddedFunction").size());
+    EXPECT_TRUE(repository->FindByName("AccessMixinTests").empty());
+    repository.reset();
+    remove(tagsFile.c_str());
+    remove((tagsFile + ".idx").c_str());
+    remove(fileTagsFile.c_str());
+  }
+
+  TEST_F(Tags, ResidentRepositoryFindsSameTags)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal.resident";
+    std::string const fieldsFile = tagsFile + ".fields";
+    WriteFile(tagsFile, ReadFile("classes_repos/tags.universal"));
+    IndexOptions resident;
+    resident.ResidentMemoryLimit = 256 * 1024 * 1024;
+    auto const expected = FindAllTags(tagsFile, IndexOptions());
+    ASSERT_FALSE(expected.empty());
+    EXPECT_EQ(expected, FindAllTags(tagsFile, resident));
+
+    // Storage keeps only permanent repositories resident
+    size_t symbolsLoaded = 0;
+    auto storage = RepositoryStorage::Create(resident);
+    ASSERT_EQ(LoadSuccess, storage->Load(tagsFile.c_str(), RepositoryType::Permanent, symbolsLoaded));
+    EXPECT_LT(ReadFile(tagsFile).size(), storage->GetInfo(tagsFile.c_str()).ResidentSize);
+    storage = RepositoryStorage::Create(resident);
+    ASSERT_EQ(LoadSuccess, storage->Load(tagsFile.c_str(), RepositoryType::Regular, symbolsLoaded));
+    EXPECT_EQ(0, storage->GetInfo(tagsFile.c_str()).ResidentSize);
+    storage.reset();
+
+    // Changes of files are not seen until repository is loaded again
+    auto repository = Internal::Repository::Create(tagsFile.c_str(), false, resident);
+    ASSERT_EQ(LoadSuccess, repository->Load(symbolsLoaded));
+    WriteFile(tagsFile, "!_TAG_FILE_FORMAT\t2\t/extended format/\n"
+                        "AddedFunction\ttest_mixins.py\t/^def AddedFunction():$/;\"\tf\tline:1\n");
+    EXPECT_FALSE(repository->FindByName(expected.front().name.c_str()).empty());
+    EXPECT_TRUE(repository->FindByName("AddedFunction").empty());
+    // Tags file may be written within the same second as index, so index is built anew
+    remove((tagsFile + ".idx").c_str());
+    ASSERT_EQ(LoadSuccess, repository->Load(symbolsLoaded));
+    EXPECT_TRUE(repository->FindByName(expected.front().name.c_str()).empty());
+    EXPECT_EQ(1, repository->FindByName("AddedFunction").size());
+    repository.reset();
+    remove(tagsFile.c_str());
+    remove((tagsFile + ".idx").c_str());
+    remove(fieldsFile.c_str());
+  }
+
+  TEST_F(Tags, ResidentMemoryLimitIsSharedByStorageRepositories)
+  {
+    std::string const firstTagsFile = "classes_repos/tags.universal.shared1";
+    std::string const secondTagsFile = "classes_repos/tags.universal.shared2";
+    WriteFile(firstTagsFile, ReadFile("classes_repos/tags.universal"));
+    WriteFile(secondTagsFile, ReadFile("classes_repos/tags.universal"));
+    IndexOptions resident;
+    resident.ResidentMemoryLimit = 256 * 1024 * 1024;
+    size_t symbolsLoaded = 0;
+    auto storage = RepositoryStorage::Create(resident);
+    ASSERT_EQ(LoadSuccess, storage->Load(firstTagsFile.c_str(), RepositoryType::Permanent, symbolsLoaded));
+    auto const residentSize = storage->GetInfo(firstTagsFile.c_str()).ResidentSize;
+    ASSERT_LT(0, residentSize);
+
+    // Files of each repository fit into limit, but files of both do not
+    resident.ResidentMemoryLimit = residentSize * 3 / 2;
+    storage = RepositoryStorage::Create(resident);
+    ASSERT_EQ(LoadSuccess, storage->Load(firstTagsFile.c_str(), RepositoryType::Permanent, symbolsLoaded));
+    ASSERT_EQ(LoadSuccess, storage->Load(secondTagsFile.c_str(), RepositoryType::Permanent, symbolsLoaded));
+    EXPECT_EQ(residentSize, storage->GetInfo(firstTagsFile.c_str()).ResidentSize);
+    EXPECT_EQ(0, storage->GetInfo(secondTagsFile.c_str()).ResidentSize);
+    EXPECT_EQ(storage->GetSelector(firstTagsFile.c_str(), false, SortingOptions::Default, UnlimitedMaxCount)->GetByName("AView").size(),
+              storage->GetSelector(secondTagsFile.c_str(), false, SortingOptions::Default, UnlimitedMaxCount)->GetByName("AView").size());
+
+    // Budget of removed repository is given to the next one loaded
+    storage->Remove(firstTagsFile.c_str());
+    ASSERT_EQ(LoadSuccess, storage->Load(secondTagsFile.c_str(), RepositoryType::Permanent, symbolsLoaded));
+    EXPECT_EQ(residentSize, storage->GetInfo(secondTagsFile.c_str()).ResidentSize);
+    storage.reset();
+    for (auto const& tagsFile : {firstTagsFile, secondTagsFile})
+    {
+      remove(tagsFile.c_str());
+      remove((tagsFile + ".idx").c_str());
+      remove((tagsFile + ".fields").c_str());
+    }
+  }
+
+  TEST_F(Tags, ReleasedRepositoryMapsFilesAgain)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal.released";
+    std::string const indexFile = tagsFile + ".idx";
+    WriteFile(tagsFile, MakeNumberedTags(3));
+    auto storage = RepositoryStorage::Create();
+    size_t symbolsLoaded = 0;
+    ASSERT_EQ(LoadSuccess, storage->Load(tagsFile.c_str(), RepositoryType::Regular, symbolsLoaded));
+    EXPECT_EQ(1, storage->GetSelector(tagsFile.c_str(), false, SortingOptions::Default, UnlimitedMaxCount)->GetByName("Name1").size());
+    // Released tags file is moved aside and removed like by reindex of repository
+    storage->ReleaseFiles(tagsFile.c_str());
+    ASSERT_EQ(0, rename(tagsFile.c_str(), (tagsFile + ".old").c_str()));
+    WriteFile(tagsFile, MakeNumberedTags(4));
+    EXPECT_EQ(0, remove((tagsFile + ".old").c_str()));
+    remove(indexFile.c_str());
+    ASSERT_EQ(LoadSuccess, storage->Load(tagsFile.c_str(), RepositoryType::Regular, symbolsLoaded));
+    EXPECT_EQ(4, symbolsLoaded);
+    EXPECT_EQ(1, storage->GetSelector(tagsFile.c_str(), false, SortingOptions::Default, UnlimitedMaxCount)->GetByName("Name3").size());
+    storage.reset();
+    remove(tagsFile.c_str());
+    remove(indexFile.c_str());
+  }
+
+  TEST_F(Tags, IndexIsPublishedOverIndexOfOpenRepository)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal.republished";
+    std::string const indexFile = tagsFile + ".idx";
+    WriteFile(tagsFile, MakeNumberedTags(3));
+    size_t symbolsLoaded = 0;
+    auto open = Internal::Repository::Create(tagsFile.c_str(), false);
+    ASSERT_EQ(LoadSuccess, open->Load(symbolsLoaded));
+    ASSERT_EQ(1, open->FindByName("Name1").size());
+    // Repository of changed tags file, like the one reloaded by storage, publishes index while the open one keeps its index mapped
+    WriteFile(tagsFile, MakeNumberedTags(4));
+    ASSERT_TRUE(SetModificationTime(tagsFile, GetModificationTime(tagsFile) + 10));
+    auto reloaded = Internal::Repository::Create(tagsFile.c_str(), false);
+    ASSERT_EQ(LoadSuccess, reloaded->Load(symbolsLoaded));
+    EXPECT_EQ(4, symbolsLoaded);
+    EXPECT_EQ(1, reloaded->FindByName("Name3").size());
+    ASSERT_EQ(LoadSuccess, open->Load(symbolsLoaded));
+    EXPECT_EQ(1, open->FindByName("Name3").size());
+    open.reset();
+    reloaded.reset();
+    remove(tagsFile.c_str());
+    remove(indexFile.c_str());
+  }
+
+  TEST_F(Tags, FlushedCacheDoesNotChangeMappedIndex)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal.flushed";
+    std::string const indexFile = tagsFile + ".idx";
+    WriteFile(tagsFile, MakeNumberedTags(3));
+    size_t symbolsLoaded = 0;
+    auto repository = Internal::Repository::Create(tagsFile.c_str(), false);
+    ASSERT_EQ(LoadSuccess, repository->Load(symbolsLoaded));
+    auto const tags = repository->FindByName("Name1");
+    ASSERT_EQ(1, tags.size());
+    auto const previous = ReadFile(indexFile);
+    auto mapped = Internal::MapFile(indexFile.c_str());
+    ASSERT_TRUE(!!mapped);
+    repository->CacheTag(tags.front(), 10, true);
+    EXPECT_EQ(previous, std::string(mapped->Data(), mapped->Size()));
+    EXPECT_NE(previous, ReadFile(indexFile));
+    auto loaded = Internal::Repository::Create(tagsFile.c_str(), false);
+    ASSERT_EQ(LoadSuccess, loaded->Load(symbolsLoaded));
+    EXPECT_EQ(1, loaded->GetCachedTags(false, 10).size());
+    mapped.reset();
+    repository.reset();
+    loaded.reset();
+    remove(tagsFile.c_str());
+    remove(indexFile.c_str());
+  }
+
+  TEST_F(Tags, RepositoryOfUnchangedTagsIsLoadedAgain)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal.unchanged";
+    std::string const indexFile = tagsFile + ".idx";
+    WriteFile(tagsFile, MakeNumberedTags(3));
+    auto storage = RepositoryStorage::Create();
+    size_t symbolsLoaded = 0;
+    ASSERT_EQ(LoadSuccess, storage->Load(tagsFile.c_str(), RepositoryType::Regular, symbolsLoaded));
+    auto const tags = storage->GetSelector(tagsFile.c_str(), false, SortingOptions::Default, UnlimitedMaxCount)->GetByName("Name1");
+    ASSERT_EQ(1, tags.size());
+    // Tag cached without flush is kept only by the loaded repository
+    storage->CacheTag(tags.front(), 10, false);
+    ASSERT_EQ(LoadSuccess, storage->Load(tagsFile.c_str(), RepositoryType::Regular, symbolsLoaded));
+    EXPECT_EQ(1, storage->GetSelector(tagsFile.c_str(), false, SortingOptions::Default, UnlimitedMaxCount)->GetCachedTags(false).size());
+    // Repository of changed tags file is loaded anew
+    WriteFile(tagsFile, MakeNumberedTags(4));
+    ASSERT_TRUE(SetModificationTime(tagsFile, GetModificationTime(tagsFile) + 10));
+    ASSERT_EQ(LoadSuccess, storage->Load(tagsFile.c_str(), RepositoryType::Regular, symbolsLoaded));
+    EXPECT_EQ(4, symbolsLoaded);
+    EXPECT_EQ(1, storage->GetSelector(tagsFile.c_str(), false, SortingOptions::Default, UnlimitedMaxCount)->GetByName("Name3").size());
+    storage.reset();
+    remove(tagsFile.c_str());
+    remove(indexFile.c_str());
+  }
+
+  TEST_F(Tags, ChangesAreCheckedOncePerInterval)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal.interval";
+    std::string const indexFile = tagsFile + ".idx";
+    WriteFile(tagsFile, ReadFile("classes_repos/tags.universal"));
+    IndexOptions throttled;
+    throttled.ChangesCheckInterval = 60 * 60 * 1000;
+    auto checked = Internal::Repository::Create(tagsFile.c_str(), false, IndexOptions());
+    auto unchecked = Internal::Repository::Create(tagsFile.c_str(), false, throttled);
+    size_t symbolsLoaded = 0;
+    ASSERT_EQ(LoadSuccess, checked->Load(symbolsLoaded));
+    ASSERT_EQ(LoadSuccess, unchecked->Load(symbolsLoaded));
+    auto const expected = checked->FindByName("AccessMixinTests");
+    ASSERT_FALSE(expected.empty());
+    EXPECT_EQ(expected, unchecked->FindByName("AccessMixinTests"));
+
+    // Index looks modified by other process
+    ASSERT_TRUE(SetModificationTime(indexFile, GetModificationTime(indexFile) - 10));
+    EXPECT_THROW(checked->FindByName("AccessMixinTests"), std::logic_error);
+    EXPECT_EQ(expected, unchecked->FindByName("AccessMixinTests"));
+    ASSERT_EQ(LoadSuccess, unchecked->Load(symbolsLoaded));
+    EXPECT_EQ(expected, unchecked->FindByName("AccessMixinTests"));
+
+    // Own patch of index is seen at once, though index is written later than it was loaded
+    std::string const fileTagsFile = tagsFile + ".file";
+    WriteFile(fileTagsFile, "!_TAG_FILE_FORMAT\t2\t/extended format/\n"
+                            "AddedFunction\ttest_mixins.py\t/^def AddedFunction():$/;\"\tf\tline:1\n");
+    ASSERT_TRUE(SetModificationTime(indexFile, GetModificationTime(indexFile) - 10));
+    ASSERT_EQ(LoadSuccess, unchecked->Load(symbolsLoaded));
+    auto commit = unchecked->UpdateTagsByFile("classes_repos\\test_mixins.py", fileTagsFile.c_str());
+    ASSERT_TRUE(!!commit);
+    commit();
+    EXPECT_EQ(1, unchecked->FindByName("AddedFunction").size());
+    checked.reset();
+    unchecked.reset();
+    remove(tagsFile.c_str());
+    remove(indexFile.c_str());
+    remove(fileTagsFile.c_str());
+  }
+
+  TEST_F(Tags, WatchedRepositoryIsLoadedAnew)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal.watched";
+    WriteFile(tagsFile, MakeNumberedTags(3));
+    IndexOptions watched;
+    watched.WatchInterval = 10;
+    auto storage = RepositoryStorage::Create(watched);
+    size_t symbolsLoaded = 0;
+    ASSERT_EQ(LoadSuccess, storage->Load(tagsFile.c_str(), RepositoryType::Regular, symbolsLoaded));
+    ASSERT_EQ(1, storage->GetSelector(tagsFile.c_str(), false, SortingOptions::Default, UnlimitedMaxCount)->GetByName("Name2").size());
+
+    // Tags file is changed by other process, old repository answers lookups until it is replaced
+    WriteFile(tagsFile, MakeNumberedTags(5));
+    ASSERT_TRUE(SetModificationTime(tagsFile, GetModificationTime(tagsFile) - 10));
+    bool reloaded = false;
+    for (int i = 0; i < 1000 && !reloaded; ++i)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      auto selector = storage->GetSelector(tagsFile.c_str(), false, SortingOptions::Default, UnlimitedMaxCount);
+      ASSERT_EQ(1, selector->GetByName("Name2").size());
+      reloaded = selector->GetByName("Name4").size() == 1;
+    }
+
+    EXPECT_TRUE(reloaded);
+    EXPECT_EQ(RepositoryType::Regular, storage->GetInfo(tagsFile.c_str()).Type);
+    storage.reset();
+    remove(tagsFile.c_str());
+    remove((tagsFile + ".idx").c_str());
+  }
+
+  TEST_F(Tags, RepositoryAnswersLookupsWhileLoadIsPending)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal.pending";
+    std::string const indexFile = tagsFile + ".idx";
+    WriteFile(tagsFile, MakeNumberedTags(3));
+    auto storage = RepositoryStorage::Create();
+    size_t symbolsLoaded = 0;
+    ASSERT_EQ(LoadSuccess, storage->Load(tagsFile.c_str(), RepositoryType::Permanent, symbolsLoaded));
+    auto old = storage->GetSelector(tagsFile.c_str(), false, SortingOptions::Default, UnlimitedMaxCount);
+    ASSERT_EQ(1, old->GetByName("Name2").size());
+
+    // Tags file is rewritten by ctags and loaded anew, index is built while the old repository serves lookups
+    WriteFile(tagsFile, MakeNumberedTags(5));
+    ASSERT_TRUE(SetModificationTime(tagsFile, GetModificationTime(tagsFile) - 10));
+    std::promise<void> started;
+    std::promise<void> resumed;
+    auto resume = resumed.get_future().share();
+    std::promise<int> loaded;
+    bool first = true;
+    storage->LoadAsync(tagsFile.c_str(), RepositoryType::Regular,
+                       [&started, resume, &first](size_t, size_t) { if (first) { first = false; started.set_value(); resume.wait(); } },
+                       [&loaded](int err, size_t) { loaded.set_value(err); });
+    ASSERT_EQ(std::future_status::ready, started.get_future().wait_for(std::chrono::seconds(10)));
+    std::vector<TagInfo> found;
+    EXPECT_NO_THROW(found = storage->GetSelector(tagsFile.c_str(), false, SortingOptions::Default, UnlimitedMaxCount)->GetByName("Name2"));
+    EXPECT_EQ(1, found.size());
+    EXPECT_NO_THROW(found = storage->GetSelector(tagsFile.c_str(), false, SortingOptions::Default, UnlimitedMaxCount)->GetByPart("Name", false, true));
+    EXPECT_EQ(3, found.size());
+    resumed.set_value();
+    auto result = loaded.get_future();
+    ASSERT_EQ(std::future_status::ready, result.wait_for(std::chrono::seconds(10)));
+    EXPECT_EQ(LoadSuccess, result.get());
+
+    // Index of the old repository is replaced, lookups in progress keep using it
+    EXPECT_NO_THROW(found = old->GetByName("Name2"));
+    EXPECT_EQ(1, found.size());
+    EXPECT_EQ(1, storage->GetSelector(tagsFile.c_str(), false, SortingOptions::Default, UnlimitedMaxCount)->GetByName("Name4").size());
+    EXPECT_EQ(RepositoryType::Permanent, storage->GetInfo(tagsFile.c_str()).Type);
+    old.reset();
+    storage.reset();
+    remove(tagsFile.c_str());
+    remove(indexFile.c_str());
+  }
+
+  TEST_F(Tags, RepositoryIsLoadedInBackground)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal.background";
+    std::string const indexFile = tagsFile + ".idx";
+    WriteFile(tagsFile, MakeNumberedTags(5));
+    auto storage = RepositoryStorage::Create();
+    std::vector<std::pair<size_t, size_t>> stages;
+    std::promise<std::pair<int, size_t>> loaded;
+    storage->LoadAsync(tagsFile.c_str(), RepositoryType::Regular,
+                       [&stages](size_t done, size_t total) { stages.emplace_back(done, total); },
+                       [&loaded](int err, size_t symbolsLoaded) { loaded.set_value(std::make_pair(err, symbolsLoaded)); });
+    auto result = loaded.get_future();
+    ASSERT_EQ(std::future_status::ready, result.wait_for(std::chrono::seconds(10)));
+    EXPECT_EQ(std::make_pair(LoadSuccess, size_t(5)), result.get());
+    EXPECT_EQ((std::vector<std::pair<size_t, size_t>>{{1, 4}, {2, 4}, {3, 4}, {4, 4}}), stages);
+    EXPECT_EQ(1, storage->GetSelector(tagsFile.c_str(), false, SortingOptions::Default, UnlimitedMaxCount)->GetByName("Name4").size());
+    // Index is built in temporary file renamed to index file
+    EXPECT_NE(0, GetModificationTime(indexFile));
+    EXPECT_EQ(0, GetModificationTime(GetTemporaryFile(indexFile + ".tmp", 0)));
+    storage.reset();
+    remove(tagsFile.c_str());
+    remove(indexFile.c_str());
+  }
+
+  // Run with -fsanitize=thread to check for data races, see TAGS_SANITIZE_THREAD
+  TEST_F(Tags, StorageIsUsedConcurrently)
+  {
+    std::string const tagsFile = "classes_repos/tags.universal.concurrent";
+    std::string const indexFile = tagsFile + ".idx";
+    WriteFile(tagsFile, MakeNumberedTags(5));
+    auto storage = RepositoryStorage::Create();
+    size_t symbolsLoaded = 0;
+    ASSERT_EQ(LoadSuccess, storage->Load(tagsFile.c_str(), RepositoryType::Regular, symbolsLoaded));
+    auto lookup = [&storage, &tagsFile]() {
+      for (size_t i = 0; i < 100; ++i)
+      {
+        auto selector = storage->GetSelector(tagsFile.c_str(), false, SortingOptions::Default, UnlimitedMaxCount);
+        EXPECT_EQ(1, selector->GetByName(("Name" + std::to_string(i % 5)).c_str()).size());
+        EXPECT_EQ(5, selector->GetByPart("Name", false, true).size());
+        EXPECT_GE(5u, selector->GetCachedTags(false).size());
+      }
+    };
+    std::thread lookups[] = {std::thread(lookup), std::thread(lookup)};
+    std::thread caching([&storage, &tagsFile]() {
+      for (size_t i = 0; i < 100; ++i)
+      {
+        auto tags = storage->GetSelector(tagsFile.c_str(), false, SortingOptions::Default, UnlimitedMaxCount)->GetByName(("Name" + std::to_string(i % 5)).c_str());
+        if (!tags.empty())
+          storage->CacheTag(tags.back(), 5, false);
+
+        storage->SetLastVisited(tagsFile.c_str(), std::to_string(i), false);
+        storage->ResetCacheCounters(tagsFile.c_str(), false);
+      }
+    });
+    for (size_t i = 0; i < 10; ++i)
+    {
+      EXPECT_EQ(LoadSuccess, storage->Load(tagsFile.c_str(), RepositoryType::Regular, symbolsLoaded));
+      storage->LoadAsync(tagsFile.c_str(), RepositoryType::Regular, IndexProgress(), LoadReceiver());
+      EXPECT_EQ(tagsFile, storage->GetInfo(tagsFile.c_str()).TagsPath);
+    }
+
+    caching.join();
+    for (auto& t : lookups)
+      t.join();
+
+    storage.reset();
+    remove(tagsFile.c_str());
+    remove(indexFile.c_str());
+  }
+
   TEST_F(Tags, LoadedPartiallyCoincidentalPathRepos)
   {
     ASSERT_NO_FATAL_FAILURE(TestRepositoryRoot("partially_coincidental_path_repos/a_vs_aa.tags", "D:\\tmp\\repository"));
@@ -1,8 +1,12 @@
 #include <gtest/gtest.h>
 #include <tags_repository.h>
 #include <tags_repository_storage.h>
+#include <tags_selector.h>
+#include <tags_sorting_options.h>
 
+#include <chrono>
 #include <ostream>
+#include <thread>
 
 namespace
 {
@@ -20,7 +24,7 @@ namespace
     {
     }
 
-    int Load(size_t& symbolsLoaded) override
+    int Load(size_t& symbolsLoaded, Tags::IndexProgress const&) override
     {
       return 0;
     }
@@ -46,12 +50,27 @@ namespace
       return GetDirOfFile(TagsFilePath);
     }
 
+    // Repositories with shorter paths answer later, so concurrent queries complete out of order
     std::vector<TagInfo> FindByName(const char* name) const override
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(TagsFilePath.length() < 25 ? 20 : 0));
+      TagInfo tag;
+      tag.name = name;
+      tag.file = TagsFilePath;
+      return {tag};
+    }
+
+    std::vector<TagInfo> FindByName(const char* part, size_t maxCount, size_t maxTotal, bool caseInsensitive, bool useCached, Tags::Internal::LookupRange* range) const override
+    {
+      return std::vector<TagInfo>();
+    }
+
+    std::vector<TagInfo> FindByNameFuzzy(const char* pattern, size_t maxCount) const override
     {
       return std::vector<TagInfo>();
     }
 
-    std::vector<TagInfo> FindByName(const char* part, size_t maxCount, size_t maxTotal, bool caseInsensitive, bool useCached) const override
+    std::vector<TagInfo> FindByNameInfix(const char* part, size_t maxCount) const override
     {
       return std::vector<TagInfo>();
     }
@@ -61,11 +80,15 @@ namespace
       return std::vector<TagInfo>();
     }
 
-    std::vector<TagInfo> FindFiles(const char* part, size_t maxCount, bool useCached) const override
+    std::vector<TagInfo> FindFiles(const char* part, size_t maxCount, bool useCached, Tags::Internal::LookupRange* range) const override
     {
       return std::vector<TagInfo>();
     }
 
+    void FindByPart(const char* part, bool getFiles, size_t maxCount, size_t maxTotal, bool caseInsensitive, bool useCached, Tags::Internal::LookupRange* range, Tags::Internal::TagsReceiver const& receiver) const override
+    {
+    }
+
     std::vector<TagInfo> FindClassMembers(const char* classname) const override
     {
       return std::vector<TagInfo>();
@@ -89,6 +112,24 @@ namespace
       return std::vector<TagInfo>();
     }
 
+    size_t ResidentSize() const override
+    {
+      return 0;
+    }
+
+    bool TagsModified() const override
+    {
+      return false;
+    }
+
+    void ReleaseFiles() override
+    {
+    }
+
+    void PinFiles() override
+    {
+    }
+
     time_t ElapsedSinceCached() const override
     {
       return 0;
@@ -266,6 +307,48 @@ namespace Tags
         ASSERT_EQ(repo, SUT->GetInfo(repo.TagsPath.c_str()));
     }
 
+    TEST_F(RepositoryStorage, SelectsTagsInOrderOfRepositories)
+    {
+      std::string const SubrepositoryFile = RegularSubRepository.Root + "/file.cpp";
+      std::vector<std::string> const expected = {RegularRepository.TagsPath, RegularSubRepository.TagsPath, PermanentRepository.TagsPath};
+      ASSERT_NO_FATAL_FAILURE(LoadRepositories(AllRepositories));
+      auto tags = SUT->GetSelector(SubrepositoryFile.c_str(), false, SortingOptions::Default, 1)->GetByName("name");
+      std::vector<std::string> files;
+      for (auto const& tag : tags)
+        files.push_back(tag.file);
+
+      ASSERT_EQ(expected, files);
+    }
+
+    // Run with -fsanitize=thread to check for data races, see TAGS_SANITIZE_THREAD
+    TEST_F(RepositoryStorage, SelectsTagsWhileRepositoriesAreChanged)
+    {
+      std::string const SubrepositoryFile = RegularSubRepository.Root + "/file.cpp";
+      std::vector<std::string> const expected = {RegularRepository.TagsPath, RegularSubRepository.TagsPath, PermanentRepository.TagsPath};
+      ASSERT_NO_FATAL_FAILURE(LoadRepositories(AllRepositories));
+      std::thread changes([this]() {
+        for (size_t i = 0; i < 20; ++i)
+        {
+          EXPECT_TRUE(LoadRepository(TemporaryRepository));
+          SUT->Remove(TemporaryRepository.TagsPath.c_str());
+          SUT->LoadAsync(TemporaryRepository.TagsPath.c_str(), TemporaryRepository.Type, Tags::IndexProgress(), Tags::LoadReceiver());
+          EXPECT_TRUE(LoadRepository(RegularRepository));
+        }
+      });
+      for (size_t i = 0; i < 20; ++i)
+      {
+        auto tags = SUT->GetSelector(SubrepositoryFile.c_str(), false, SortingOptions::Default, 1)->GetByName("name");
+        std::vector<std::string> files;
+        for (auto const& tag : tags)
+          files.push_back(tag.file);
+
+        EXPECT_EQ(expected, files);
+        EXPECT_EQ((R{RegularRepository, RegularSubRepository}), SUT->GetByType(RepositoryType::Regular));
+      }
+
+      changes.join();
+    }
+
     TEST_F(RepositoryStorage, ReturnsEmptyInfoOfNotExistingRepository)
     {
       ASSERT_NO_FATAL_FAILURE(LoadRepositories(AllRepositories));